@@ -0,0 +1,744 @@
+#ifndef FLAT_COLUMNHIERARCHY_H
+#define FLAT_COLUMNHIERARCHY_H
+
+#include "FlatHierarchy.h"
+#include "HierarchyCache.h"
+
+// Scale + translate propagation over depth search order, the same parent stack walk as test_multiplyTransforms.
+// parentStack holds 4 floats for every depth plus one: entry 0 is the identity for the roots and entry depth + 1
+// is the latest node on depth. Consecutive nodes with the same depth are siblings that share the parent transform,
+// so blocks of 4 (SSE) or 8 (AVX) equal depths are done as one vector block and the nodes between them one by one.
+struct flat_scale_translate_columns
+{
+	const float* inPosX;
+	const float* inPosY;
+	const float* inSizeX;
+	const float* inSizeY;
+	float* outPosX;
+	float* outPosY;
+	float* outSizeX;
+	float* outSizeY;
+};
+
+template<typename DepthType>
+void flat_propagate_scale_translate_scalar(const flat_scale_translate_columns& c, const DepthType* depths, uintptr_t start, uintptr_t end, float* parentStack)
+{
+	const float* inPosX = c.inPosX;
+	const float* inPosY = c.inPosY;
+	const float* inSizeX = c.inSizeX;
+	const float* inSizeY = c.inSizeY;
+	float* outPosX = c.outPosX;
+	float* outPosY = c.outPosY;
+	float* outSizeX = c.outSizeX;
+	float* outSizeY = c.outSizeY;
+
+	for (uintptr_t i = start; i < end; i++)
+	{
+		const float* parent = parentStack + depths[i] * 4;
+		const float posX = parent[0] + parent[2] * inPosX[i];
+		const float posY = parent[1] + parent[3] * inPosY[i];
+		const float sizeX = parent[2] * inSizeX[i];
+		const float sizeY = parent[3] * inSizeY[i];
+
+		outPosX[i] = posX;
+		outPosY[i] = posY;
+		outSizeX[i] = sizeX;
+		outSizeY[i] = sizeY;
+
+		float* top = parentStack + (depths[i] + 1) * 4;
+		top[0] = posX;
+		top[1] = posY;
+		top[2] = sizeX;
+		top[3] = sizeY;
+	}
+}
+
+#if FLAT_USE_SIMD == true
+	// Bit k is set if depths[k] == depths[k + 1], for k in [0, 32)
+	template<typename DepthType>
+	FLAT_TARGET_SSE41 inline uint32_t flat_equal_neighbours_sse41(const DepthType* depths)
+	{
+		enum { Bytes = sizeof(DepthType) }; // Make Bytes an enum to ensure it is used as compile-time constant
+
+		uint32_t mask = 0;
+		for (int k = 0; k < 32; k += 16 / Bytes)
+		{
+			const __m128i a = _mm_loadu_si128((const __m128i*)(depths + k));
+			const __m128i b = _mm_loadu_si128((const __m128i*)(depths + k + 1));
+			if (Bytes == 1)
+				mask |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) << k;
+			else if (Bytes == 2)
+				mask |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(a, b), _mm_setzero_si128())) << k;
+			else
+				mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b))) << k;
+		}
+		return mask;
+	}
+
+	// First index in [start, end) that starts a run of Count equal depths, or end if there is none
+	template<int Count, typename DepthType>
+	FLAT_TARGET_SSE41 uintptr_t flat_find_equal_depths_sse41(const DepthType* depths, uintptr_t start, uintptr_t end)
+	{
+		// A run starts at k if the Count - 1 neighbour pairs from k on are equal. 32 pairs give 34 - Count starts.
+		enum { Starts = 34 - Count };
+
+		uintptr_t i = start;
+		if (sizeof(DepthType) <= 4)
+		{
+			for (; i + 33 <= end; i += Starts)
+			{
+				const uint32_t equal = flat_equal_neighbours_sse41(depths + i);
+				uint32_t runs = equal & ((1U << Starts) - 1);
+				for (int k = 1; k < Count - 1; k++)
+				{
+					runs &= equal >> k;
+				}
+
+				if (runs != 0)
+					return i + flat_trailing_zeros(runs);
+			}
+		}
+
+		for (; i + Count <= end; i++)
+		{
+			int k = 1;
+			while (k < Count && depths[i + k] == depths[i])
+			{
+				++k;
+			}
+			if (k == Count)
+				return i;
+		}
+		return end;
+	}
+
+	template<typename DepthType>
+	FLAT_TARGET_SSE41 void flat_propagate_scale_translate_sse41(const flat_scale_translate_columns& c, const DepthType* depths, uintptr_t count, float* parentStack)
+	{
+		uintptr_t i = 0;
+		while (i < count)
+		{
+			const uintptr_t run = flat_find_equal_depths_sse41<4>(depths, i, count);
+			flat_propagate_scale_translate_scalar(c, depths, i, run, parentStack);
+			if (run == count)
+				break;
+
+			// Siblings share the parent, continue with blocks while the depth stays the same
+			const DepthType depth = depths[run];
+			const float* parent = parentStack + depth * 4;
+			const __m128 posX = _mm_set1_ps(parent[0]);
+			const __m128 posY = _mm_set1_ps(parent[1]);
+			const __m128 sizeX = _mm_set1_ps(parent[2]);
+			const __m128 sizeY = _mm_set1_ps(parent[3]);
+
+			i = run;
+			do
+			{
+				_mm_storeu_ps(c.outPosX + i, _mm_add_ps(posX, _mm_mul_ps(sizeX, _mm_loadu_ps(c.inPosX + i))));
+				_mm_storeu_ps(c.outPosY + i, _mm_add_ps(posY, _mm_mul_ps(sizeY, _mm_loadu_ps(c.inPosY + i))));
+				_mm_storeu_ps(c.outSizeX + i, _mm_mul_ps(sizeX, _mm_loadu_ps(c.inSizeX + i)));
+				_mm_storeu_ps(c.outSizeY + i, _mm_mul_ps(sizeY, _mm_loadu_ps(c.inSizeY + i)));
+				i += 4;
+			} while (i + 4 <= count && depths[i] == depth && depths[i + 3] == depth && depths[i + 1] == depth && depths[i + 2] == depth);
+
+			// Only the last sibling of the run can have children
+			float* top = parentStack + (depth + 1) * 4;
+			top[0] = c.outPosX[i - 1];
+			top[1] = c.outPosY[i - 1];
+			top[2] = c.outSizeX[i - 1];
+			top[3] = c.outSizeY[i - 1];
+		}
+	}
+
+	template<typename DepthType>
+	FLAT_TARGET_AVX2 void flat_propagate_scale_translate_avx2(const flat_scale_translate_columns& c, const DepthType* depths, uintptr_t count, float* parentStack)
+	{
+		uintptr_t i = 0;
+		while (i < count)
+		{
+			const uintptr_t run = flat_find_equal_depths_sse41<8>(depths, i, count);
+			flat_propagate_scale_translate_scalar(c, depths, i, run, parentStack);
+			if (run == count)
+				break;
+
+			// Separate multiply and add, so the results match the scalar version bit for bit
+			const DepthType depth = depths[run];
+			const float* parent = parentStack + depth * 4;
+			const __m256 posX = _mm256_set1_ps(parent[0]);
+			const __m256 posY = _mm256_set1_ps(parent[1]);
+			const __m256 sizeX = _mm256_set1_ps(parent[2]);
+			const __m256 sizeY = _mm256_set1_ps(parent[3]);
+
+			i = run;
+			do
+			{
+				_mm256_storeu_ps(c.outPosX + i, _mm256_add_ps(posX, _mm256_mul_ps(sizeX, _mm256_loadu_ps(c.inPosX + i))));
+				_mm256_storeu_ps(c.outPosY + i, _mm256_add_ps(posY, _mm256_mul_ps(sizeY, _mm256_loadu_ps(c.inPosY + i))));
+				_mm256_storeu_ps(c.outSizeX + i, _mm256_mul_ps(sizeX, _mm256_loadu_ps(c.inSizeX + i)));
+				_mm256_storeu_ps(c.outSizeY + i, _mm256_mul_ps(sizeY, _mm256_loadu_ps(c.inSizeY + i)));
+				i += 8;
+			} while (i + 8 <= count && depths[i] == depth && depths[i + 7] == depth && flat_find_equal_depths_sse41<8>(depths, i, i + 8) == i);
+
+			// Only the last sibling of the run can have children
+			float* top = parentStack + (depth + 1) * 4;
+			top[0] = c.outPosX[i - 1];
+			top[1] = c.outPosY[i - 1];
+			top[2] = c.outSizeX[i - 1];
+			top[3] = c.outSizeY[i - 1];
+		}
+	}
+#endif
+
+template<typename DepthType>
+void flat_propagate_scale_translate(const flat_scale_translate_columns& c, const DepthType* depths, uintptr_t count, float* parentStack)
+{
+	parentStack[0] = 0.0f; // Identity for the roots
+	parentStack[1] = 0.0f;
+	parentStack[2] = 1.0f;
+	parentStack[3] = 1.0f;
+
+#if FLAT_USE_SIMD == true
+	const int level = flat_get_simd_level();
+	if (level >= FLAT_SIMD_AVX2)
+		return flat_propagate_scale_translate_avx2(c, depths, count, parentStack);
+	if (level >= FLAT_SIMD_SSE41)
+		return flat_propagate_scale_translate_sse41(c, depths, count, parentStack);
+#endif
+	flat_propagate_scale_translate_scalar(c, depths, 0, count, parentStack);
+}
+
+
+/////////////////////////////////////////////////////////////////
+//
+// Structure of arrays storage mode for FlatHierarchy
+//
+// Every node has ColumnCount floats and each column is its own
+// array, parallel to depths. A 2D transform (pos.x, pos.y,
+// size.x, size.y) is 4 columns. Kernels then load 4-8 nodes
+// of one column with a single instruction instead of
+// gathering a field out of every value.
+//
+// There is no sorting. New children go first under their
+// parent, same as an unsorted FlatHierarchy.
+//
+/////////////////////////////////////////////////////////////////
+template<int ColumnCount, typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
+class ColumnHierarchy : public FlatHierarchyBase<DepthType, IndexType>
+{
+public:
+	typedef FlatHierarchyBase<DepthType, IndexType> Base;
+	typedef typename Base::SizeType SizeType;
+	typedef typename Base::DepthValue DepthValue;
+	typedef typename Base::HierarchyIndex HierarchyIndex;
+
+	using Base::depths;
+	using Base::getCount;
+	using Base::getMaxDepth;
+	using Base::addDepthCounts;
+	using Base::removeDepthCounts;
+	using Base::onDepthsChanged;
+
+	enum { Columns = ColumnCount };
+
+	FLAT_INDEXED_VECTOR(float, SizeType) columns[ColumnCount];
+
+	ColumnHierarchy(SizeType reserveSize = 0)
+	{
+		depths.reserve(reserveSize);
+		for (int c = 0; c < ColumnCount; c++)
+		{
+			columns[c].reserve(reserveSize);
+		}
+	}
+
+	float* getColumn(int column) { FLAT_ASSERT(column < ColumnCount); return columns[column].getPointer(); }
+	const float* getColumn(int column) const { FLAT_ASSERT(column < ColumnCount); return columns[column].getPointer(); }
+
+	// Copies the ColumnCount floats of index to nodeValues
+	void getValue(HierarchyIndex index, float* nodeValues) const
+	{
+		FLAT_ASSERT(index < getCount());
+		for (int c = 0; c < ColumnCount; c++)
+		{
+			nodeValues[c] = columns[c][index];
+		}
+	}
+	void setValue(HierarchyIndex index, const float* nodeValues)
+	{
+		FLAT_ASSERT(index < getCount());
+		for (int c = 0; c < ColumnCount; c++)
+		{
+			columns[c][index] = nodeValues[c];
+		}
+	}
+
+	// nodeValues holds ColumnCount floats
+	HierarchyIndex createRootNode(const float* nodeValues)
+	{
+		onDepthsChanged();
+
+		const HierarchyIndex newIndex = getCount();
+		depths.pushBack((DepthValue)0U);
+		for (int c = 0; c < ColumnCount; c++)
+		{
+			columns[c].pushBack(nodeValues[c]);
+		}
+		addDepthCounts(newIndex, 1);
+		return newIndex;
+	}
+
+	HierarchyIndex createNodeAsChildOf(HierarchyIndex parentIndex, const float* nodeValues)
+	{
+		FLAT_ASSERT(parentIndex < getCount());
+		onDepthsChanged();
+
+		const HierarchyIndex newIndex = parentIndex + 1;
+		const DepthValue newParentCount = depths[parentIndex] + 1;
+		FLAT_ASSERT(newParentCount < getMaxDepth()); // Over flow protection
+
+		depths.insert(newIndex, newParentCount);
+		for (int c = 0; c < ColumnCount; c++)
+		{
+			columns[c].insert(newIndex, nodeValues[c]);
+		}
+		addDepthCounts(newIndex, 1);
+		return newIndex;
+	}
+
+	HierarchyIndex getLastDescendant(HierarchyIndex parentIndex) const
+	{
+		return (HierarchyIndex)flat_find_not_deeper(depths.getPointer(), parentIndex + 1, getCount(), depths[parentIndex]) - 1;
+	}
+
+	HierarchyIndex makeChildOf(HierarchyIndex child, HierarchyIndex parent)
+	{
+		FLAT_ASSERT(child != parent && "Self-adoption");
+
+		const SizeType count = getLastDescendant(child) - child + 1; // Descendant count including the child
+		FLAT_ASSERT((parent < child || parent > child + count - 1) && "Incest");
+		onDepthsChanged();
+
+		SizeType dest = parent + 1;
+		const DepthValue depthDiff = depths[parent] + 1 - depths[child];
+
+		if (child != dest && child + count != dest)
+		{
+			const SizeType low = child < dest ? child : dest;
+			const SizeType mid = child < dest ? child + count : child;
+			const SizeType high = child < dest ? dest : child + count;
+
+			flat_rotate(depths.getPointer(), low, mid, high);
+			for (int c = 0; c < ColumnCount; c++)
+			{
+				flat_rotate(columns[c].getPointer(), low, mid, high);
+			}
+		}
+
+		if (child < dest)
+			dest -= count;
+
+		removeDepthCounts(dest, count);
+		for (SizeType i = 0; i < count; i++)
+		{
+			depths[dest + i] += depthDiff;
+			FLAT_ASSERT(depths[dest + i] < getMaxDepth() && "Over/Under-flow threat detected"); // Over flow protection
+		}
+		addDepthCounts(dest, count);
+		return dest;
+	}
+
+	void erase(HierarchyIndex child)
+	{
+		onDepthsChanged();
+
+		const SizeType count = getLastDescendant(child) - child + 1;
+		removeDepthCounts(child, count);
+
+		const SizeType toShift = getCount() - (child + count);
+		FLAT_MEMMOVE(depths.getPointer() + child, depths.getPointer() + child + count, toShift * sizeof(DepthValue));
+		depths.resize(depths.getSize() - count);
+		for (int c = 0; c < ColumnCount; c++)
+		{
+			FLAT_MEMMOVE(columns[c].getPointer() + child, columns[c].getPointer() + child + count, toShift * sizeof(float));
+			columns[c].resize(columns[c].getSize() - count);
+		}
+	}
+
+	// Replaces the content with a FlatHierarchy. Splitter::split(const ValueType&, float* nodeValues) writes the columns of one value.
+	template<typename Splitter, typename ValueType, typename Sorter>
+	void copyFrom(const FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h)
+	{
+		onDepthsChanged();
+
+		const SizeType count = h.getCount();
+		depths.resize(count);
+		FLAT_MEMCPY(depths.getPointer(), h.depths.getPointer(), count * sizeof(DepthValue));
+		for (int c = 0; c < ColumnCount; c++)
+		{
+			columns[c].resize(count);
+		}
+
+		float nodeValues[ColumnCount];
+		for (HierarchyIndex i = 0; i < count; i++)
+		{
+			Splitter::split(h.values[i], nodeValues);
+			setValue(i, nodeValues);
+		}
+
+		if (this->depthCountsEnabled)
+			this->enableDepthCounts(true);
+	}
+
+	// World transforms of 2D scale + translate nodes. Columns 0-3 are pos.x, pos.y, size.x and size.y, relative to the parent.
+	// Writes world = (parent.pos + parent.size * pos, parent.size * size) to the first 4 columns of result. Roots are copied.
+	template<int ResultColumnCount>
+	void propagateScaleTranslate(ColumnHierarchy<ResultColumnCount, DepthType, IndexType>& result)
+	{
+		static_assert(ColumnCount >= 4 && ResultColumnCount >= 4, "Scale + translate needs 4 columns");
+
+		result.onDepthsChanged();
+
+		const SizeType count = getCount();
+		result.depths.resize(count);
+		FLAT_MEMCPY(result.depths.getPointer(), depths.getPointer(), count * sizeof(DepthValue));
+		for (int c = 0; c < ResultColumnCount; c++)
+		{
+			result.columns[c].resize(count);
+		}
+
+		// World transform of the latest node on every depth
+		parentStack.resize(((SizeType)this->findMaxDepth() + 2) * 4);
+
+		flat_scale_translate_columns c;
+		c.inPosX = getColumn(0);
+		c.inPosY = getColumn(1);
+		c.inSizeX = getColumn(2);
+		c.inSizeY = getColumn(3);
+		c.outPosX = result.getColumn(0);
+		c.outPosY = result.getColumn(1);
+		c.outSizeX = result.getColumn(2);
+		c.outSizeY = result.getColumn(3);
+		flat_propagate_scale_translate(c, depths.getPointer(), count, parentStack.getPointer());
+
+		if (result.depthCountsEnabled)
+			result.enableDepthCounts(true);
+	}
+
+private:
+	FLAT_INDEXED_VECTOR(float, SizeType) parentStack;
+};
+
+
+// Axis aligned rect, also the union of the rects of a subtree. RectBoundsOp is the ReduceUpCache Op that unions the subtree.
+struct RectBounds
+{
+	float minX;
+	float minY;
+	float maxX;
+	float maxY;
+};
+
+struct RectBoundsOp
+{
+	inline static RectBounds leaf(const RectBounds& rect)
+	{
+		return rect;
+	}
+	inline static RectBounds combine(const RectBounds& a, const RectBounds& b)
+	{
+		RectBounds result;
+		result.minX = a.minX < b.minX ? a.minX : b.minX;
+		result.minY = a.minY < b.minY ? a.minY : b.minY;
+		result.maxX = a.maxX > b.maxX ? a.maxX : b.maxX;
+		result.maxY = a.maxY > b.maxY ? a.maxY : b.maxY;
+		return result;
+	}
+};
+
+// Point hit test over depth search order. bounds is the union of the own rect and the bounds of every descendant, so a
+// point outside the bounds of a node is outside its whole subtree too, and the subtree is skipped with lastDescendants.
+// The result is the deepest node whose own rect holds the point, the later one in depth search order on a tie,
+// or count if there is none.
+struct flat_hit_test_rects
+{
+	const RectBounds* bounds;
+	const RectBounds* rects;
+};
+
+inline bool flat_rect_holds(const RectBounds& r, float x, float y)
+{
+	return x >= r.minX && x <= r.maxX && y >= r.minY && y <= r.maxY;
+}
+
+// Continues a hit test from start, hit is the best node so far or count
+template<typename DepthType, typename IndexType>
+void flat_hit_test_scalar(const flat_hit_test_rects& c, const DepthType* depths, const IndexType* lastDescendants, uintptr_t start, uintptr_t count, float x, float y, uintptr_t& hit)
+{
+	uintptr_t i = start;
+	while (i < count)
+	{
+		if (!flat_rect_holds(c.bounds[i], x, y))
+		{
+			i = lastDescendants[i] + 1;
+			continue;
+		}
+
+		if (flat_rect_holds(c.rects[i], x, y) && (hit == count || depths[i] >= depths[hit]))
+			hit = i;
+		++i;
+	}
+}
+
+#if FLAT_USE_SIMD == true
+	// Lane k is set if rects[k] holds (px, py), for k in [0, 4). The rects are transposed to minX, minY, maxX and maxY registers.
+	FLAT_TARGET_SSE41 inline uint32_t flat_rects_holding_sse41(const RectBounds* rects, __m128 px, __m128 py)
+	{
+		__m128 minX = _mm_loadu_ps(&rects[0].minX);
+		__m128 minY = _mm_loadu_ps(&rects[1].minX);
+		__m128 maxX = _mm_loadu_ps(&rects[2].minX);
+		__m128 maxY = _mm_loadu_ps(&rects[3].minX);
+		_MM_TRANSPOSE4_PS(minX, minY, maxX, maxY);
+
+		const __m128 inX = _mm_and_ps(_mm_cmple_ps(minX, px), _mm_cmple_ps(px, maxX));
+		const __m128 inY = _mm_and_ps(_mm_cmple_ps(minY, py), _mm_cmple_ps(py, maxY));
+		return (uint32_t)_mm_movemask_ps(_mm_and_ps(inX, inY));
+	}
+
+	// Same for 8 rects, the low 128 bit lane holds rects 0-3 and the high one rects 4-7
+	FLAT_TARGET_AVX2 inline uint32_t flat_rects_holding_avx2(const RectBounds* rects, __m256 px, __m256 py)
+	{
+		const __m256 r0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&rects[0].minX)), _mm_loadu_ps(&rects[4].minX), 1);
+		const __m256 r1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&rects[1].minX)), _mm_loadu_ps(&rects[5].minX), 1);
+		const __m256 r2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&rects[2].minX)), _mm_loadu_ps(&rects[6].minX), 1);
+		const __m256 r3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&rects[3].minX)), _mm_loadu_ps(&rects[7].minX), 1);
+
+		// 4x4 transpose inside both lanes, like _MM_TRANSPOSE4_PS
+		const __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+		const __m256 t1 = _mm256_unpacklo_ps(r2, r3);
+		const __m256 t2 = _mm256_unpackhi_ps(r0, r1);
+		const __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+		const __m256 minX = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+		const __m256 minY = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+		const __m256 maxX = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+		const __m256 maxY = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2));
+
+		const __m256 inX = _mm256_and_ps(_mm256_cmp_ps(minX, px, _CMP_LE_OQ), _mm256_cmp_ps(px, maxX, _CMP_LE_OQ));
+		const __m256 inY = _mm256_and_ps(_mm256_cmp_ps(minY, py, _CMP_LE_OQ), _mm256_cmp_ps(py, maxY, _CMP_LE_OQ));
+		return (uint32_t)_mm256_movemask_ps(_mm256_and_ps(inX, inY));
+	}
+
+	// Tests blocks of 4 consecutive nodes, which are mostly sibling runs. A node in the block can only be a descendant of
+	// a node that failed before it if it fails too, so every node that passes is visited and the block is never undone.
+	// The next block starts past the furthest subtree of the nodes that failed.
+	template<typename DepthType, typename IndexType>
+	FLAT_TARGET_SSE41 uintptr_t flat_hit_test_sse41(const flat_hit_test_rects& c, const DepthType* depths, const IndexType* lastDescendants, uintptr_t count, float x, float y)
+	{
+		const __m128 px = _mm_set1_ps(x);
+		const __m128 py = _mm_set1_ps(y);
+
+		uintptr_t hit = count;
+		uintptr_t i = 0;
+		while (i + 4 <= count)
+		{
+			const uint32_t inBounds = flat_rects_holding_sse41(c.bounds + i, px, py);
+			if (inBounds != 0)
+			{
+				uint32_t hits = inBounds & flat_rects_holding_sse41(c.rects + i, px, py);
+				while (hits != 0)
+				{
+					const uintptr_t k = i + flat_trailing_zeros(hits);
+					if (hit == count || depths[k] >= depths[hit])
+						hit = k;
+					hits &= hits - 1;
+				}
+			}
+
+			uintptr_t next = i + 4;
+			uint32_t outside = ~inBounds & 0xf;
+			while (outside != 0)
+			{
+				const uintptr_t end = (uintptr_t)lastDescendants[i + flat_trailing_zeros(outside)] + 1;
+				next = end > next ? end : next;
+				outside &= outside - 1;
+			}
+			i = next;
+		}
+
+		flat_hit_test_scalar(c, depths, lastDescendants, i, count, x, y, hit);
+		return hit;
+	}
+
+	template<typename DepthType, typename IndexType>
+	FLAT_TARGET_AVX2 uintptr_t flat_hit_test_avx2(const flat_hit_test_rects& c, const DepthType* depths, const IndexType* lastDescendants, uintptr_t count, float x, float y)
+	{
+		const __m256 px = _mm256_set1_ps(x);
+		const __m256 py = _mm256_set1_ps(y);
+
+		uintptr_t hit = count;
+		uintptr_t i = 0;
+		while (i + 8 <= count)
+		{
+			const uint32_t inBounds = flat_rects_holding_avx2(c.bounds + i, px, py);
+			if (inBounds != 0)
+			{
+				uint32_t hits = inBounds & flat_rects_holding_avx2(c.rects + i, px, py);
+				while (hits != 0)
+				{
+					const uintptr_t k = i + flat_trailing_zeros(hits);
+					if (hit == count || depths[k] >= depths[hit])
+						hit = k;
+					hits &= hits - 1;
+				}
+			}
+
+			uintptr_t next = i + 8;
+			uint32_t outside = ~inBounds & 0xff;
+			while (outside != 0)
+			{
+				const uintptr_t end = (uintptr_t)lastDescendants[i + flat_trailing_zeros(outside)] + 1;
+				next = end > next ? end : next;
+				outside &= outside - 1;
+			}
+			i = next;
+		}
+
+		flat_hit_test_scalar(c, depths, lastDescendants, i, count, x, y, hit);
+		return hit;
+	}
+#endif
+
+template<typename DepthType, typename IndexType>
+uintptr_t flat_hit_test(const flat_hit_test_rects& c, const DepthType* depths, const IndexType* lastDescendants, uintptr_t count, float x, float y)
+{
+#if FLAT_USE_SIMD == true
+	const int level = flat_get_simd_level();
+	if (level >= FLAT_SIMD_AVX2)
+		return flat_hit_test_avx2(c, depths, lastDescendants, count, x, y);
+	if (level >= FLAT_SIMD_SSE41)
+		return flat_hit_test_sse41(c, depths, lastDescendants, count, x, y);
+#endif
+	uintptr_t hit = count;
+	flat_hit_test_scalar(c, depths, lastDescendants, 0, count, x, y, hit);
+	return hit;
+}
+
+
+/////////////////////////////////////////////////////////////////
+//
+// Point hit test index for 2D rects
+//
+// The world rect of every node, built from world transforms
+// (pos.x, pos.y, size.x, size.y) with non negative sizes.
+// The subtree bounds are a ReduceUpCache with RectBoundsOp
+// and the subtrees are skipped with a LastDescendantCache.
+// hitTest() finds the deepest node whose rect holds a point,
+// for example the widget under the mouse. When world
+// transforms change, set them with setRect() and call update()
+// before the next hitTest(), only the changed subtrees and
+// their ancestors are reduced again. Structural changes of the
+// hierarchy need build().
+//
+/////////////////////////////////////////////////////////////////
+template<typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
+struct RectHitIndex
+{
+	typedef FlatHierarchyBase<DepthType, IndexType> Hierarchy;
+	typedef typename Hierarchy::SizeType SizeType;
+	typedef typename Hierarchy::DepthValue DepthValue;
+	typedef typename Hierarchy::HierarchyIndex HierarchyIndex;
+
+	FLAT_INDEXED_VECTOR(RectBounds, SizeType) rects;
+	ReduceUpCache<RectBoundsOp, RectBounds, DepthType, IndexType> boundsCache;
+	LastDescendantCache<DepthType, IndexType> descendantCache;
+
+	SizeType getCount() const { return rects.getSize(); }
+
+	// world[i] is the world transform of node i, Splitter::split(const ValueType&, float* nodeValues) writes pos.x, pos.y, size.x and size.y
+	template<typename Splitter, typename ValueType>
+	void build(const Hierarchy& h, const ValueType* world)
+	{
+		rects.resize(h.getCount());
+
+		float nodeValues[4];
+		for (HierarchyIndex i = 0; i < h.getCount(); i++)
+		{
+			Splitter::split(world[i], nodeValues);
+			writeRect(i, nodeValues[0], nodeValues[1], nodeValues[2], nodeValues[3]);
+		}
+		makeCachesValid(h);
+	}
+
+	// Columns 0-3 of world are pos.x, pos.y, size.x and size.y, as written by ColumnHierarchy::propagateScaleTranslate()
+	template<int WorldColumnCount>
+	void build(const ColumnHierarchy<WorldColumnCount, DepthType, IndexType>& world)
+	{
+		static_assert(WorldColumnCount >= 4, "Rects need 4 columns");
+
+		rects.resize(world.getCount());
+		for (HierarchyIndex i = 0; i < world.getCount(); i++)
+		{
+			writeRect(i, world.columns[0][i], world.columns[1][i], world.columns[2][i], world.columns[3][i]);
+		}
+		makeCachesValid(world);
+	}
+
+	// O(1). The new world transform of index, the bounds are updated by update().
+	void setRect(HierarchyIndex index, float posX, float posY, float sizeX, float sizeY)
+	{
+		FLAT_ASSERT(index < getCount());
+		writeRect(index, posX, posY, sizeX, sizeY);
+		boundsCache.markDirty(index);
+	}
+
+	// Reduces the bounds of the subtrees that hold changed rects again. Returns the number of visited nodes.
+	SizeType update(const Hierarchy& h)
+	{
+		return boundsCache.update(h, rects.getPointer(), descendantCache);
+	}
+
+	// Deepest node whose rect holds (x, y), edges included, or getIndexNotFound(). Overlapping nodes on the same depth
+	// resolve to the later one in depth search order, the one drawn on top. Call update() after setRect() first.
+	HierarchyIndex hitTest(const Hierarchy& h, float x, float y) const
+	{
+		const SizeType count = getCount();
+		FLAT_ASSERT(h.getCount() == count && boundsCache.cacheValues.getSize() == count);
+
+		flat_hit_test_rects c;
+		c.bounds = boundsCache.cacheValues.getPointer();
+		c.rects = rects.getPointer();
+
+		const uintptr_t hit = flat_hit_test(c, h.depths.getPointer(), descendantCache.cacheValues.getPointer(), count, x, y);
+#ifdef _DEBUG
+		{ // Correctness check
+			uintptr_t check = count;
+			for (SizeType i = 0; i < count; i++)
+			{
+				if (flat_rect_holds(rects[i], x, y) && (check == count || h.depths[i] >= h.depths[check]))
+					check = i;
+			}
+			FLAT_ASSERT(check == hit);
+		}
+#endif
+		return hit == count ? Hierarchy::getIndexNotFound() : (HierarchyIndex)hit;
+	}
+
+private:
+	void makeCachesValid(const Hierarchy& h)
+	{
+		descendantCache.makeCacheValid(h);
+		boundsCache.makeCacheValid(h, rects.getPointer());
+	}
+
+	void writeRect(HierarchyIndex index, float posX, float posY, float sizeX, float sizeY)
+	{
+		FLAT_ASSERT(sizeX >= 0.0f && sizeY >= 0.0f);
+		RectBounds& rect = rects[index];
+		rect.minX = posX;
+		rect.minY = posY;
+		rect.maxX = posX + sizeX;
+		rect.maxY = posY + sizeY;
+	}
+};
+
+
+#endif
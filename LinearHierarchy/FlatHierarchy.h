@@ -105,14 +105,14 @@ static_assert(sizeof(uintptr_t) == sizeof(void*), "uintptr_t isn't actually poin
 	#endif
 #else
 	#ifndef FLAT_MEMCPY
-		inline void flat_memcpy_impl(char* dst, const char* src, uint32_t length)
+		inline void flat_memcpy_impl(char* dst, const char* src, uintptr_t length)
 		{
 			FLAT_ASSERT(dst != 0);
 			FLAT_ASSERT(src != 0);
 			FLAT_ASSERT(src != dst);
 			FLAT_ASSERT(dst + length <= src || src + length <= dst);
 
-			for (uint32_t i = 0; i < length; i++)
+			for (uintptr_t i = 0; i < length; i++)
 			{
 				dst[i] = src[i];
 			}
@@ -121,7 +121,7 @@ static_assert(sizeof(uintptr_t) == sizeof(void*), "uintptr_t isn't actually poin
 	#endif
 
 	#ifndef FLAT_MEMMOVE
-		inline void flat_memmove_impl(char* dst, const char* src, uint32_t length)
+		inline void flat_memmove_impl(char* dst, const char* src, uintptr_t length)
 		{
 			FLAT_ASSERT(dst != 0);
 			FLAT_ASSERT(src != 0);
@@ -134,14 +134,14 @@ static_assert(sizeof(uintptr_t) == sizeof(void*), "uintptr_t isn't actually poin
 			}
 			else if(dst < src)
 			{
-				for (uint32_t i = 0; i < length; i++)
+				for (uintptr_t i = 0; i < length; i++)
 				{
 					dst[i] = src[i];
 				}
 			}
 			else
 			{
-				for (uint32_t i = length; i-- > 0;)
+				for (uintptr_t i = length; i-- > 0;)
 				{
 					dst[i] = src[i];
 				}
@@ -167,8 +167,845 @@ static_assert(sizeof(uintptr_t) == sizeof(void*), "uintptr_t isn't actually poin
 	#endif
 #endif
 
-#define FLAT_SIZETYPE uint32_t
-#define FLAT_DEPTHTYPE uint16_t
+// Depth kernels. findMaxDepth() and findMinDepthBetween() reduce the depth array with the widest instruction set the CPU has:
+// SSE4.1 (+ POPCNT), AVX2 (+ BMI2) or AVX-512 (F + BW), or a scalar loop. The level is read with CPUID when the first FlatHierarchyBase is
+// constructed. The wider kernels are compiled with per-function target attributes, so no compiler switches are needed.
+enum FlatSimdLevel
+{
+	FLAT_SIMD_SCALAR = 0,
+	FLAT_SIMD_SSE41 = 1,
+	FLAT_SIMD_AVX2 = 2,
+	FLAT_SIMD_AVX512 = 3
+};
+
+#if FLAT_USE_SIMD == true
+	#ifdef _MSC_VER
+		#include <intrin.h> // __cpuidex, _xgetbv
+		#define FLAT_TARGET_SSE41
+		#define FLAT_TARGET_AVX2
+		#define FLAT_TARGET_AVX512
+	#else
+		#include <cpuid.h> // __cpuid_count
+		#define FLAT_TARGET_SSE41 __attribute__((target("sse4.1,popcnt")))
+		#define FLAT_TARGET_AVX2 __attribute__((target("avx2,bmi,bmi2,popcnt")))
+		#define FLAT_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,bmi,bmi2,popcnt")))
+	#endif
+
+	inline void flat_cpuid(int info[4], int leaf, int subLeaf)
+	{
+	#ifdef _MSC_VER
+		__cpuidex(info, leaf, subLeaf);
+	#else
+		unsigned int a, b, c, d;
+		__cpuid_count(leaf, subLeaf, a, b, c, d);
+		info[0] = (int)a;
+		info[1] = (int)b;
+		info[2] = (int)c;
+		info[3] = (int)d;
+	#endif
+	}
+
+	// Register state the OS saves on context switches (XCR0)
+	inline uint64_t flat_xgetbv()
+	{
+	#ifdef _MSC_VER
+		return _xgetbv(0);
+	#else
+		unsigned int a, d;
+		__asm__ volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+		return ((uint64_t)d << 32) | a;
+	#endif
+	}
+
+	inline int flat_detect_simd_level()
+	{
+		int info[4];
+		flat_cpuid(info, 0, 0);
+		const int maxLeaf = info[0];
+
+		flat_cpuid(info, 1, 0);
+		if ((info[2] & (1 << 19)) == 0 || (info[2] & (1 << 23)) == 0) // SSE4.1 and POPCNT
+			return FLAT_SIMD_SCALAR;
+
+		const bool osSavesYmm = (info[2] & (1 << 27)) != 0 && (flat_xgetbv() & 0x6) == 0x6; // OSXSAVE, XMM and YMM state
+		if (!osSavesYmm || (info[2] & (1 << 28)) == 0 || maxLeaf < 7) // AVX
+			return FLAT_SIMD_SSE41;
+
+		flat_cpuid(info, 7, 0);
+		if ((info[1] & (1 << 5)) == 0 || (info[1] & (1 << 3)) == 0 || (info[1] & (1 << 8)) == 0) // AVX2, BMI1 and BMI2
+			return FLAT_SIMD_SSE41;
+
+		const bool osSavesZmm = (flat_xgetbv() & 0xE6) == 0xE6; // Opmask and ZMM state
+		if (!osSavesZmm || (info[1] & (1 << 16)) == 0 || (info[1] & (1 << 30)) == 0) // AVX-512 F and BW
+			return FLAT_SIMD_AVX2;
+
+		return FLAT_SIMD_AVX512;
+	}
+#else
+	inline int flat_detect_simd_level()
+	{
+		return FLAT_SIMD_SCALAR;
+	}
+#endif
+
+inline int& flat_simd_level_storage()
+{
+	static int level = -1;
+	return level;
+}
+
+inline int flat_get_simd_level()
+{
+	int& level = flat_simd_level_storage();
+	if (level < 0)
+		level = flat_detect_simd_level();
+	return level;
+}
+
+// Lowers the kernel level, for example to compare the kernels. Levels the CPU doesn't support fall back to the detected one.
+inline void flat_set_simd_level(int level)
+{
+	const int detected = flat_detect_simd_level();
+	flat_simd_level_storage() = level < detected ? level : detected;
+}
+
+// Minimum or maximum of result and count depths
+template<bool IsMax, typename DepthType>
+DepthType flat_reduce_depths_scalar(const DepthType* data, uintptr_t count, DepthType result)
+{
+	for (uintptr_t i = 0; i < count; i++)
+	{
+		if (IsMax ? result < data[i] : data[i] < result)
+			result = data[i];
+	}
+	return result;
+}
+
+#if FLAT_USE_SIMD == true
+	template<bool IsMax, int Bytes>
+	FLAT_TARGET_SSE41 inline __m128i flat_minmax_sse41(__m128i a, __m128i b)
+	{
+		if (Bytes == 1) return IsMax ? _mm_max_epu8(a, b) : _mm_min_epu8(a, b);
+		if (Bytes == 2) return IsMax ? _mm_max_epu16(a, b) : _mm_min_epu16(a, b);
+		return IsMax ? _mm_max_epu32(a, b) : _mm_min_epu32(a, b);
+	}
+
+	template<bool IsMax, int Bytes>
+	FLAT_TARGET_SSE41 inline uint32_t flat_horizontal_sse41(__m128i v)
+	{
+		// Shift and compare the lanes down to the lowest one
+		v = flat_minmax_sse41<IsMax, Bytes>(v, _mm_srli_si128(v, 8));
+		v = flat_minmax_sse41<IsMax, Bytes>(v, _mm_srli_si128(v, 4));
+		if (Bytes <= 2) v = flat_minmax_sse41<IsMax, Bytes>(v, _mm_srli_si128(v, 2));
+		if (Bytes == 1) v = flat_minmax_sse41<IsMax, Bytes>(v, _mm_srli_si128(v, 1));
+
+		const uint32_t lowest = (uint32_t)_mm_cvtsi128_si32(v);
+		return Bytes == 1 ? (lowest & 0xFF) : Bytes == 2 ? (lowest & 0xFFFF) : lowest;
+	}
+
+	template<bool IsMax, typename DepthType>
+	FLAT_TARGET_SSE41 DepthType flat_reduce_depths_sse41(const DepthType* data, uintptr_t count, DepthType result)
+	{
+		enum { Bytes = sizeof(DepthType), Lanes = 16 / sizeof(DepthType) }; // Enums to ensure these are used as compile-time constants
+
+		__m128i acc0 = Bytes == 1 ? _mm_set1_epi8((char)result) : Bytes == 2 ? _mm_set1_epi16((short)result) : _mm_set1_epi32((int)result);
+		__m128i acc1 = acc0;
+		__m128i acc2 = acc0;
+		__m128i acc3 = acc0;
+
+		uintptr_t i = 0;
+		for (; i + 4 * Lanes <= count; i += 4 * Lanes)
+		{
+			acc0 = flat_minmax_sse41<IsMax, Bytes>(acc0, _mm_loadu_si128((const __m128i*)(data + i) + 0));
+			acc1 = flat_minmax_sse41<IsMax, Bytes>(acc1, _mm_loadu_si128((const __m128i*)(data + i) + 1));
+			acc2 = flat_minmax_sse41<IsMax, Bytes>(acc2, _mm_loadu_si128((const __m128i*)(data + i) + 2));
+			acc3 = flat_minmax_sse41<IsMax, Bytes>(acc3, _mm_loadu_si128((const __m128i*)(data + i) + 3));
+		}
+		for (; i + Lanes <= count; i += Lanes)
+		{
+			acc0 = flat_minmax_sse41<IsMax, Bytes>(acc0, _mm_loadu_si128((const __m128i*)(data + i)));
+		}
+
+		acc0 = flat_minmax_sse41<IsMax, Bytes>(flat_minmax_sse41<IsMax, Bytes>(acc0, acc1), flat_minmax_sse41<IsMax, Bytes>(acc2, acc3));
+		result = (DepthType)flat_horizontal_sse41<IsMax, Bytes>(acc0);
+
+		return flat_reduce_depths_scalar<IsMax>(data + i, count - i, result);
+	}
+
+	template<bool IsMax, int Bytes>
+	FLAT_TARGET_AVX2 inline __m256i flat_minmax_avx2(__m256i a, __m256i b)
+	{
+		if (Bytes == 1) return IsMax ? _mm256_max_epu8(a, b) : _mm256_min_epu8(a, b);
+		if (Bytes == 2) return IsMax ? _mm256_max_epu16(a, b) : _mm256_min_epu16(a, b);
+		return IsMax ? _mm256_max_epu32(a, b) : _mm256_min_epu32(a, b);
+	}
+
+	template<bool IsMax, typename DepthType>
+	FLAT_TARGET_AVX2 DepthType flat_reduce_depths_avx2(const DepthType* data, uintptr_t count, DepthType result)
+	{
+		enum { Bytes = sizeof(DepthType), Lanes = 32 / sizeof(DepthType) }; // Enums to ensure these are used as compile-time constants
+
+		__m256i acc0 = Bytes == 1 ? _mm256_set1_epi8((char)result) : Bytes == 2 ? _mm256_set1_epi16((short)result) : _mm256_set1_epi32((int)result);
+		__m256i acc1 = acc0;
+		__m256i acc2 = acc0;
+		__m256i acc3 = acc0;
+
+		uintptr_t i = 0;
+		for (; i + 4 * Lanes <= count; i += 4 * Lanes)
+		{
+			acc0 = flat_minmax_avx2<IsMax, Bytes>(acc0, _mm256_loadu_si256((const __m256i*)(data + i) + 0));
+			acc1 = flat_minmax_avx2<IsMax, Bytes>(acc1, _mm256_loadu_si256((const __m256i*)(data + i) + 1));
+			acc2 = flat_minmax_avx2<IsMax, Bytes>(acc2, _mm256_loadu_si256((const __m256i*)(data + i) + 2));
+			acc3 = flat_minmax_avx2<IsMax, Bytes>(acc3, _mm256_loadu_si256((const __m256i*)(data + i) + 3));
+		}
+		for (; i + Lanes <= count; i += Lanes)
+		{
+			acc0 = flat_minmax_avx2<IsMax, Bytes>(acc0, _mm256_loadu_si256((const __m256i*)(data + i)));
+		}
+
+		acc0 = flat_minmax_avx2<IsMax, Bytes>(flat_minmax_avx2<IsMax, Bytes>(acc0, acc1), flat_minmax_avx2<IsMax, Bytes>(acc2, acc3));
+		const __m128i half = flat_minmax_sse41<IsMax, Bytes>(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+		result = (DepthType)flat_horizontal_sse41<IsMax, Bytes>(half);
+
+		return flat_reduce_depths_scalar<IsMax>(data + i, count - i, result);
+	}
+
+	template<bool IsMax, int Bytes>
+	FLAT_TARGET_AVX512 inline __m512i flat_minmax_avx512(__m512i a, __m512i b)
+	{
+		if (Bytes == 1) return IsMax ? _mm512_max_epu8(a, b) : _mm512_min_epu8(a, b);
+		if (Bytes == 2) return IsMax ? _mm512_max_epu16(a, b) : _mm512_min_epu16(a, b);
+		return IsMax ? _mm512_max_epu32(a, b) : _mm512_min_epu32(a, b);
+	}
+
+	template<bool IsMax, typename DepthType>
+	FLAT_TARGET_AVX512 DepthType flat_reduce_depths_avx512(const DepthType* data, uintptr_t count, DepthType result)
+	{
+		enum { Bytes = sizeof(DepthType), Lanes = 64 / sizeof(DepthType) }; // Enums to ensure these are used as compile-time constants
+
+		__m512i acc0 = Bytes == 1 ? _mm512_set1_epi8((char)result) : Bytes == 2 ? _mm512_set1_epi16((short)result) : _mm512_set1_epi32((int)result);
+		__m512i acc1 = acc0;
+		__m512i acc2 = acc0;
+		__m512i acc3 = acc0;
+
+		uintptr_t i = 0;
+		for (; i + 4 * Lanes <= count; i += 4 * Lanes)
+		{
+			acc0 = flat_minmax_avx512<IsMax, Bytes>(acc0, _mm512_loadu_si512((const __m512i*)(data + i) + 0));
+			acc1 = flat_minmax_avx512<IsMax, Bytes>(acc1, _mm512_loadu_si512((const __m512i*)(data + i) + 1));
+			acc2 = flat_minmax_avx512<IsMax, Bytes>(acc2, _mm512_loadu_si512((const __m512i*)(data + i) + 2));
+			acc3 = flat_minmax_avx512<IsMax, Bytes>(acc3, _mm512_loadu_si512((const __m512i*)(data + i) + 3));
+		}
+		for (; i + Lanes <= count; i += Lanes)
+		{
+			acc0 = flat_minmax_avx512<IsMax, Bytes>(acc0, _mm512_loadu_si512((const __m512i*)(data + i)));
+		}
+
+		acc0 = flat_minmax_avx512<IsMax, Bytes>(flat_minmax_avx512<IsMax, Bytes>(acc0, acc1), flat_minmax_avx512<IsMax, Bytes>(acc2, acc3));
+		const __m256i quarter = flat_minmax_avx2<IsMax, Bytes>(_mm512_castsi512_si256(acc0), _mm512_extracti64x4_epi64(acc0, 1));
+		const __m128i half = flat_minmax_sse41<IsMax, Bytes>(_mm256_castsi256_si128(quarter), _mm256_extracti128_si256(quarter, 1));
+		result = (DepthType)flat_horizontal_sse41<IsMax, Bytes>(half);
+
+		return flat_reduce_depths_scalar<IsMax>(data + i, count - i, result);
+	}
+#endif
+
+// Picks the kernel for the detected level. Depths wider than 4 bytes use the scalar loop.
+template<bool IsMax, typename DepthType>
+DepthType flat_reduce_depths(const DepthType* data, uintptr_t count, DepthType result)
+{
+#if FLAT_USE_SIMD == true
+	enum { Bytes = sizeof(DepthType) }; // Make Bytes an enum to ensure it is used as compile-time constant
+
+	if (Bytes == 1 || Bytes == 2 || Bytes == 4)
+	{
+		switch (flat_get_simd_level())
+		{
+		case FLAT_SIMD_AVX512:
+			return flat_reduce_depths_avx512<IsMax>(data, count, result);
+		case FLAT_SIMD_AVX2:
+			return flat_reduce_depths_avx2<IsMax>(data, count, result);
+		case FLAT_SIMD_SSE41:
+			return flat_reduce_depths_sse41<IsMax>(data, count, result);
+		default:
+			break;
+		}
+	}
+#endif
+	return flat_reduce_depths_scalar<IsMax>(data, count, result);
+}
+
+// Index of the first depth in [start, end) that is not deeper than depth, or end. This is the subtree end search
+// of getLastDescendant(). The kernels compare a whole register of depths at a time and pick the first hit from the
+// compare mask. The signed compares are fine because depths stay below getMaxDepth().
+template<typename DepthType>
+uintptr_t flat_find_not_deeper_scalar(const DepthType* data, uintptr_t start, uintptr_t end, DepthType depth)
+{
+	while (start < end && data[start] > depth)
+	{
+		++start;
+	}
+	return start;
+}
+
+inline uint32_t flat_trailing_zeros(uint64_t v)
+{
+	FLAT_ASSERT(v != 0);
+#if FLAT_USE_SIMD == true && defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, v);
+	return (uint32_t)index;
+#elif defined(__GNUC__)
+	return (uint32_t)__builtin_ctzll(v);
+#else
+	uint32_t index = 0;
+	while ((v & 1) == 0)
+	{
+		v >>= 1;
+		++index;
+	}
+	return index;
+#endif
+}
+
+// POPCNT only inside the FLAT_TARGET_* kernels or behind the level check, the SSE4.1 level implies it
+inline uint32_t flat_popcount64(uint64_t v)
+{
+#if defined(__GNUC__)
+	return (uint32_t)__builtin_popcountll(v); // POPCNT if the whole build targets it, a bit trick otherwise
+#else
+#if FLAT_USE_SIMD == true
+	if (flat_get_simd_level() >= FLAT_SIMD_SSE41)
+		return (uint32_t)_mm_popcnt_u64(v);
+#endif
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (uint32_t)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Index of the highest set bit
+inline uint32_t flat_floor_log2(uint32_t v)
+{
+	FLAT_ASSERT(v != 0);
+#if FLAT_USE_SIMD == true && defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse(&index, v);
+	return (uint32_t)index;
+#elif defined(__GNUC__)
+	return 31U - (uint32_t)__builtin_clz(v);
+#else
+	uint32_t index = 0;
+	while (v >>= 1)
+	{
+		++index;
+	}
+	return index;
+#endif
+}
+
+#if FLAT_USE_SIMD == true
+	template<typename DepthType>
+	FLAT_TARGET_SSE41 uintptr_t flat_find_not_deeper_sse41(const DepthType* data, uintptr_t start, uintptr_t end, DepthType depth)
+	{
+		enum { Bytes = sizeof(DepthType), Lanes = 16 / sizeof(DepthType) }; // Enums to ensure these are used as compile-time constants
+
+		const __m128i limit = Bytes == 1 ? _mm_set1_epi8((char)depth) : Bytes == 2 ? _mm_set1_epi16((short)depth) : _mm_set1_epi32((int)depth);
+		for (; start + Lanes <= end; start += Lanes)
+		{
+			const __m128i in = _mm_loadu_si128((const __m128i*)(data + start));
+			__m128i deeper;
+			if (Bytes == 1) deeper = _mm_cmpgt_epi8(in, limit);
+			else if (Bytes == 2) deeper = _mm_cmpgt_epi16(in, limit);
+			else deeper = _mm_cmpgt_epi32(in, limit);
+
+			const uint32_t hits = ~(uint32_t)_mm_movemask_epi8(deeper) & 0xFFFF;
+			if (hits != 0)
+				return start + flat_trailing_zeros(hits) / Bytes;
+		}
+		return flat_find_not_deeper_scalar(data, start, end, depth);
+	}
+
+	template<typename DepthType>
+	FLAT_TARGET_AVX2 uintptr_t flat_find_not_deeper_avx2(const DepthType* data, uintptr_t start, uintptr_t end, DepthType depth)
+	{
+		enum { Bytes = sizeof(DepthType), Lanes = 32 / sizeof(DepthType) }; // Enums to ensure these are used as compile-time constants
+
+		const __m256i limit = Bytes == 1 ? _mm256_set1_epi8((char)depth) : Bytes == 2 ? _mm256_set1_epi16((short)depth) : _mm256_set1_epi32((int)depth);
+		for (; start + Lanes <= end; start += Lanes)
+		{
+			const __m256i in = _mm256_loadu_si256((const __m256i*)(data + start));
+			__m256i deeper;
+			if (Bytes == 1) deeper = _mm256_cmpgt_epi8(in, limit);
+			else if (Bytes == 2) deeper = _mm256_cmpgt_epi16(in, limit);
+			else deeper = _mm256_cmpgt_epi32(in, limit);
+
+			const uint32_t hits = ~(uint32_t)_mm256_movemask_epi8(deeper);
+			if (hits != 0)
+				return start + flat_trailing_zeros(hits) / Bytes;
+		}
+		return flat_find_not_deeper_sse41(data, start, end, depth);
+	}
+
+	template<typename DepthType>
+	FLAT_TARGET_AVX512 uintptr_t flat_find_not_deeper_avx512(const DepthType* data, uintptr_t start, uintptr_t end, DepthType depth)
+	{
+		enum { Bytes = sizeof(DepthType), Lanes = 64 / sizeof(DepthType) }; // Enums to ensure these are used as compile-time constants
+
+		const __m512i limit = Bytes == 1 ? _mm512_set1_epi8((char)depth) : Bytes == 2 ? _mm512_set1_epi16((short)depth) : _mm512_set1_epi32((int)depth);
+		for (; start + Lanes <= end; start += Lanes)
+		{
+			const __m512i in = _mm512_loadu_si512((const __m512i*)(data + start));
+			uint64_t hits;
+			if (Bytes == 1) hits = (uint64_t)_mm512_cmple_epu8_mask(in, limit);
+			else if (Bytes == 2) hits = (uint64_t)_mm512_cmple_epu16_mask(in, limit);
+			else hits = (uint64_t)_mm512_cmple_epu32_mask(in, limit);
+
+			if (hits != 0)
+				return start + flat_trailing_zeros(hits);
+		}
+		return flat_find_not_deeper_avx2(data, start, end, depth);
+	}
+#endif
+
+template<typename DepthType>
+uintptr_t flat_find_not_deeper(const DepthType* data, uintptr_t start, uintptr_t end, DepthType depth)
+{
+	// Leaves are the common case, answer them before paying for the kernel setup
+	if (start >= end || data[start] <= depth)
+		return start;
+
+#if FLAT_USE_SIMD == true
+	enum { Bytes = sizeof(DepthType) }; // Make Bytes an enum to ensure it is used as compile-time constant
+
+	if (Bytes == 1 || Bytes == 2 || Bytes == 4)
+	{
+		switch (flat_get_simd_level())
+		{
+		case FLAT_SIMD_AVX512:
+			return flat_find_not_deeper_avx512(data, start + 1, end, depth);
+		case FLAT_SIMD_AVX2:
+			return flat_find_not_deeper_avx2(data, start + 1, end, depth);
+		case FLAT_SIMD_SSE41:
+			return flat_find_not_deeper_sse41(data, start + 1, end, depth);
+		default:
+			break;
+		}
+	}
+#endif
+	return flat_find_not_deeper_scalar(data, start + 1, end, depth);
+}
+
+// Direct child scan from start: depths equal to depth are children, the first depth below it ends the parent's subtree.
+// Returns the index of child n (0 based) or, when there are not that many, the subtree end and adds the children seen
+// to childCount. The kernels compare a register of depths at a time, popcount the children before the subtree end
+// and select child n from the mask (pdep + tzcnt where BMI2 is available).
+template<typename DepthType>
+uintptr_t flat_scan_children_scalar(const DepthType* data, uintptr_t start, uintptr_t end, DepthType depth, uintptr_t n, uintptr_t* childCount)
+{
+	for (; start < end && data[start] >= depth; ++start)
+	{
+		if (data[start] == depth)
+		{
+			if (n == 0)
+				return start;
+			--n;
+			++*childCount;
+		}
+	}
+	return start;
+}
+
+#if FLAT_USE_SIMD == true
+	// One block of the child scan. equal and below have Shift mask bits per depth and only the lowest one is set.
+	// Returns true when the scan ends in this block, with the answer in result.
+	template<int Shift>
+	FLAT_TARGET_SSE41 inline bool flat_scan_children_block_sse41(uint64_t equal, uint64_t below, uintptr_t blockStart, uintptr_t& n, uintptr_t* childCount, uintptr_t& result)
+	{
+		if (below != 0)
+			equal &= ((uint64_t)1 << flat_trailing_zeros(below)) - 1; // Only children before the subtree end
+
+		const uintptr_t found = (uintptr_t)_mm_popcnt_u64(equal);
+		if (n < found)
+		{
+			for (uintptr_t i = 0; i < n; i++)
+			{
+				equal &= equal - 1;
+			}
+			result = blockStart + flat_trailing_zeros(equal) / Shift;
+			return true;
+		}
+		n -= found;
+		*childCount += found;
+
+		if (below != 0)
+		{
+			result = blockStart + flat_trailing_zeros(below) / Shift;
+			return true;
+		}
+		return false;
+	}
+
+	// Same with pdep selecting child n
+	template<int Shift>
+	FLAT_TARGET_AVX2 inline bool flat_scan_children_block_bmi2(uint64_t equal, uint64_t below, uintptr_t blockStart, uintptr_t& n, uintptr_t* childCount, uintptr_t& result)
+	{
+		if (below != 0)
+			equal &= ((uint64_t)1 << flat_trailing_zeros(below)) - 1; // Only children before the subtree end
+
+		const uintptr_t found = (uintptr_t)_mm_popcnt_u64(equal);
+		if (n < found)
+		{
+			result = blockStart + flat_trailing_zeros(_pdep_u64((uint64_t)1 << n, equal)) / Shift;
+			return true;
+		}
+		n -= found;
+		*childCount += found;
+
+		if (below != 0)
+		{
+			result = blockStart + flat_trailing_zeros(below) / Shift;
+			return true;
+		}
+		return false;
+	}
+
+	template<typename DepthType>
+	FLAT_TARGET_SSE41 uintptr_t flat_scan_children_sse41(const DepthType* data, uintptr_t start, uintptr_t end, DepthType depth, uintptr_t n, uintptr_t* childCount)
+	{
+		enum { Bytes = sizeof(DepthType), Lanes = 16 / sizeof(DepthType) }; // Enums to ensure these are used as compile-time constants
+		const uint64_t laneBits = Bytes == 1 ? 0xFFFF : Bytes == 2 ? 0x5555 : 0x1111;
+
+		const __m128i target = Bytes == 1 ? _mm_set1_epi8((char)depth) : Bytes == 2 ? _mm_set1_epi16((short)depth) : _mm_set1_epi32((int)depth);
+		for (; start + Lanes <= end; start += Lanes)
+		{
+			const __m128i in = _mm_loadu_si128((const __m128i*)(data + start));
+			__m128i equal, below;
+			if (Bytes == 1) { equal = _mm_cmpeq_epi8(in, target); below = _mm_cmpgt_epi8(target, in); }
+			else if (Bytes == 2) { equal = _mm_cmpeq_epi16(in, target); below = _mm_cmpgt_epi16(target, in); }
+			else { equal = _mm_cmpeq_epi32(in, target); below = _mm_cmpgt_epi32(target, in); }
+
+			uintptr_t result;
+			if (flat_scan_children_block_sse41<Bytes>((uint64_t)_mm_movemask_epi8(equal) & laneBits, (uint64_t)_mm_movemask_epi8(below) & laneBits, start, n, childCount, result))
+				return result;
+		}
+		return flat_scan_children_scalar(data, start, end, depth, n, childCount);
+	}
+
+	template<typename DepthType>
+	FLAT_TARGET_AVX2 uintptr_t flat_scan_children_avx2(const DepthType* data, uintptr_t start, uintptr_t end, DepthType depth, uintptr_t n, uintptr_t* childCount)
+	{
+		enum { Bytes = sizeof(DepthType), Lanes = 32 / sizeof(DepthType) }; // Enums to ensure these are used as compile-time constants
+		const uint64_t laneBits = Bytes == 1 ? 0xFFFFFFFF : Bytes == 2 ? 0x55555555 : 0x11111111;
+
+		const __m256i target = Bytes == 1 ? _mm256_set1_epi8((char)depth) : Bytes == 2 ? _mm256_set1_epi16((short)depth) : _mm256_set1_epi32((int)depth);
+		for (; start + Lanes <= end; start += Lanes)
+		{
+			const __m256i in = _mm256_loadu_si256((const __m256i*)(data + start));
+			__m256i equal, below;
+			if (Bytes == 1) { equal = _mm256_cmpeq_epi8(in, target); below = _mm256_cmpgt_epi8(target, in); }
+			else if (Bytes == 2) { equal = _mm256_cmpeq_epi16(in, target); below = _mm256_cmpgt_epi16(target, in); }
+			else { equal = _mm256_cmpeq_epi32(in, target); below = _mm256_cmpgt_epi32(target, in); }
+
+			uintptr_t result;
+			if (flat_scan_children_block_bmi2<Bytes>((uint32_t)_mm256_movemask_epi8(equal) & laneBits, (uint32_t)_mm256_movemask_epi8(below) & laneBits, start, n, childCount, result))
+				return result;
+		}
+		return flat_scan_children_scalar(data, start, end, depth, n, childCount);
+	}
+
+	template<typename DepthType>
+	FLAT_TARGET_AVX512 uintptr_t flat_scan_children_avx512(const DepthType* data, uintptr_t start, uintptr_t end, DepthType depth, uintptr_t n, uintptr_t* childCount)
+	{
+		enum { Bytes = sizeof(DepthType), Lanes = 64 / sizeof(DepthType) }; // Enums to ensure these are used as compile-time constants
+
+		const __m512i target = Bytes == 1 ? _mm512_set1_epi8((char)depth) : Bytes == 2 ? _mm512_set1_epi16((short)depth) : _mm512_set1_epi32((int)depth);
+		for (; start + Lanes <= end; start += Lanes)
+		{
+			const __m512i in = _mm512_loadu_si512((const __m512i*)(data + start));
+			uint64_t equal, below;
+			if (Bytes == 1) { equal = _mm512_cmpeq_epu8_mask(in, target); below = _mm512_cmplt_epu8_mask(in, target); }
+			else if (Bytes == 2) { equal = _mm512_cmpeq_epu16_mask(in, target); below = _mm512_cmplt_epu16_mask(in, target); }
+			else { equal = _mm512_cmpeq_epu32_mask(in, target); below = _mm512_cmplt_epu32_mask(in, target); }
+
+			uintptr_t result;
+			if (flat_scan_children_block_bmi2<1>(equal, below, start, n, childCount, result))
+				return result;
+		}
+		return flat_scan_children_avx2(data, start, end, depth, n, childCount);
+	}
+#endif
+
+template<typename DepthType>
+uintptr_t flat_scan_children(const DepthType* data, uintptr_t start, uintptr_t end, DepthType depth, uintptr_t n, uintptr_t* childCount)
+{
+	// Leaves are the common case, answer them before paying for the kernel setup
+	if (start >= end || data[start] < depth)
+		return start;
+
+#if FLAT_USE_SIMD == true
+	enum { Bytes = sizeof(DepthType) }; // Make Bytes an enum to ensure it is used as compile-time constant
+
+	if (Bytes == 1 || Bytes == 2 || Bytes == 4)
+	{
+		switch (flat_get_simd_level())
+		{
+		case FLAT_SIMD_AVX512:
+			return flat_scan_children_avx512(data, start, end, depth, n, childCount);
+		case FLAT_SIMD_AVX2:
+			return flat_scan_children_avx2(data, start, end, depth, n, childCount);
+		case FLAT_SIMD_SSE41:
+			return flat_scan_children_sse41(data, start, end, depth, n, childCount);
+		default:
+			break;
+		}
+	}
+#endif
+	return flat_scan_children_scalar(data, start, end, depth, n, childCount);
+}
+
+// results[i] = first < indices[i] <= last. Returns how many are inside. The loop has no branches, so compilers vectorise it.
+template<typename IndexType>
+IndexType flat_check_intervals(IndexType first, IndexType last, const IndexType* indices, IndexType indexCount, bool* results)
+{
+	IndexType inside = 0;
+	for (IndexType i = 0; i < indexCount; i++)
+	{
+		const bool result = IndexType(indices[i] - first - 1) < IndexType(last - first); // Unsigned wrap rejects indices[i] <= first
+		results[i] = result;
+		inside += result;
+	}
+	return inside;
+}
+
+// Parallel loops. FLAT_PARALLEL_FOR(jobCount, function, context) runs function(context, jobIndex) for every jobIndex
+// in [0, jobCount) and returns when all of them are done. Jobs must not write to the same memory.
+// Define FLAT_PARALLEL_FOR to run the jobs on your own job system, or define FLAT_USE_THREADS as true to spread them
+// over a pool of one OS thread per core. By default the jobs run one after another on the calling thread.
+#ifndef FLAT_USE_THREADS
+	#define FLAT_USE_THREADS false
+#endif
+
+#ifndef FLAT_MAX_THREADS
+	#define FLAT_MAX_THREADS 64
+#endif
+
+typedef void (*FlatJobFunction)(void* context, uint32_t jobIndex);
+
+inline void flat_serial_for_impl(uint32_t jobCount, FlatJobFunction function, void* context)
+{
+	for (uint32_t i = 0; i < jobCount; i++)
+	{
+		function(context, i);
+	}
+}
+
+#ifndef FLAT_PARALLEL_FOR
+#if FLAT_USE_THREADS == true
+	#if FLAT_ALLOW_INCLUDES == true
+		#ifdef _WIN32
+			#include <windows.h>  // CreateThread, InterlockedIncrement, CRITICAL_SECTION, CONDITION_VARIABLE, GetSystemInfo
+		#else
+			#include <pthread.h>  // pthread_create, pthread_mutex_t, pthread_cond_t
+			#include <unistd.h>   // sysconf
+		#endif
+	#else
+		#error "Cannot use threads without includes. Define FLAT_ALLOW_INCLUDES as true or define FLAT_PARALLEL_FOR"
+	#endif
+
+	#ifdef _WIN32
+		typedef CRITICAL_SECTION flat_mutex;
+		typedef CONDITION_VARIABLE flat_condition;
+		inline void flat_mutex_init(flat_mutex* m) { InitializeCriticalSection(m); }
+		inline void flat_mutex_lock(flat_mutex* m) { EnterCriticalSection(m); }
+		inline bool flat_mutex_try_lock(flat_mutex* m) { return TryEnterCriticalSection(m) != 0; }
+		inline void flat_mutex_unlock(flat_mutex* m) { LeaveCriticalSection(m); }
+		inline void flat_condition_init(flat_condition* c) { InitializeConditionVariable(c); }
+		inline void flat_condition_wait(flat_condition* c, flat_mutex* m) { SleepConditionVariableCS(c, m, INFINITE); }
+		inline void flat_condition_broadcast(flat_condition* c) { WakeAllConditionVariable(c); }
+	#else
+		typedef pthread_mutex_t flat_mutex;
+		typedef pthread_cond_t flat_condition;
+		inline void flat_mutex_init(flat_mutex* m) { pthread_mutex_init(m, NULL); }
+		inline void flat_mutex_lock(flat_mutex* m) { pthread_mutex_lock(m); }
+		inline bool flat_mutex_try_lock(flat_mutex* m) { return pthread_mutex_trylock(m) == 0; }
+		inline void flat_mutex_unlock(flat_mutex* m) { pthread_mutex_unlock(m); }
+		inline void flat_condition_init(flat_condition* c) { pthread_cond_init(c, NULL); }
+		inline void flat_condition_wait(flat_condition* c, flat_mutex* m) { pthread_cond_wait(c, m); }
+		inline void flat_condition_broadcast(flat_condition* c) { pthread_cond_broadcast(c); }
+	#endif
+
+	struct flat_parallel_for_state
+	{
+		FlatJobFunction function;
+		void* context;
+		uint32_t jobCount;
+		volatile long nextJob;
+	};
+
+	// Workers pull job indices from a shared counter until they run out
+	inline void flat_parallel_for_worker(flat_parallel_for_state* state)
+	{
+		for (;;)
+		{
+	#ifdef _WIN32
+			const uint32_t job = (uint32_t)(InterlockedIncrement(&state->nextJob) - 1);
+	#else
+			const uint32_t job = (uint32_t)__sync_fetch_and_add(&state->nextJob, 1);
+	#endif
+			if (job >= state->jobCount)
+				return;
+			state->function(state->context, job);
+		}
+	}
+
+	// The worker threads are started on the first parallel loop and wait for the next one until the process exits.
+	// A loop bumps generation, every worker runs the loop once and counts itself in finished.
+	struct flat_thread_pool
+	{
+		flat_mutex lock;         // Guards state, generation and finished
+		flat_condition wake;     // Workers wait here for the next generation
+		flat_condition done;     // The calling thread waits here for finished to reach workerCount
+		flat_mutex callLock;     // One loop at a time. Nested and concurrent loops run serially on their own thread.
+		flat_parallel_for_state* state;
+		uint32_t generation;
+		uint32_t finished;
+		uint32_t workerCount;
+	};
+
+	inline void flat_thread_pool_run(flat_thread_pool* pool)
+	{
+		uint32_t seen = 0;
+		flat_mutex_lock(&pool->lock);
+		for (;;)
+		{
+			while (pool->generation == seen)
+			{
+				flat_condition_wait(&pool->wake, &pool->lock);
+			}
+			seen = pool->generation;
+			flat_parallel_for_state* state = pool->state;
+			flat_mutex_unlock(&pool->lock);
+
+			flat_parallel_for_worker(state);
+
+			flat_mutex_lock(&pool->lock);
+			if (++pool->finished == pool->workerCount)
+				flat_condition_broadcast(&pool->done);
+		}
+	}
+
+	#ifdef _WIN32
+	inline DWORD WINAPI flat_thread_pool_thread(LPVOID pool)
+	{
+		flat_thread_pool_run((flat_thread_pool*)pool);
+		return 0;
+	}
+	#else
+	inline void* flat_thread_pool_thread(void* pool)
+	{
+		flat_thread_pool_run((flat_thread_pool*)pool);
+		return NULL;
+	}
+	#endif
+
+	inline bool flat_start_thread_pool(flat_thread_pool* pool)
+	{
+	#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		uint32_t threadCount = (uint32_t)info.dwNumberOfProcessors;
+	#else
+		uint32_t threadCount = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+	#endif
+		if (threadCount > FLAT_MAX_THREADS)
+			threadCount = FLAT_MAX_THREADS;
+
+		flat_mutex_init(&pool->lock);
+		flat_mutex_init(&pool->callLock);
+		flat_condition_init(&pool->wake);
+		flat_condition_init(&pool->done);
+		pool->state = NULL;
+		pool->generation = 0;
+		pool->finished = 0;
+		pool->workerCount = 0;
+
+		// The calling thread is the first worker of every loop
+		for (uint32_t i = 1; i < threadCount; i++)
+		{
+	#ifdef _WIN32
+			HANDLE thread = CreateThread(NULL, 0, flat_thread_pool_thread, pool, 0, NULL);
+			if (thread == NULL)
+				break;
+			CloseHandle(thread);
+	#else
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, flat_thread_pool_thread, pool) != 0)
+				break;
+			pthread_detach(thread);
+	#endif
+			++pool->workerCount;
+		}
+		return true;
+	}
+
+	inline flat_thread_pool* flat_get_thread_pool()
+	{
+		// No destructor, the workers may still be waiting on it while the process exits
+		static flat_thread_pool pool;
+		static const bool started = flat_start_thread_pool(&pool);
+		(void)started;
+		return &pool;
+	}
+
+	inline void flat_parallel_for_impl(uint32_t jobCount, FlatJobFunction function, void* context)
+	{
+		flat_thread_pool* pool = jobCount > 1 ? flat_get_thread_pool() : NULL;
+		if (pool == NULL || pool->workerCount == 0 || !flat_mutex_try_lock(&pool->callLock))
+		{
+			flat_serial_for_impl(jobCount, function, context);
+			return;
+		}
+
+		flat_parallel_for_state state;
+		state.function = function;
+		state.context = context;
+		state.jobCount = jobCount;
+		state.nextJob = 0;
+
+		flat_mutex_lock(&pool->lock);
+		pool->state = &state;
+		pool->finished = 0;
+		++pool->generation;
+		flat_condition_broadcast(&pool->wake);
+		flat_mutex_unlock(&pool->lock);
+
+		flat_parallel_for_worker(&state);
+
+		// state lives on this stack, so every worker has to be done with it
+		flat_mutex_lock(&pool->lock);
+		while (pool->finished < pool->workerCount)
+		{
+			flat_condition_wait(&pool->done, &pool->lock);
+		}
+		flat_mutex_unlock(&pool->lock);
+		flat_mutex_unlock(&pool->callLock);
+	}
+
+	#define FLAT_PARALLEL_FOR(jobCount, function, context) flat_parallel_for_impl(jobCount, function, context)
+#else
+	#define FLAT_PARALLEL_FOR(jobCount, function, context) flat_serial_for_impl(jobCount, function, context)
+#endif
+#endif
+
+// Default index and depth types. FlatHierarchy and the caches take them as template parameters.
+#ifndef FLAT_SIZETYPE
+	#define FLAT_SIZETYPE uint32_t
+#endif
+#ifndef FLAT_DEPTHTYPE
+	#define FLAT_DEPTHTYPE uint16_t
+#endif
 
 #ifndef FLAT_ALLOC
 #ifdef _WIN32
@@ -185,13 +1022,13 @@ static_assert(sizeof(uintptr_t) == sizeof(void*), "uintptr_t isn't actually poin
 #endif
 
 #ifndef FLAT_VECTOR
-	template<typename ValueType>
+	template<typename ValueType, typename Size = uint32_t>
 	class flat_vector_impl
 	{
 		flat_vector_impl(const flat_vector_impl&) { } // private move constructor to avoid mistakes
 		void operator=(const flat_vector_impl&) { }   // private move assignment to avoid mistakes
 	public:
-		typedef uint32_t SizeType;
+		typedef Size SizeType;
 
 		flat_vector_impl()
 			: buffer(nullptr)
@@ -223,7 +1060,7 @@ static_assert(sizeof(uintptr_t) == sizeof(void*), "uintptr_t isn't actually poin
 
 		void clear() { size = 0; }
 		void resize(SizeType newSize) { FLAT_ASSERT(newSize < ((SizeType)(~0) >> 1)); reserve(newSize); size = newSize; }
-		ValueType operator[] (SizeType index) const { FLAT_ASSERT(index < size); return buffer[index]; }
+		const ValueType& operator[] (SizeType index) const { FLAT_ASSERT(index < size); return buffer[index]; }
 		ValueType& operator[] (SizeType index) { FLAT_ASSERT(index < size); return buffer[index]; }
 
 		void reserve(SizeType capacity)
@@ -306,192 +1143,332 @@ static_assert(sizeof(uintptr_t) == sizeof(void*), "uintptr_t isn't actually poin
 	};
 	
 	#define FLAT_VECTOR flat_vector_impl
+	#define FLAT_INDEXED_VECTOR(ValueType, IndexType) flat_vector_impl<ValueType, IndexType>
 #endif
 
-/////////////////////////////////////////////////////////////////
-//
-// Base implementation containing only a depths-vector
-// Mostly used by cache structures to determine node relations
-//
-/////////////////////////////////////////////////////////////////
-class FlatHierarchyBase
-{
-public:
-	typedef FLAT_SIZETYPE SizeType;
-	typedef FLAT_DEPTHTYPE DepthValue;
-	typedef SizeType HierarchyIndex;
-
-	FLAT_VECTOR<DepthValue> depths;
+#ifndef FLAT_INDEXED_VECTOR
+	// Vector that can hold as many elements as IndexType can address. Custom vectors use their own size type.
+	#define FLAT_INDEXED_VECTOR(ValueType, IndexType) FLAT_VECTOR<ValueType>
+#endif
 
+#ifndef FLAT_ROTATE_BUFFER_SIZE
+	#define FLAT_ROTATE_BUFFER_SIZE 4096
+#endif
 
+// Swaps two non-overlapping byte ranges of equal length through a stack buffer
+inline void flat_swap_bytes_impl(char* a, char* b, uintptr_t length)
+{
+	FLAT_ASSERT(a + length <= b || b + length <= a);
 
-	SizeType getCount() const
+	char buffer[FLAT_ROTATE_BUFFER_SIZE];
+	while (length > 0)
 	{
-		return depths.getSize();
+		const uintptr_t chunk = length < FLAT_ROTATE_BUFFER_SIZE ? length : FLAT_ROTATE_BUFFER_SIZE;
+		FLAT_MEMCPY(buffer, a, chunk);
+		FLAT_MEMCPY(a, b, chunk);
+		FLAT_MEMCPY(b, buffer, chunk);
+		a += chunk;
+		b += chunk;
+		length -= chunk;
 	}
+}
 
+// Rotates [first, last) so that the element at middle becomes the first one. Doesn't allocate.
+// When the shorter side fits the stack buffer it is parked there while the longer side is shifted with one memmove.
+// Otherwise equal length blocks are swapped (Gries-Mills) until the shorter side fits.
+template<typename T, typename IndexType>
+void flat_rotate(T* data, IndexType first, IndexType middle, IndexType last)
+{
+	FLAT_ASSERT(first <= middle && middle <= last);
 
+	char* base = (char*)data;
+	IndexType left = middle - first;
+	IndexType right = last - middle;
+	IndexType split = middle;
 
-	__declspec(noinline)
-		DepthValue findMaxDepth() const
+	while (left > 0 && right > 0)
 	{
-		DepthValue result = 0;
-#if FLAT_USE_SIMD == false
-		for (HierarchyIndex i = 0; i < getCount(); i++)
+		if (left * sizeof(T) <= FLAT_ROTATE_BUFFER_SIZE || right * sizeof(T) <= FLAT_ROTATE_BUFFER_SIZE)
 		{
-			if (depths[i] > result)
-				result = depths[i];
+			char buffer[FLAT_ROTATE_BUFFER_SIZE];
+			char* start = base + (split - left) * sizeof(T);
+			char* end = base + (split + right) * sizeof(T);
+			if (left <= right)
+			{
+				FLAT_MEMCPY(buffer, start, left * sizeof(T));
+				FLAT_MEMMOVE(start, start + left * sizeof(T), right * sizeof(T));
+				FLAT_MEMCPY(end - left * sizeof(T), buffer, left * sizeof(T));
+			}
+			else
+			{
+				FLAT_MEMCPY(buffer, end - right * sizeof(T), right * sizeof(T));
+				FLAT_MEMMOVE(start + right * sizeof(T), start, left * sizeof(T));
+				FLAT_MEMCPY(start, buffer, right * sizeof(T));
+			}
+			return;
 		}
-		return result;
-#else
-		enum { Bytes = sizeof(DepthValue) }; // Make Bytes an enum to ensure it is used as compile-time constant
-		static_assert(Bytes == 1 || Bytes == 2 || Bytes == 4 || Bytes > 4, "Byte count mismatch");
 
-		if (Bytes <= 4) // DepthValue == uint8_t / uint16_t / uint32_t
+		if (left > right)
 		{
-			FLAT_ASSERT(Bytes == 1 || Bytes == 2 || Bytes == 4);
-
-			SizeType bytesLeft = getCount() * Bytes;
-			const uint8_t* data = (const uint8_t*)depths.getPointer();
-
-			FLAT_ASSERT((((uintptr_t)data) & 0xF) == 0);
+			// Swap the right side with the end of the left side, leaving a shorter left side to rotate
+			flat_swap_bytes_impl(base + (split - right) * sizeof(T), base + split * sizeof(T), right * sizeof(T));
+			split -= right;
+			left -= right;
+		}
+		else
+		{
+			// Swap the left side with the start of the right side, leaving a shorter right side to rotate
+			flat_swap_bytes_impl(base + (split - left) * sizeof(T), base + split * sizeof(T), left * sizeof(T));
+			split += left;
+			right -= left;
+		}
+	}
+}
 
-			while (bytesLeft > 0 && (((uintptr_t)data) & 0xF) != 0)
-			{
-				if (result < *data)
-					result = *data;
-				data += Bytes;
-				bytesLeft -= Bytes;
-			}
+// Room for an ancestor on depth in a stack of the latest index on every depth. Depths grow by at most one from node to node,
+// so the scans call this when a node is deeper than any before it instead of finding the max depth first.
+template<typename StackType, typename DepthType>
+inline void flat_grow_ancestor_stack(StackType& stack, DepthType depth)
+{
+	if (stack.getSize() <= depth)
+		stack.resize(((uintptr_t)depth + 1) * 2);
+}
+
+// FlatHierarchy::reduceUp() over count depths, shared with the caches that keep the results. stack is the latest index on every
+// depth, it grows on demand and can be kept between calls. out[i] starts as Op::leaf(in[i]) and every direct child is folded in
+// with Op::combine() in child order, once the walk leaves the subtree of the child.
+template<typename Op, typename DepthType, typename IndexType, typename InType, typename OutType, typename StackType>
+void flat_reduce_up(const DepthType* depths, IndexType count, const InType* in, OutType* out, StackType& ancestors)
+{
+	if (count == 0)
+		return;
 
-			FLAT_ASSERT((((uintptr_t)data) & 0xF) == 0);
+	DepthType openDepth = depths[0];
+	flat_grow_ancestor_stack(ancestors, openDepth);
+	IndexType* stack = ancestors.getPointer();
+	uintptr_t stackSize = ancestors.getSize();
 
-			__m128i res = _mm_setzero_si128();
-			__m128i max0 = _mm_setzero_si128();
-			__m128i max1 = _mm_setzero_si128();
-			__m128i max2 = _mm_setzero_si128();
-			__m128i max3 = _mm_setzero_si128();
+	out[0] = Op::leaf(in[0]);
+	stack[openDepth] = 0;
 
-			while (bytesLeft >= 64)
-			{
-				__m128i in0 = _mm_load_si128((const __m128i*)data + 0);
-				__m128i in1 = _mm_load_si128((const __m128i*)data + 1);
-				__m128i in2 = _mm_load_si128((const __m128i*)data + 2);
-				__m128i in3 = _mm_load_si128((const __m128i*)data + 3);
+	for (IndexType i = 1; i <= count; i++)
+	{
+		// Fold the open nodes that do not contain i to their parents, deepest first. Past the end everything is folded.
+		const DepthType depth = i < count ? depths[i] : 0;
+		for (DepthType d = openDepth; d >= depth && d > 0; --d)
+		{
+			out[stack[d - 1]] = Op::combine(out[stack[d - 1]], out[stack[d]]);
+		}
 
-				if (Bytes == 1) max0 = _mm_max_epu8(max0, in0);
-				if (Bytes == 1) max1 = _mm_max_epu8(max1, in1);
-				if (Bytes == 1) max2 = _mm_max_epu8(max2, in2);
-				if (Bytes == 1) max3 = _mm_max_epu8(max3, in3);
+		if (i == count)
+			break;
 
-				if (Bytes == 2) max0 = _mm_max_epu16(max0, in0);
-				if (Bytes == 2) max1 = _mm_max_epu16(max1, in1);
-				if (Bytes == 2) max2 = _mm_max_epu16(max2, in2);
-				if (Bytes == 2) max3 = _mm_max_epu16(max3, in3);
+		if (depth >= stackSize)
+		{
+			flat_grow_ancestor_stack(ancestors, depth);
+			stack = ancestors.getPointer();
+			stackSize = ancestors.getSize();
+		}
+		out[i] = Op::leaf(in[i]);
+		stack[depth] = i;
+		openDepth = depth;
+	}
+}
 
-				if (Bytes == 4) max0 = _mm_max_epu32(max0, in0);
-				if (Bytes == 4) max1 = _mm_max_epu32(max1, in1);
-				if (Bytes == 4) max2 = _mm_max_epu32(max2, in2);
-				if (Bytes == 4) max3 = _mm_max_epu32(max3, in3);
+/////////////////////////////////////////////////////////////////
+//
+// Base implementation containing only a depths-vector
+// Mostly used by cache structures to determine node relations
+//
+/////////////////////////////////////////////////////////////////
+template<typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
+class FlatHierarchyBase
+{
+	static_assert(DepthType(~DepthType(0)) > DepthType(0), "DepthType must be unsigned");
+	static_assert(IndexType(~IndexType(0)) > IndexType(0), "IndexType must be unsigned");
+public:
+	typedef IndexType SizeType;
+	typedef DepthType DepthValue;
+	typedef SizeType HierarchyIndex;
 
-				data += 64;
-				bytesLeft -= 64;
-			}
+	FLAT_INDEXED_VECTOR(DepthValue, SizeType) depths;
+
+	// Optional node count per depth, which makes findMaxDepth() and countNodesAtDepth() O(1).
+	// FlatHierarchy and the cached free functions keep it up to date while it is enabled. Code that edits depths
+	// directly has to call removeDepthCounts() before and addDepthCounts() after the edit, or onDepthsChanged() if it
+	// does not keep the counts. PackedHierarchy does not keep it.
+	FLAT_INDEXED_VECTOR(SizeType, SizeType) depthCounts;
+	DepthValue trackedMaxDepth;
+	bool depthCountsEnabled;
+
+	// Optional range minimum index over depths, which makes findMinDepthBetween() and lowestCommonAncestor() O(1).
+	// A sparse table over blocks of DepthRangeBlockSize nodes, the blocks at both ends of a query are scanned.
+	// Every writer of depths calls onDepthsChanged(), which invalidates it, and the queries fall back to the linear
+	// kernels until makeDepthRangeIndexValid().
+	enum { DepthRangeBlockSize = 32 };
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) depthRangeTable;   // Level k holds the first shallowest node of 2^k blocks from every block
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) depthRangeParents; // Parent of every node, getIndexNotFound() for the roots
+	bool depthRangeIndexEnabled;
+	bool depthRangeIndexValid;
+
+	FlatHierarchyBase()
+		: trackedMaxDepth(0)
+		, depthCountsEnabled(false)
+		, depthRangeIndexEnabled(false)
+		, depthRangeIndexValid(false)
+	{
+		flat_get_simd_level(); // Detect the depth kernels on the first construction
+	}
 
-			if (bytesLeft >= 48)
-			{
-				__m128i in0 = _mm_load_si128((const __m128i*)data + 0);
-				__m128i in1 = _mm_load_si128((const __m128i*)data + 1);
-				__m128i in2 = _mm_load_si128((const __m128i*)data + 2);
+	SizeType getCount() const
+	{
+		return depths.getSize();
+	}
 
-				if (Bytes == 1) max0 = _mm_max_epu8(max0, in0);
-				if (Bytes == 1) max1 = _mm_max_epu8(max1, in1);
-				if (Bytes == 1) max2 = _mm_max_epu8(max2, in2);
+	// Has to be called by everything that writes to depths. Invalidates the depth range index.
+	void onDepthsChanged()
+	{
+		depthRangeIndexValid = false;
+	}
 
-				if (Bytes == 2) max0 = _mm_max_epu16(max0, in0);
-				if (Bytes == 2) max1 = _mm_max_epu16(max1, in1);
-				if (Bytes == 2) max2 = _mm_max_epu16(max2, in2);
+	// O(N) when enabling
+	void enableDepthCounts(bool enable)
+	{
+		depthCountsEnabled = enable;
+		depthCounts.clear();
+		trackedMaxDepth = 0;
+		addDepthCounts(0, getCount());
+	}
 
-				if (Bytes == 4) max0 = _mm_max_epu32(max0, in0);
-				if (Bytes == 4) max1 = _mm_max_epu32(max1, in1);
-				if (Bytes == 4) max2 = _mm_max_epu32(max2, in2);
+	// O(count)
+	void addDepthCounts(HierarchyIndex first, SizeType count)
+	{
+		onDepthsChanged();
+		if (!depthCountsEnabled)
+			return;
 
-				data += 48;
-				bytesLeft -= 48;
-			}
-			else if (bytesLeft >= 32)
+		for (HierarchyIndex i = first; i < first + count; i++)
+		{
+			const DepthValue depth = depths[i];
+			while (depthCounts.getSize() <= depth)
 			{
-				__m128i in0 = _mm_load_si128((const __m128i*)data + 0);
-				__m128i in1 = _mm_load_si128((const __m128i*)data + 1);
-
-				if (Bytes == 1) max0 = _mm_max_epu8(max0, in0);
-				if (Bytes == 1) max1 = _mm_max_epu8(max1, in1);
-
-				if (Bytes == 2) max0 = _mm_max_epu16(max0, in0);
-				if (Bytes == 2) max1 = _mm_max_epu16(max1, in1);
-
-				if (Bytes == 4) max0 = _mm_max_epu32(max0, in0);
-				if (Bytes == 4) max1 = _mm_max_epu32(max1, in1);
-
-				data += 32;
-				bytesLeft -= 32;
+				depthCounts.pushBack(0);
 			}
-			else if (bytesLeft >= 16)
-			{
-				__m128i in0 = _mm_load_si128((const __m128i*)data + 0);
+			++depthCounts[depth];
+			if (trackedMaxDepth < depth)
+				trackedMaxDepth = depth;
+		}
+	}
 
-				if (Bytes == 1) max0 = _mm_max_epu8(max0, in0);
-				if (Bytes == 2) max0 = _mm_max_epu16(max0, in0);
-				if (Bytes == 4) max0 = _mm_max_epu32(max0, in0);
+	// O(count), plus O(MaxDepth) when the deepest levels empty
+	void removeDepthCounts(HierarchyIndex first, SizeType count)
+	{
+		onDepthsChanged();
+		if (!depthCountsEnabled)
+			return;
 
-				data += 16;
-				bytesLeft -= 16;
-			}
+		for (HierarchyIndex i = first; i < first + count; i++)
+		{
+			FLAT_ASSERT(depths[i] < depthCounts.getSize() && depthCounts[depths[i]] > 0);
+			--depthCounts[depths[i]];
+		}
+		while (trackedMaxDepth > 0 && depthCounts[trackedMaxDepth] == 0)
+		{
+			--trackedMaxDepth;
+		}
+	}
 
-			// Collect all max values
-			{
-				if (Bytes == 1) res = _mm_max_epu8(_mm_max_epu8(max0, max1), _mm_max_epu8(max2, max3));
-				if (Bytes == 2) res = _mm_max_epu8(_mm_max_epu8(max0, max1), _mm_max_epu8(max2, max3));
-				if (Bytes == 4) res = _mm_max_epu8(_mm_max_epu8(max0, max1), _mm_max_epu8(max2, max3));
-			}
+	// O(N) when enabling
+	void enableDepthRangeIndex(bool enable)
+	{
+		depthRangeIndexEnabled = enable;
+		depthRangeIndexValid = false;
+		depthRangeTable.clear();
+		depthRangeParents.clear();
+		if (enable)
+			makeDepthRangeIndexValid();
+	}
 
-			// Shift and compare max values to last byte
-			{
-				if (Bytes == 1) res = _mm_max_epu8(res, _mm_srli_si128(res, 8));
-				if (Bytes == 1) res = _mm_max_epu8(res, _mm_srli_si128(res, 4));
-				if (Bytes == 1) res = _mm_max_epu8(res, _mm_srli_si128(res, 2));
-				if (Bytes == 1) res = _mm_max_epu8(res, _mm_srli_si128(res, 1));
+	bool isDepthRangeIndexValid() const
+	{
+		return depthRangeIndexEnabled && depthRangeIndexValid;
+	}
 
-				if (Bytes == 2) res = _mm_max_epu16(res, _mm_srli_si128(res, 8));
-				if (Bytes == 2) res = _mm_max_epu16(res, _mm_srli_si128(res, 4));
-				if (Bytes == 2) res = _mm_max_epu16(res, _mm_srli_si128(res, 2));
+	// O(N). The parent of a node is found by climbing the parents of the node before it, which is O(N) in total
+	// because every climbed step is a depth that the walk went up earlier.
+	void makeDepthRangeIndexValid()
+	{
+		FLAT_ASSERT(depthRangeIndexEnabled);
 
-				if (Bytes == 4) res = _mm_max_epu32(res, _mm_srli_si128(res, 8));
-				if (Bytes == 4) res = _mm_max_epu32(res, _mm_srli_si128(res, 4));
+		const SizeType count = getCount();
+		depthRangeParents.resize(count);
+		for (HierarchyIndex i = 0; i < count; i++)
+		{
+			HierarchyIndex parent = i > 0 ? i - 1 : getIndexNotFound();
+			while (parent != getIndexNotFound() && depths[parent] >= depths[i])
+			{
+				parent = depthRangeParents[parent];
 			}
-			result = (DepthValue)_mm_cvtsi128_si32(res);
+			depthRangeParents[i] = parent;
+		}
 
-			while (bytesLeft > 0)
+		const SizeType blockCount = (count + DepthRangeBlockSize - 1) / DepthRangeBlockSize;
+		const SizeType levelCount = blockCount > 0 ? flat_floor_log2((uint32_t)blockCount) + 1 : 0;
+		depthRangeTable.resize(blockCount * levelCount);
+		for (SizeType block = 0; block < blockCount; block++)
+		{
+			const HierarchyIndex start = block * DepthRangeBlockSize;
+			const HierarchyIndex end = start + DepthRangeBlockSize < count ? start + DepthRangeBlockSize : count;
+			HierarchyIndex shallowest = start;
+			for (HierarchyIndex i = start + 1; i < end; i++)
 			{
-				FLAT_ASSERT(bytesLeft >= Bytes);
-
-				if (result < *(DepthValue*)data)
-					result = *(DepthValue*)data;
-				data += Bytes;
-				bytesLeft -= Bytes;
+				if (depths[i] < depths[shallowest])
+					shallowest = i;
 			}
+			depthRangeTable[block] = shallowest;
 		}
-		else // sizeof(DepthValue) > 4
+		for (SizeType level = 1; level < levelCount; level++)
 		{
-			for (HierarchyIndex i = 0; i < getCount(); i++)
+			const SizeType half = SizeType(1) << (level - 1);
+			const HierarchyIndex* below = depthRangeTable.getPointer() + (level - 1) * blockCount;
+			HierarchyIndex* row = depthRangeTable.getPointer() + level * blockCount;
+			for (SizeType block = 0; block + half * 2 <= blockCount; block++)
 			{
-				if (depths[i] > result)
-					result = depths[i];
+				const HierarchyIndex left = below[block];
+				const HierarchyIndex right = below[block + half];
+				row[block] = depths[right] < depths[left] ? right : left;
 			}
 		}
+		depthRangeIndexValid = true;
+	}
+
+	// O(1) with depth counts enabled, otherwise O(N)
+	SizeType countNodesAtDepth(DepthValue depth) const
+	{
+		if (depthCountsEnabled)
+			return depth < depthCounts.getSize() ? depthCounts[depth] : 0;
+
+		SizeType result = 0;
+		for (HierarchyIndex i = 0; i < getCount(); i++)
+		{
+			if (depths[i] == depth)
+				++result;
+		}
+		return result;
+	}
+
+
+
+	__declspec(noinline)
+		DepthValue findMaxDepth() const
+	{
+		if (depthCountsEnabled)
+			return trackedMaxDepth;
+
+		const DepthValue result = flat_reduce_depths<true>(depths.getPointer(), getCount(), DepthValue(0));
 #ifdef _DEBUG
 		{ // Correctness check
-			SizeType check = 0;
+			DepthValue check = 0;
 			for (HierarchyIndex i = 0; i < getCount(); i++)
 			{
 				if (check < depths[i])
@@ -501,7 +1478,6 @@ public:
 		}
 #endif
 		return result;
-#endif
 	}
 
 	__declspec(noinline)
@@ -510,176 +1486,130 @@ public:
 		FLAT_ASSERT(last < getCount());
 		FLAT_ASSERT(first <= last);
 
-		DepthValue result = 0;
-#if FLAT_USE_SIMD == false
-		for (HierarchyIndex i = first; i <= last; i++)
-		{
-			if (depths[i] < result)
-				result = depths[i];
+		const DepthValue result = isDepthRangeIndexValid() ? depths[findMinDepthIndex(first, last)]
+			: flat_reduce_depths<false>(depths.getPointer() + first, last + 1 - first, depths[first]);
+#ifdef _DEBUG
+		{ // Correctness check
+			DepthValue check = depths[first];
+			for (HierarchyIndex i = first; i <= last; i++)
+			{
+				if (check > depths[i])
+					check = depths[i];
+			}
+			FLAT_ASSERT(check == result);
 		}
+#endif
 		return result;
-#else
-		enum { Bytes = sizeof(DepthValue) }; // Make Bytes an enum to ensure it is used as compile-time constant
-		static_assert(Bytes == 1 || Bytes == 2 || Bytes == 4 || Bytes > 4, "Byte count mismatch");
-
-		if (Bytes <= 4 && first + 16 / Bytes <= last) // DepthValue == uint8_t / uint16_t / uint32_t
-		{
-			FLAT_ASSERT(Bytes == 1 || Bytes == 2 || Bytes == 4);
-
-			SizeType bytesLeft = (last + 1 - first) * Bytes;
-
-			FLAT_ASSERT(bytesLeft / Bytes < getCount());
-
-			const uint8_t* data = (const uint8_t*)depths.getPointer() + first;
+	}
 
-			while (bytesLeft > 0 && (((uintptr_t)data) & 0xF) != 0)
-			{
-				if (result > *data)
-					result = *data;
-				data += Bytes;
-				bytesLeft -= Bytes;
-			}
+	// Deepest node that is a or b or an ancestor of both, getIndexNotFound() if they are under different roots.
+	// The shallowest node between them in (first, last] is a child of the result, unless first is an ancestor of last.
+	// O(1) with a valid depth range index, otherwise O(N).
+	HierarchyIndex lowestCommonAncestor(HierarchyIndex a, HierarchyIndex b) const
+	{
+		FLAT_ASSERT(a < getCount() && b < getCount());
 
-			__m128i res = _mm_setzero_si128();
-			__m128i min0 = _mm_setzero_si128();
-			__m128i min1 = _mm_setzero_si128();
-			__m128i min2 = _mm_setzero_si128();
-			__m128i min3 = _mm_setzero_si128();
+		const HierarchyIndex first = a < b ? a : b;
+		const HierarchyIndex last = a < b ? b : a;
+		if (first == last)
+			return first;
 
-			while (bytesLeft >= 64)
+		HierarchyIndex result;
+		if (isDepthRangeIndexValid())
+		{
+			const HierarchyIndex shallowest = findMinDepthIndex(first + 1, last);
+			result = depths[shallowest] > depths[first] ? first : depthRangeParents[shallowest];
+		}
+		else
+		{
+			const DepthValue minDepth = findMinDepthBetween(first + 1, last);
+			if (minDepth > depths[first])
 			{
-				__m128i in0 = _mm_load_si128((const __m128i*)data + 0);
-				__m128i in1 = _mm_load_si128((const __m128i*)data + 1);
-				__m128i in2 = _mm_load_si128((const __m128i*)data + 2);
-				__m128i in3 = _mm_load_si128((const __m128i*)data + 3);
-
-				if (Bytes == 1) min0 = _mm_min_epu8(min0, in0);
-				if (Bytes == 1) min1 = _mm_min_epu8(min1, in1);
-				if (Bytes == 1) min2 = _mm_min_epu8(min2, in2);
-				if (Bytes == 1) min3 = _mm_min_epu8(min3, in3);
-
-				if (Bytes == 2) min0 = _mm_min_epu16(min0, in0);
-				if (Bytes == 2) min1 = _mm_min_epu16(min1, in1);
-				if (Bytes == 2) min2 = _mm_min_epu16(min2, in2);
-				if (Bytes == 2) min3 = _mm_min_epu16(min3, in3);
-
-				if (Bytes == 4) min0 = _mm_min_epu32(min0, in0);
-				if (Bytes == 4) min1 = _mm_min_epu32(min1, in1);
-				if (Bytes == 4) min2 = _mm_min_epu32(min2, in2);
-				if (Bytes == 4) min3 = _mm_min_epu32(min3, in3);
-
-				data += 64;
-				bytesLeft -= 64;
+				result = first;
 			}
-
-			if (bytesLeft >= 48)
+			else if (minDepth == 0)
 			{
-				__m128i in0 = _mm_load_si128((const __m128i*)data + 0);
-				__m128i in1 = _mm_load_si128((const __m128i*)data + 1);
-				__m128i in2 = _mm_load_si128((const __m128i*)data + 2);
-
-				if (Bytes == 1) min0 = _mm_min_epu8(min0, in0);
-				if (Bytes == 1) min1 = _mm_min_epu8(min1, in1);
-				if (Bytes == 1) min2 = _mm_min_epu8(min2, in2);
-
-				if (Bytes == 2) min0 = _mm_min_epu16(min0, in0);
-				if (Bytes == 2) min1 = _mm_min_epu16(min1, in1);
-				if (Bytes == 2) min2 = _mm_min_epu16(min2, in2);
-
-				if (Bytes == 4) min0 = _mm_min_epu32(min0, in0);
-				if (Bytes == 4) min1 = _mm_min_epu32(min1, in1);
-				if (Bytes == 4) min2 = _mm_min_epu32(min2, in2);
-
-				data += 48;
-				bytesLeft -= 48;
+				result = getIndexNotFound();
 			}
-			else if (bytesLeft >= 32)
+			else
 			{
-				__m128i in0 = _mm_load_si128((const __m128i*)data + 0);
-				__m128i in1 = _mm_load_si128((const __m128i*)data + 1);
-
-				if (Bytes == 1) min0 = _mm_min_epu8(min0, in0);
-				if (Bytes == 1) min1 = _mm_min_epu8(min1, in1);
-
-				if (Bytes == 2) min0 = _mm_min_epu16(min0, in0);
-				if (Bytes == 2) min1 = _mm_min_epu16(min1, in1);
-
-				if (Bytes == 4) min0 = _mm_min_epu32(min0, in0);
-				if (Bytes == 4) min1 = _mm_min_epu32(min1, in1);
-
-				data += 32;
-				bytesLeft -= 32;
+				// The ancestor of first at minDepth - 1
+				result = first;
+				while (depths[result] >= minDepth)
+				{
+					--result;
+				}
 			}
-			else if (bytesLeft >= 16)
+		}
+#ifdef _DEBUG
+		{ // Correctness check
+			HierarchyIndex check[2] = { first, last };
+			while (check[0] != check[1])
 			{
-				__m128i in0 = _mm_load_si128((const __m128i*)data + 0);
-
-				if (Bytes == 1) min0 = _mm_min_epu8(min0, in0);
-				if (Bytes == 2) min0 = _mm_min_epu16(min0, in0);
-				if (Bytes == 4) min0 = _mm_min_epu32(min0, in0);
-
-				data += 16;
-				bytesLeft -= 16;
-			}
+				const int up = depths[check[0]] > depths[check[1]] || (depths[check[0]] == depths[check[1]] && check[0] > check[1]) ? 0 : 1;
+				if (depths[check[up]] == 0)
+				{
+					check[0] = getIndexNotFound();
+					break;
+				}
 
-			// Collect all min values
-			{
-				if (Bytes == 1) res = _mm_min_epu8(_mm_min_epu8(min0, min1), _mm_min_epu8(min2, min3));
-				if (Bytes == 2) res = _mm_min_epu8(_mm_min_epu8(min0, min1), _mm_min_epu8(min2, min3));
-				if (Bytes == 4) res = _mm_min_epu8(_mm_min_epu8(min0, min1), _mm_min_epu8(min2, min3));
+				HierarchyIndex parent = check[up] - 1;
+				while (depths[parent] >= depths[check[up]])
+				{
+					--parent;
+				}
+				check[up] = parent;
 			}
+			FLAT_ASSERT(check[0] == result);
+		}
+#endif
+		return result;
+	}
 
-			// Shift and compare min values to last byte
-			{
-				if (Bytes == 1) res = _mm_min_epu8(res, _mm_srli_si128(res, 8));
-				if (Bytes == 1) res = _mm_min_epu8(res, _mm_srli_si128(res, 4));
-				if (Bytes == 1) res = _mm_min_epu8(res, _mm_srli_si128(res, 2));
-				if (Bytes == 1) res = _mm_min_epu8(res, _mm_srli_si128(res, 1));
-
-				if (Bytes == 2) res = _mm_min_epu16(res, _mm_srli_si128(res, 8));
-				if (Bytes == 2) res = _mm_min_epu16(res, _mm_srli_si128(res, 4));
-				if (Bytes == 2) res = _mm_min_epu16(res, _mm_srli_si128(res, 2));
-
-				if (Bytes == 4) res = _mm_min_epu32(res, _mm_srli_si128(res, 8));
-				if (Bytes == 4) res = _mm_min_epu32(res, _mm_srli_si128(res, 4));
-			}
-			result = (DepthValue)_mm_cvtsi128_si32(res);
+	static HierarchyIndex getIndexNotFound() { return HierarchyIndex(~HierarchyIndex(0)); }
 
-			while (bytesLeft > 0)
-			{
-				FLAT_ASSERT(bytesLeft >= Bytes);
+	// Exclude most significant bit to catch roll over errors
+	static DepthValue getMaxDepth() { return DepthValue(DepthValue(~DepthValue(0)) >> 1); }
 
-				if (result > *(DepthValue*)data)
-					result = *(DepthValue*)data;
-				data += Bytes;
-				bytesLeft -= Bytes;
-			}
-		}
-		else // sizeof(DepthValue) > 4
-		{
-			for (HierarchyIndex i = first; i <= last; i++)
-			{
-				if (result > depths[i])
-					result = depths[i];
-			}
-			return result;
-		}
-#ifdef _DEBUG
-		{ // Correctness check
-			SizeType check = 0;
-			for (HierarchyIndex i = first; i <= last; i++)
-			{
-				if (check > depths[i])
-					check = depths[i];
-			}
-			FLAT_ASSERT(check == result);
+private:
+	// First shallowest node in [first, last] with a valid depth range index
+	HierarchyIndex findMinDepthIndex(HierarchyIndex first, HierarchyIndex last) const
+	{
+		const SizeType firstBlock = first / DepthRangeBlockSize;
+		const SizeType lastBlock = last / DepthRangeBlockSize;
+		if (firstBlock == lastBlock)
+			return findMinDepthIndexInBlock(first, last + 1);
+
+		HierarchyIndex result = findMinDepthIndexInBlock(first, (firstBlock + 1) * DepthRangeBlockSize);
+		if (firstBlock + 1 < lastBlock)
+		{
+			// Two overlapping power of two runs of blocks cover the blocks in between
+			const SizeType blockCount = (getCount() + DepthRangeBlockSize - 1) / DepthRangeBlockSize;
+			const SizeType level = flat_floor_log2((uint32_t)(lastBlock - firstBlock - 1));
+			const HierarchyIndex* row = depthRangeTable.getPointer() + level * blockCount;
+			const HierarchyIndex left = row[firstBlock + 1];
+			const HierarchyIndex right = row[lastBlock - (SizeType(1) << level)];
+			if (depths[left] < depths[result])
+				result = left;
+			if (depths[right] < depths[result])
+				result = right;
 		}
-#endif
-		return result;
-#endif
+
+		const HierarchyIndex right = findMinDepthIndexInBlock(lastBlock * DepthRangeBlockSize, last + 1);
+		return depths[right] < depths[result] ? right : result;
 	}
 
-	static HierarchyIndex getIndexNotFound() { return HierarchyIndex(~0); }
+	// At most DepthRangeBlockSize nodes
+	HierarchyIndex findMinDepthIndexInBlock(HierarchyIndex start, HierarchyIndex end) const
+	{
+		HierarchyIndex result = start;
+		for (HierarchyIndex i = start + 1; i < end; i++)
+		{
+			if (depths[i] < depths[result])
+				result = i;
+		}
+		return result;
+	}
 };
 
 
@@ -694,12 +1624,25 @@ struct DefaultSorter
 	inline static bool isFirst(const T& a, const T& b) { return a < b; }
 };
 
-template<typename ValueType, typename Sorter = DefaultSorter>
-class FlatHierarchy : public FlatHierarchyBase
+template<typename ValueType, typename Sorter = DefaultSorter, typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
+class FlatHierarchy : public FlatHierarchyBase<DepthType, IndexType>
 {
 public:
-
-	FLAT_VECTOR<ValueType> values;
+	typedef FlatHierarchyBase<DepthType, IndexType> Base;
+	typedef typename Base::SizeType SizeType;
+	typedef typename Base::DepthValue DepthValue;
+	typedef typename Base::HierarchyIndex HierarchyIndex;
+
+	using Base::depths;
+	using Base::getCount;
+	using Base::findMinDepthBetween;
+	using Base::getIndexNotFound;
+	using Base::getMaxDepth;
+	using Base::addDepthCounts;
+	using Base::removeDepthCounts;
+	using Base::onDepthsChanged;
+
+	FLAT_INDEXED_VECTOR(ValueType, SizeType) values;
 
 	FlatHierarchy(SizeType reserveSize = 0)
 	{
@@ -712,6 +1655,8 @@ public:
 
 	HierarchyIndex createRootNode(const ValueType& value)
 	{
+		onDepthsChanged();
+
 		HierarchyIndex newIndex = getCount();
 
 		if (Sorter::UseSorting == true)
@@ -736,11 +1681,14 @@ public:
 			depths.pushBack((DepthValue)0U);
 		}
 
+		addDepthCounts(newIndex, 1);
 		return newIndex;
 	}
 
 	HierarchyIndex createNodeAsChildOf(HierarchyIndex parentIndex, const ValueType& value)
 	{
+		onDepthsChanged();
+
 		SizeType newIndex = parentIndex + 1;
 
 		if (Sorter::UseSorting == true)
@@ -762,26 +1710,128 @@ public:
 
 		FLAT_ASSERT(newIndex > parentIndex);
 
-		FLAT_DEPTHTYPE newParentCount = depths[parentIndex] + 1;
-		FLAT_ASSERT(newParentCount < FLAT_MAXDEPTH); // Over flow protection
+		DepthValue newParentCount = depths[parentIndex] + 1;
+		FLAT_ASSERT(newParentCount < getMaxDepth()); // Over flow protection
 
 		values.insert(newIndex, value);
 		depths.insert(newIndex, newParentCount);
+		addDepthCounts(newIndex, 1);
 		return newIndex;
 	}
-	HierarchyIndex getLastDescendant(HierarchyIndex parentIndex)
+
+	// Adds a block of nodes under parentIndex. The block is in depth search order and its depths are relative
+	// to the new children (0 = direct child of parentIndex). When sorting, the block's top level nodes must be
+	// in sorted order. They get merged among the existing children so that the tail of the hierarchy is only
+	// shifted once. Returns the index of the first top level node of the block.
+	HierarchyIndex createNodesAsChildrenOf(HierarchyIndex parentIndex, const ValueType* newValues, const DepthValue* relativeDepths, SizeType count)
 	{
-		HierarchyIndex result = parentIndex + 1;
-		DepthValue parentDepth = depths[parentIndex];
-		while (result < getCount() && depths[result] > parentDepth)
+		onDepthsChanged();
+
+		FLAT_ASSERT(parentIndex < getCount());
+		FLAT_ASSERT(count > 0 && relativeDepths[0] == 0);
+
+		const DepthValue targetDepth = depths[parentIndex] + 1;
+		FLAT_ASSERT(targetDepth < getMaxDepth()); // Over flow protection
+
+		const SizeType oldCount = getCount();
+		const SizeType rangeEnd = Sorter::UseSorting == true ? getLastDescendant(parentIndex) + 1 : parentIndex + 1;
+
+		if (values.getCapacity() < oldCount + count)
+		{
+			const SizeType newCapacity = oldCount + count > values.getCapacity() * 2 ? oldCount + count : values.getCapacity() * 2;
+			values.reserve(newCapacity);
+			depths.reserve(newCapacity);
+		}
+		values.resize(oldCount + count);
+		depths.resize(oldCount + count);
+
+		DepthValue* dPtr = depths.getPointer();
+		ValueType* vPtr = values.getPointer();
+
+		// Open the gap once
+		FLAT_MEMMOVE(dPtr + rangeEnd + count, dPtr + rangeEnd, (oldCount - rangeEnd) * sizeof(DepthValue));
+		FLAT_MEMMOVE(vPtr + rangeEnd + count, vPtr + rangeEnd, (oldCount - rangeEnd) * sizeof(ValueType));
+
+		// Merge backwards: existing child subtrees and block subtrees are taken from their ends and written
+		// to the end of the merged range, so every existing node is moved at most once.
+		SizeType write = rangeEnd + count;  // End of the unwritten part of the merged range
+		SizeType existingEnd = rangeEnd;    // End of the unmerged existing children
+		SizeType blockEnd = count;          // End of the unmerged block
+		SizeType laterBlockRoot = count;   // Previously merged top level node of the block
+		SizeType result = rangeEnd;
+
+		while (blockEnd > 0)
 		{
-			++result;
+			SizeType blockStart = blockEnd - 1;
+			while (relativeDepths[blockStart] != 0)
+			{
+				FLAT_ASSERT(blockStart > 0);
+				FLAT_ASSERT(relativeDepths[blockStart] <= relativeDepths[blockStart - 1] + 1 && "Block is not in depth search order");
+				--blockStart;
+			}
+
+			SizeType existingStart = existingEnd;
+			if (Sorter::UseSorting == true && existingEnd > parentIndex + 1)
+			{
+				existingStart = existingEnd - 1;
+				while (dPtr[existingStart] != targetDepth)
+				{
+					--existingStart;
+				}
+			}
+
+			if (existingStart < existingEnd && Sorter::isFirst(newValues[blockStart], vPtr[existingStart]))
+			{
+				// Existing child comes last
+				const SizeType subtreeCount = existingEnd - existingStart;
+				write -= subtreeCount;
+				FLAT_MEMMOVE(dPtr + write, dPtr + existingStart, subtreeCount * sizeof(DepthValue));
+				FLAT_MEMMOVE(vPtr + write, vPtr + existingStart, subtreeCount * sizeof(ValueType));
+				existingEnd = existingStart;
+			}
+			else
+			{
+				// Block's child comes last
+				FLAT_ASSERT((Sorter::UseSorting == false || laterBlockRoot == count || !Sorter::isFirst(newValues[laterBlockRoot], newValues[blockStart])) && "Block is not sorted");
+				const SizeType subtreeCount = blockEnd - blockStart;
+				write -= subtreeCount;
+				for (SizeType i = 0; i < subtreeCount; i++)
+				{
+					dPtr[write + i] = relativeDepths[blockStart + i] + targetDepth;
+					vPtr[write + i] = newValues[blockStart + i];
+					FLAT_ASSERT(dPtr[write + i] < getMaxDepth()); // Over flow protection
+				}
+				addDepthCounts(write, subtreeCount);
+				blockEnd = blockStart;
+				laterBlockRoot = blockStart;
+				result = write;
+			}
+		}
+
+		FLAT_ASSERT(write == existingEnd);
+		return result;
+	}
+
+	HierarchyIndex getLastDescendant(HierarchyIndex parentIndex)
+	{
+		const HierarchyIndex result = (HierarchyIndex)flat_find_not_deeper(depths.getPointer(), parentIndex + 1, getCount(), depths[parentIndex]);
+#ifdef _DEBUG
+		{ // Correctness check
+			HierarchyIndex check = parentIndex + 1;
+			while (check < getCount() && depths[check] > depths[parentIndex])
+			{
+				++check;
+			}
+			FLAT_ASSERT(check == result);
 		}
+#endif
 		return result - 1;
 	}
 
 	HierarchyIndex makeChildOf(HierarchyIndex child, HierarchyIndex parent)
 	{
+		onDepthsChanged();
+
 		//printf("Make %d child of %d\n", child, parent);
 
 		FLAT_ASSERT(child != parent && "Self-adoption");
@@ -844,19 +1894,260 @@ public:
 			dest -= count;
 		}
 
+		removeDepthCounts(dest, count);
 		for (SizeType i = 0; i < count; i++)
 		{
 			depths[dest + i] += depthDiff;
-#define TO_STR_IMPL(p) #p
-#define TO_STR(p) TO_STR_IMPL(p)
-			FLAT_ASSERT(depths[dest + i] < FLAT_MAXDEPTH && "Over/Under-flow threat detected: " TO_STR(FLAT_MAXDEPTH)); // Over flow protection
+			FLAT_ASSERT(depths[dest + i] < getMaxDepth() && "Over/Under-flow threat detected"); // Over flow protection
 		}
+		addDepthCounts(dest, count);
 		return dest;
 	}
 
+	// Buffers of makeChildrenOf(). Keep one between calls, so it only allocates when a batch touches a larger span than before.
+	struct MakeChildrenScratch
+	{
+		struct Frame
+		{
+			HierarchyIndex node;
+			HierarchyIndex nextChild;    // Next original child to consider
+			HierarchyIndex nextIncoming; // Next moved child to consider
+		};
+
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) parents;         // Original parent of every span node
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) lastDescendants; // Original last descendant of every span node
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) moveOf;          // Move list index of a moved child
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) incomingHead;    // First move into a node, in sibling order
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) incomingNext;    // Next move into the same parent
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) ancestors;       // Ancestor stack of the parent pass
+		FLAT_INDEXED_VECTOR(Frame, SizeType) frames;                   // Ancestor stack of the gather pass
+		FLAT_INDEXED_VECTOR(DepthValue, SizeType) newDepths;
+		FLAT_INDEXED_VECTOR(ValueType, SizeType) newValues;
+	};
+
+	// Moves several subtrees at once. All indices refer to the hierarchy as it is before the call, and a new parent
+	// may be moved itself. The final depth search order is written with a single gather pass that also fixes the depths.
+	// Under every new parent the moved children are placed
+	// - with sorting, among the children that stay by Sorter::isFirst() and after the ones with an equal key, where
+	//   makeChildOf() puts them. Moved children with equal keys keep their order in the list.
+	// - without sorting, before the children that stay and in the order of the list. makeChildOf() makes every
+	//   child the first one, so that is the order of makeChildOf() calls in reverse list order.
+	// Returns false and leaves the hierarchy untouched if the moves would create a cycle or move a node twice.
+	// When newIndices is given, it receives the index of every moved child after the move.
+	// It allocates its buffers on every call, pass a MakeChildrenScratch instead to keep them.
+	bool makeChildrenOf(const HierarchyIndex* children, const HierarchyIndex* newParents, SizeType moveCount, HierarchyIndex* newIndices = NULL)
+	{
+		MakeChildrenScratch scratch;
+		return makeChildrenOf(children, newParents, moveCount, scratch, newIndices);
+	}
+
+	// Same with the buffers of scratch. Only the span under the lowest common ancestor of all moved children and new parents
+	// is rebuilt, or the top level subtrees from the first to the last one they are in. Nodes outside keep their place.
+	bool makeChildrenOf(const HierarchyIndex* children, const HierarchyIndex* newParents, SizeType moveCount, MakeChildrenScratch& scratch, HierarchyIndex* newIndices = NULL)
+	{
+		const SizeType count = getCount();
+		const HierarchyIndex notFound = getIndexNotFound();
+
+		if (moveCount == 0)
+		{
+			onDepthsChanged();
+			return true;
+		}
+
+		// Find the span, before the depth range index is invalidated
+		HierarchyIndex first = notFound;
+		HierarchyIndex last = 0;
+		for (SizeType m = 0; m < moveCount; m++)
+		{
+			const HierarchyIndex child = children[m];
+			const HierarchyIndex parent = newParents[m];
+			if (child >= count || parent >= count || child == parent)
+			{
+				onDepthsChanged();
+				return false;
+			}
+			const HierarchyIndex low = child < parent ? child : parent;
+			const HierarchyIndex high = child < parent ? parent : child;
+			first = low < first ? low : first;
+			last = high > last ? high : last;
+		}
+
+		HierarchyIndex start = lowestCommonAncestor(first, last);
+		if (start == notFound)
+		{
+			// Under different roots, take their top level subtrees
+			start = first;
+			while (depths[start] > 0)
+			{
+				--start;
+			}
+		}
+		const DepthValue baseDepth = depths[start];
+		const HierarchyIndex end = (HierarchyIndex)flat_find_not_deeper(depths.getPointer(), last + 1, count, baseDepth);
+		const SizeType spanCount = end - start;
+
+		onDepthsChanged();
+
+		// Original parents and last descendants of the span in one pass, as offsets from start
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType)& parents = scratch.parents;
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType)& lastDescendants = scratch.lastDescendants;
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType)& moveOf = scratch.moveOf;
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType)& incomingHead = scratch.incomingHead;
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType)& incomingNext = scratch.incomingNext;
+		parents.resize(spanCount);
+		lastDescendants.resize(spanCount);
+		moveOf.resize(spanCount);
+		incomingHead.resize(spanCount);
+		incomingNext.resize(moveCount);
+		{
+			FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType)& stack = scratch.ancestors;
+			stack.clear();
+			for (HierarchyIndex i = 0; i < spanCount; i++)
+			{
+				const DepthValue d = depths[start + i] - baseDepth;
+				while (stack.getSize() > d)
+				{
+					lastDescendants[stack.getBack()] = i - 1;
+					stack.resize(stack.getSize() - 1);
+				}
+				FLAT_ASSERT(stack.getSize() == d);
+				parents[i] = d > 0 ? stack.getBack() : notFound;
+				stack.pushBack(i);
+				moveOf[i] = notFound;
+				incomingHead[i] = notFound;
+			}
+			while (stack.getSize() > 0)
+			{
+				lastDescendants[stack.getBack()] = spanCount - 1;
+				stack.resize(stack.getSize() - 1);
+			}
+		}
+
+		// Validate
+		for (SizeType m = 0; m < moveCount; m++)
+		{
+			const HierarchyIndex child = children[m] - start;
+			if (moveOf[child] != notFound)
+				return false;
+			moveOf[child] = m;
+		}
+		for (SizeType m = 0; m < moveCount; m++)
+		{
+			// Walk the ancestors the new parent will have after the moves, up to the span root
+			HierarchyIndex current = newParents[m] - start;
+			for (SizeType steps = 0; current != notFound; steps++)
+			{
+				if (current == children[m] - start || steps > spanCount)
+					return false;
+				current = moveOf[current] != notFound ? newParents[moveOf[current]] - start : parents[current];
+			}
+		}
+
+		// Link moved children to their new parents in sibling order
+		for (SizeType m = 0; m < moveCount; m++)
+		{
+			HierarchyIndex* link = &incomingHead[newParents[m] - start];
+			if (Sorter::UseSorting == true)
+			{
+				while (*link != notFound && !Sorter::isFirst(values[children[m]], values[children[*link]]))
+				{
+					link = &incomingNext[*link];
+				}
+			}
+			else
+			{
+				while (*link != notFound)
+				{
+					link = &incomingNext[*link];
+				}
+			}
+			incomingNext[m] = *link;
+			*link = m;
+		}
+
+		// Gather the final depth search order of the span
+		typedef typename MakeChildrenScratch::Frame Frame;
+
+		FLAT_INDEXED_VECTOR(DepthValue, SizeType)& newDepths = scratch.newDepths;
+		FLAT_INDEXED_VECTOR(ValueType, SizeType)& newValues = scratch.newValues;
+		FLAT_INDEXED_VECTOR(Frame, SizeType)& stack = scratch.frames;
+		newDepths.resize(spanCount);
+		newValues.resize(spanCount);
+		stack.clear();
+
+		SizeType write = 0;
+		for (HierarchyIndex root = 0; root < spanCount; root = lastDescendants[root] + 1)
+		{
+			if (moveOf[root] != notFound)
+				continue;
+
+			HierarchyIndex node = root;
+			for (;;)
+			{
+				// Emit node
+				if (moveOf[node] != notFound && newIndices != NULL)
+					newIndices[moveOf[node]] = start + write;
+
+				newDepths[write] = (DepthValue)(baseDepth + stack.getSize());
+				newValues[write] = values[start + node];
+				FLAT_ASSERT(newDepths[write] < getMaxDepth() && "Over/Under-flow threat detected"); // Over flow protection
+				++write;
+
+				Frame frame;
+				frame.node = node;
+				frame.nextChild = node + 1;
+				frame.nextIncoming = incomingHead[node];
+				stack.pushBack(frame);
+
+				// Find the next node to emit, popping finished frames
+				node = notFound;
+				while (node == notFound && stack.getSize() > 0)
+				{
+					Frame& top = stack.getBack();
+
+					while (top.nextChild <= lastDescendants[top.node] && moveOf[top.nextChild] != notFound)
+					{
+						top.nextChild = lastDescendants[top.nextChild] + 1;
+					}
+
+					const bool hasChild = top.nextChild <= lastDescendants[top.node];
+					const bool hasIncoming = top.nextIncoming != notFound;
+
+					if (hasIncoming && (!hasChild || Sorter::UseSorting == false || Sorter::isFirst(values[children[top.nextIncoming]], values[start + top.nextChild])))
+					{
+						node = children[top.nextIncoming] - start;
+						top.nextIncoming = incomingNext[top.nextIncoming];
+					}
+					else if (hasChild)
+					{
+						node = top.nextChild;
+						top.nextChild = lastDescendants[top.nextChild] + 1;
+					}
+					else
+					{
+						stack.resize(stack.getSize() - 1);
+					}
+				}
+
+				if (node == notFound)
+					break;
+			}
+		}
+		FLAT_ASSERT(write == spanCount);
+
+		removeDepthCounts(start, spanCount);
+		FLAT_MEMCPY(depths.getPointer() + start, newDepths.getPointer(), spanCount * sizeof(DepthValue));
+		FLAT_MEMCPY(values.getPointer() + start, newValues.getPointer(), spanCount * sizeof(ValueType));
+		addDepthCounts(start, spanCount);
+		return true;
+	}
+
 	void erase(HierarchyIndex child)
 	{
+		onDepthsChanged();
+
 		SizeType count = getLastDescendant(child) - child + 1;
+		removeDepthCounts(child, count);
 
 		const SizeType toShift = getCount() - (child + count);
 		FLAT_MEMMOVE(depths.getPointer() + child, depths.getPointer() + child + count, toShift * sizeof(DepthValue));
@@ -865,45 +2156,116 @@ public:
 		depths.resize(depths.getSize() - count);
 		values.resize(values.getSize() - count);
 	}
+
+	// Erases the subtrees starting from the given indices in a single compacting pass. The indices can be
+	// in any order and may overlap each other's subtrees. Returns the number of erased nodes.
+	SizeType eraseMany(const HierarchyIndex* indices, SizeType indexCount)
+	{
+		struct SubtreeEnd
+		{
+			const DepthValue* depths;
+			SizeType count;
+
+			HierarchyIndex getEnd(HierarchyIndex index) const
+			{
+				return (HierarchyIndex)flat_find_not_deeper(depths, index + 1, count, depths[index]);
+			}
+		};
+
+		SubtreeEnd subtreeEnd;
+		subtreeEnd.depths = depths.getPointer();
+		subtreeEnd.count = getCount();
+
+		FLAT_INDEXED_VECTOR(uint32_t, SizeType) marks;
+		HierarchyIndex first;
+		return eraseMany(indices, indexCount, subtreeEnd, marks, first);
+	}
+
+	// Same with the index after every erased subtree from subtreeEnd.getEnd(index), for example from a LastDescendantCache.
+	// getEnd() is called in index order, before anything at or after index is overwritten. marks receives a bit for every
+	// index in indices and first the lowest of them, so caches can erase the same subtrees.
+	template<typename SubtreeEnd>
+	SizeType eraseMany(const HierarchyIndex* indices, SizeType indexCount, const SubtreeEnd& subtreeEnd, FLAT_INDEXED_VECTOR(uint32_t, SizeType)& marks, HierarchyIndex& first)
+	{
+		onDepthsChanged();
+
+		const SizeType count = getCount();
+		first = count;
+		if (indexCount == 0)
+			return 0;
+
+		// Mark subtree roots
+		marks.resize((count + 31) / 32);
+		for (SizeType i = 0; i < marks.getSize(); i++)
+		{
+			marks[i] = 0;
+		}
+
+		for (SizeType i = 0; i < indexCount; i++)
+		{
+			FLAT_ASSERT(indices[i] < count);
+			marks[indices[i] / 32] |= 1U << (indices[i] % 32);
+			if (first > indices[i])
+				first = indices[i];
+		}
+
+		DepthValue* dPtr = depths.getPointer();
+		ValueType* vPtr = values.getPointer();
+
+		SizeType write = first;
+		SizeType read = first;
+		while (read < count)
+		{
+			if ((marks[read / 32] >> (read % 32) & 1) != 0)
+			{
+				// Skip the whole subtree, including any marks inside it
+				const SizeType subtreeStart = read;
+				read = subtreeEnd.getEnd(read);
+				FLAT_ASSERT(read > subtreeStart && read <= count);
+				removeDepthCounts(subtreeStart, read - subtreeStart);
+				continue;
+			}
+
+			// Keep a run of nodes up to the next mark
+			const SizeType runStart = read;
+			while (read < count && (marks[read / 32] >> (read % 32) & 1) == 0)
+			{
+				++read;
+			}
+
+			if (write != runStart)
+			{
+				FLAT_MEMMOVE(dPtr + write, dPtr + runStart, (read - runStart) * sizeof(DepthValue));
+				FLAT_MEMMOVE(vPtr + write, vPtr + runStart, (read - runStart) * sizeof(ValueType));
+			}
+			write += read - runStart;
+		}
+
+		depths.resize(write);
+		values.resize(write);
+		return count - write;
+	}
+
+	// Moves the range [source, source + count) so that it starts right before the pre-move index dest.
+	// The range is rotated in place, no memory is allocated.
 	void move(SizeType source, SizeType dest, SizeType count)
 	{
-#if 1
+		onDepthsChanged();
+
+		FLAT_ASSERT(dest <= source || dest >= source + count);
+
 		SizeType low = source < dest ? source : dest;
 		SizeType mid = source < dest ? source + count : source;
-		SizeType high = source < dest ? dest + count : source + count;
-
-		bool low_small = mid - low < high - mid;
-		SizeType small_start = low_small ? low              : mid;
-		SizeType small_count = low_small ? mid - low        : high - mid;
-		SizeType small_dest  = low_small ? low + high - mid : low;
-		SizeType large_start = low_small ? mid              : low;
-		SizeType large_count = low_small ? high - mid       : mid - low;
-		SizeType large_dest  = low_small ? low              : low + high - mid;
-
-		static const SizeType static_buffer_size = 1024;
-		char stack_buffer[static_buffer_size];
-		char* temp_buffer = stack_buffer;
-		if (small_count * sizeof(ValueType) > static_buffer_size)
-			temp_buffer = (char*)malloc(small_count * sizeof(ValueType));
-
-		//printf("memcpy(X, %d, %d); ", small_start, small_count);
-		//printf("memmove(%d, %d, %d); ", large_dest, large_start, large_count);
-		//printf("memcpy(%d, X, %d);\n", small_dest, small_count);
-
-		FLAT_MEMCPY (temp_buffer                     , depths.getPointer() + small_start, small_count);
-		FLAT_MEMMOVE(depths.getPointer() + large_dest, depths.getPointer() + large_start, large_count);
-		FLAT_MEMCPY (depths.getPointer() + small_dest, temp_buffer                      , small_count);
-		
-		FLAT_MEMCPY (temp_buffer                     , values.getPointer() + small_start, small_count);
-		FLAT_MEMMOVE(values.getPointer() + large_dest, values.getPointer() + large_start, large_count);
-		FLAT_MEMCPY (values.getPointer() + small_dest, temp_buffer                      , small_count);
+		SizeType high = source < dest ? dest : source + count;
+		FLAT_ASSERT(high <= getCount());
 
-		if (small_count * sizeof(ValueType) > static_buffer_size)
-			free(temp_buffer);
-#endif
+		flat_rotate(depths.getPointer(), low, mid, high);
+		flat_rotate(values.getPointer(), low, mid, high);
 	}
 	inline void moveImp(SizeType source, SizeType dest, SizeType count, DepthValue* depthBuffer, ValueType* valueBuffer)
 	{
+		onDepthsChanged();
+
 		FLAT_ASSERT(source + count <= dest || dest + count < source);
 
 		DepthValue* dPtr = depths.getPointer();
@@ -929,8 +2291,12 @@ public:
 		//printf("memcpy(%d, X, %d);\n", dest, count);
 	}
 
-	inline bool linearIsChildOf(HierarchyIndex child, HierarchyIndex parent)
+	// True if child is in the subtree of parent. O(child - parent), stops at the first node that is not deeper than parent.
+	// With a LastDescendantCache the isChildOf() free function answers in O(1).
+	inline bool linearIsChildOf(HierarchyIndex child, HierarchyIndex parent) const
 	{
+		FLAT_ASSERT(child < getCount() && parent < getCount());
+
 		if (child <= parent || depths[child] <= depths[parent])
 			return false;
 
@@ -940,7 +2306,23 @@ public:
 			return true;
 		}
 
-		return depths[parent] < findMinDepthBetween(parent + 1, child - 1);
+		const bool result = flat_find_not_deeper(depths.getPointer(), parent + 1, child, depths[parent]) == child;
+#ifdef _DEBUG
+		{ // Correctness check
+			FLAT_ASSERT(result == (depths[parent] < findMinDepthBetween(parent + 1, child - 1)));
+		}
+#endif
+		return result;
+	}
+
+	// Batch form of linearIsChildOf() for filtering selections. results[i] tells if indices[i] is in the subtree of parent.
+	// Returns the number of those. One subtree end search, then an interval check per index.
+	SizeType areDescendantsOf(HierarchyIndex parent, const HierarchyIndex* indices, SizeType indexCount, bool* results) const
+	{
+		FLAT_ASSERT(parent < getCount());
+
+		const HierarchyIndex last = (HierarchyIndex)flat_find_not_deeper(depths.getPointer(), parent + 1, getCount(), depths[parent]) - 1;
+		return flat_check_intervals(parent, last, indices, indexCount, results);
 	}
 
 	HierarchyIndex findValue(const ValueType& valueType, HierarchyIndex startingFrom = 0)
@@ -964,6 +2346,259 @@ public:
 		}
 		return getIndexNotFound();
 	}
+
+	// Latest index on every depth, the stack of scanDown(), scanDownSubtree() and reduceUp(). It grows on demand while a scan
+	// goes deeper, keep one between calls so it only allocates when the tree gets deeper than in any earlier scan.
+	typedef FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) AncestorStack;
+
+	// Buffers of the multithreaded scanDown(). Keep one between calls, so it only allocates when the tree has grown.
+	template<typename OutType>
+	struct ScanDownScratch
+	{
+		AncestorStack ancestors;                                    // Ancestors of the next chunk start
+		FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) lastAtDepth; // Last index on every depth inside every chunk
+		FLAT_VECTOR<OutType> carry;                                 // Results of the ancestors of every chunk start
+		FLAT_VECTOR<const OutType*> parents;                        // Parent results while the chunks are scanned
+	};
+
+	// Parent to child fold in depth search order, the transform propagation of test_multiplyTransforms for any value type.
+	// out[i] = Op::root(values[i]) for roots and Op::combine(out[parent], values[i]) for the rest, out holds getCount() items.
+	// Op is a struct of static functions like the Sorter, so both calls are inlined. One pass, the ancestor stack is allocated
+	// by the call, pass an AncestorStack to keep it.
+	// multiThreaded cuts the nodes into equal chunks at any index and runs them with FLAT_PARALLEL_FOR, whatever the tree shape.
+	// It allocates the chunk buffers on every call, pass a ScanDownScratch instead to keep them.
+	template<typename Op, typename OutType>
+	void scanDown(OutType* out, bool multiThreaded = false) const
+	{
+		if (multiThreaded && getCount() > ScanChunkSize)
+		{
+			ScanDownScratch<OutType> scratch;
+			scanDown<Op>(out, scratch);
+			return;
+		}
+
+		AncestorStack stack;
+		scanDown<Op>(out, stack);
+	}
+
+	// Single threaded scanDown() with the ancestor stack of the caller
+	template<typename Op, typename OutType>
+	void scanDown(OutType* out, AncestorStack& ancestors) const
+	{
+		const SizeType count = getCount();
+		const DepthValue* depthData = depths.getPointer();
+		const ValueType* valueData = values.getPointer();
+		HierarchyIndex* stack = ancestors.getPointer();
+		SizeType stackSize = ancestors.getSize();
+
+		for (HierarchyIndex i = 0; i < count; i++)
+		{
+			const DepthValue depth = depthData[i];
+			if (depth >= stackSize)
+			{
+				flat_grow_ancestor_stack(ancestors, depth);
+				stack = ancestors.getPointer();
+				stackSize = ancestors.getSize();
+			}
+			out[i] = depth == 0 ? Op::root(valueData[i]) : Op::combine(out[stack[depth - 1]], valueData[i]);
+			stack[depth] = i;
+		}
+	}
+
+	// Multithreaded scanDown() with the chunk buffers of scratch. Trees up to one chunk are scanned on the calling thread.
+	// The chunk buffers hold a row for every depth, so this one finds the max depth first, O(1) with depth counts.
+	template<typename Op, typename OutType>
+	void scanDown(OutType* out, ScanDownScratch<OutType>& scratch) const
+	{
+		if (getCount() <= ScanChunkSize)
+		{
+			scanDown<Op>(out, scratch.ancestors);
+			return;
+		}
+
+		const SizeType rowCount = (SizeType)this->findMaxDepth() + 1;
+		scanDownChunks<Op>(out, rowCount, scratch);
+	}
+
+	// scanDown() of the subtree of index only, for when values inside it changed. out must be up to date before index.
+	// parent is the parent of index, getIndexNotFound() for a root. O(subtree size). Returns the index after the subtree.
+	template<typename Op, typename OutType>
+	HierarchyIndex scanDownSubtree(OutType* out, HierarchyIndex index, HierarchyIndex parent, AncestorStack& ancestors) const
+	{
+		FLAT_ASSERT(index < getCount());
+
+		const DepthValue* depthData = depths.getPointer();
+		const ValueType* valueData = values.getPointer();
+		const DepthValue subtreeDepth = depthData[index];
+		const HierarchyIndex end = (HierarchyIndex)flat_find_not_deeper(depthData, index + 1, getCount(), subtreeDepth);
+
+		flat_grow_ancestor_stack(ancestors, subtreeDepth);
+		HierarchyIndex* stack = ancestors.getPointer();
+		SizeType stackSize = ancestors.getSize();
+		if (subtreeDepth > 0)
+		{
+			// Nodes of the subtree only read the stack from the parent's depth on
+			FLAT_ASSERT(parent < index && depthData[parent] + 1 == subtreeDepth);
+			stack[subtreeDepth - 1] = parent;
+		}
+
+		for (HierarchyIndex i = index; i < end; i++)
+		{
+			const DepthValue depth = depthData[i];
+			if (depth >= stackSize)
+			{
+				flat_grow_ancestor_stack(ancestors, depth);
+				stack = ancestors.getPointer();
+				stackSize = ancestors.getSize();
+			}
+			out[i] = depth == 0 ? Op::root(valueData[i]) : Op::combine(out[stack[depth - 1]], valueData[i]);
+			stack[depth] = i;
+		}
+		return end;
+	}
+
+	template<typename Op, typename OutType>
+	HierarchyIndex scanDownSubtree(OutType* out, HierarchyIndex index, HierarchyIndex parent) const
+	{
+		AncestorStack stack;
+		return scanDownSubtree<Op>(out, index, parent, stack);
+	}
+
+	// Same when the parent is not known, it is found by walking back from index. O(subtree size + distance back to the parent).
+	template<typename Op, typename OutType>
+	HierarchyIndex scanDownSubtree(OutType* out, HierarchyIndex index) const
+	{
+		FLAT_ASSERT(index < getCount());
+
+		HierarchyIndex parent = getIndexNotFound();
+		if (depths[index] > 0)
+		{
+			parent = index - 1;
+			while (depths[parent] >= depths[index])
+			{
+				--parent;
+			}
+		}
+		return scanDownSubtree<Op>(out, index, parent);
+	}
+
+	// Child to parent reduce, the subtree aggregate of every node: bounds, descendant counts, dirty flags. out holds getCount() items.
+	// out[i] starts as Op::leaf(values[i]) and every direct child is folded in with out[i] = Op::combine(out[i], out[child]) in child order,
+	// once the subtree of the child is complete. A node is complete when the walk leaves its subtree, so it is one front to back pass.
+	template<typename Op, typename OutType>
+	void reduceUp(OutType* out) const
+	{
+		reduceUp<Op>(values.getPointer(), out);
+	}
+
+	// Same with the leaves from in, which holds getCount() items. For example world bounds from the scanDown() world transforms.
+	template<typename Op, typename InType, typename OutType>
+	void reduceUp(const InType* in, OutType* out) const
+	{
+		AncestorStack stack;
+		flat_reduce_up<Op>(depths.getPointer(), getCount(), in, out, stack);
+	}
+
+private:
+	enum { ScanChunkSize = 16384 };
+
+	template<typename OutType>
+	struct ScanDownJob
+	{
+		const DepthValue* depths;
+		const ValueType* values;
+		OutType* out;
+		HierarchyIndex* lastAtDepth; // Last index on every depth inside the chunk
+		const OutType* carry;        // Results of the ancestors of the first node of the chunk
+		const OutType** parents;     // Parent results while the chunk is scanned
+		SizeType count;
+		SizeType rowCount;
+	};
+
+	// Like a parallel prefix scan. The ancestor of a node on a depth is the last index before it on that depth, so the chunks
+	// first record their last index on every depth in parallel. One pass over the chunks then chains those into the ancestors
+	// of every chunk start and folds their results, which costs chunkCount * maxDepth calls. Last, the chunks are scanned in parallel.
+	template<typename Op, typename OutType>
+	void scanDownChunks(OutType* out, SizeType rowCount, ScanDownScratch<OutType>& scratch) const
+	{
+		const SizeType count = getCount();
+		const SizeType chunkCount = (count + ScanChunkSize - 1) / ScanChunkSize;
+
+		scratch.carry.resize(chunkCount * rowCount);
+		scratch.parents.resize(chunkCount * rowCount);
+		scratch.lastAtDepth.resize(chunkCount * rowCount);
+		scratch.ancestors.resize(rowCount);
+
+		ScanDownJob<OutType> job;
+		job.depths = depths.getPointer();
+		job.values = values.getPointer();
+		job.out = out;
+		job.lastAtDepth = scratch.lastAtDepth.getPointer();
+		job.carry = scratch.carry.getPointer();
+		job.parents = scratch.parents.getPointer();
+		job.count = count;
+		job.rowCount = rowCount;
+		FLAT_PARALLEL_FOR((uint32_t)chunkCount, &findChunkLastAtDepth<OutType>, &job);
+
+		HierarchyIndex* stack = scratch.ancestors.getPointer();
+		for (SizeType chunk = 0; chunk < chunkCount; chunk++)
+		{
+			const HierarchyIndex start = chunk * ScanChunkSize;
+			OutType* chain = scratch.carry.getPointer() + chunk * rowCount;
+			for (DepthValue depth = 0; depth < job.depths[start]; depth++)
+			{
+				chain[depth] = depth == 0 ? Op::root(job.values[stack[0]]) : Op::combine(chain[depth - 1], job.values[stack[depth]]);
+			}
+
+			const HierarchyIndex* last = job.lastAtDepth + chunk * rowCount;
+			for (SizeType depth = 0; depth < rowCount; depth++)
+			{
+				if (last[depth] != getIndexNotFound())
+					stack[depth] = last[depth];
+			}
+		}
+
+		FLAT_PARALLEL_FOR((uint32_t)chunkCount, (&scanDownChunk<Op, OutType>), &job);
+	}
+
+	template<typename OutType>
+	static void findChunkLastAtDepth(void* context, uint32_t chunk)
+	{
+		const ScanDownJob<OutType>& job = *(const ScanDownJob<OutType>*)context;
+		const HierarchyIndex start = chunk * ScanChunkSize;
+		const HierarchyIndex end = start + ScanChunkSize < job.count ? start + ScanChunkSize : job.count;
+		HierarchyIndex* last = job.lastAtDepth + chunk * job.rowCount;
+
+		for (SizeType depth = 0; depth < job.rowCount; depth++)
+		{
+			last[depth] = getIndexNotFound();
+		}
+		for (HierarchyIndex i = start; i < end; i++)
+		{
+			last[job.depths[i]] = i;
+		}
+	}
+
+	template<typename Op, typename OutType>
+	static void scanDownChunk(void* context, uint32_t chunk)
+	{
+		const ScanDownJob<OutType>& job = *(const ScanDownJob<OutType>*)context;
+		const HierarchyIndex start = chunk * ScanChunkSize;
+		const HierarchyIndex end = start + ScanChunkSize < job.count ? start + ScanChunkSize : job.count;
+		const OutType* chain = job.carry + chunk * job.rowCount;
+		const OutType** parents = job.parents + chunk * job.rowCount;
+
+		for (DepthValue depth = 0; depth < job.depths[start]; depth++)
+		{
+			parents[depth] = chain + depth;
+		}
+		for (HierarchyIndex i = start; i < end; i++)
+		{
+			const DepthValue depth = job.depths[i];
+			job.out[i] = depth == 0 ? Op::root(job.values[i]) : Op::combine(*parents[depth - 1], job.values[i]);
+			parents[depth] = job.out + i;
+		}
+	}
 };
 
 
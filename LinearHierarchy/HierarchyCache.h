@@ -23,29 +23,256 @@
 	#define FLAT_MEMSET(dst, value, length) memset(dst, value, length)
 #endif
 
-static uint32_t getNextPowerOfTwo(uint32_t v)
+template<typename T>
+static T getNextPowerOfTwo(T v)
 {
-	FLAT_ASSERT((v & 0x80000000) == 0);
+	FLAT_ASSERT((v >> (sizeof(T) * 8 - 1)) == 0);
 
-	uint32_t r = 0;
+	T r = 0;
 	while (v >>= 1)
 	{
 		++r;
 	}
-	return 1 << (r + 1);
+	return T(1) << (r + 1);
 }
 
 
+// Builds one HierarchyCache row over [start, end): row[i] = depths[i] > rowNumber ? row[i - 1] + 1 : 0.
+// That is the distance back to the last node that is not deeper than rowNumber, so the SIMD version marks
+// those reset positions and carries their running maximum across the lanes (log-step) and from block to block.
+// reset is the last index before start that is not deeper than rowNumber. It is ignored when start is 0.
+template<typename DepthType, typename IndexType>
+void flat_build_cache_row_scalar(IndexType* row, const DepthType* depths, DepthType rowNumber, IndexType start, IndexType end, IndexType reset)
+{
+	for (IndexType i = start; i < end; i++)
+	{
+		if (depths[i] <= rowNumber)
+			reset = i;
+		row[i] = i - reset;
+	}
+}
+
+#if FLAT_USE_SIMD == true
+	// 4 depths zero extended to 32 bits
+	template<typename DepthType>
+	FLAT_TARGET_SSE41 inline __m128i flat_load_depths_epi32_sse41(const DepthType* depths)
+	{
+		enum { Bytes = sizeof(DepthType) }; // Make Bytes an enum to ensure it is used as compile-time constant
+
+		if (Bytes == 1)
+		{
+			int packed;
+			FLAT_MEMCPY(&packed, depths, sizeof(packed));
+			return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+		}
+		if (Bytes == 2)
+			return _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)depths));
+		return _mm_loadu_si128((const __m128i*)depths);
+	}
+
+	template<typename DepthType, typename IndexType>
+	FLAT_TARGET_SSE41 void flat_build_cache_row_sse41(IndexType* row, const DepthType* depths, DepthType rowNumber, IndexType start, IndexType end, IndexType reset)
+	{
+		const __m128i rowNumbers = _mm_set1_epi32((int)rowNumber);
+		const __m128i step = _mm_set1_epi32(4);
+		__m128i positions = _mm_setr_epi32((int)start, (int)start + 1, (int)start + 2, (int)start + 3);
+		__m128i carry = _mm_set1_epi32((int)reset);
+
+		IndexType i = start;
+		for (; i + 4 <= end; i += 4)
+		{
+			// Positions of nodes that are not deeper than rowNumber, 0 elsewhere, and their running maximum
+			__m128i resets = _mm_andnot_si128(_mm_cmpgt_epi32(flat_load_depths_epi32_sse41(depths + i), rowNumbers), positions);
+			resets = _mm_max_epu32(resets, _mm_slli_si128(resets, 4));
+			resets = _mm_max_epu32(resets, _mm_slli_si128(resets, 8));
+			resets = _mm_max_epu32(resets, carry);
+
+			_mm_storeu_si128((__m128i*)(row + i), _mm_sub_epi32(positions, resets));
+
+			carry = _mm_shuffle_epi32(resets, 0xFF);
+			positions = _mm_add_epi32(positions, step);
+		}
+
+		flat_build_cache_row_scalar(row, depths, rowNumber, i, end, (IndexType)_mm_cvtsi128_si32(carry));
+	}
+
+	template<typename DepthType, typename IndexType>
+	FLAT_TARGET_AVX2 void flat_build_cache_row_avx2(IndexType* row, const DepthType* depths, DepthType rowNumber, IndexType start, IndexType end, IndexType reset)
+	{
+		enum { Bytes = sizeof(DepthType) }; // Make Bytes an enum to ensure it is used as compile-time constant
+
+		const __m256i rowNumbers = _mm256_set1_epi32((int)rowNumber);
+		const __m256i step = _mm256_set1_epi32(8);
+		__m256i positions = _mm256_setr_epi32((int)start, (int)start + 1, (int)start + 2, (int)start + 3, (int)start + 4, (int)start + 5, (int)start + 6, (int)start + 7);
+		__m256i carry = _mm256_set1_epi32((int)reset);
+
+		IndexType i = start;
+		for (; i + 8 <= end; i += 8)
+		{
+			__m256i d;
+			if (Bytes == 1)
+				d = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(depths + i)));
+			else if (Bytes == 2)
+				d = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(depths + i)));
+			else
+				d = _mm256_loadu_si256((const __m256i*)(depths + i));
+
+			// Running maximum inside both 128 bit lanes, then from the low lane to the high lane and from the previous block
+			__m256i resets = _mm256_andnot_si256(_mm256_cmpgt_epi32(d, rowNumbers), positions);
+			resets = _mm256_max_epu32(resets, _mm256_slli_si256(resets, 4));
+			resets = _mm256_max_epu32(resets, _mm256_slli_si256(resets, 8));
+			const __m256i lowLast = _mm256_shuffle_epi32(resets, 0xFF);
+			resets = _mm256_max_epu32(resets, _mm256_permute2x128_si256(lowLast, lowLast, 0x08));
+			resets = _mm256_max_epu32(resets, carry);
+
+			_mm256_storeu_si256((__m256i*)(row + i), _mm256_sub_epi32(positions, resets));
+
+			carry = _mm256_permutevar8x32_epi32(resets, _mm256_set1_epi32(7));
+			positions = _mm256_add_epi32(positions, step);
+		}
+
+		flat_build_cache_row_sse41(row, depths, rowNumber, i, end, (IndexType)_mm_cvtsi128_si32(_mm256_castsi256_si128(carry)));
+	}
+#endif
+
+// Picks the kernel for the detected level. Depths wider than 4 bytes and indices other than 4 bytes use the scalar loop.
+template<typename DepthType, typename IndexType>
+void flat_build_cache_row(IndexType* row, const DepthType* depths, DepthType rowNumber, IndexType start, IndexType end, IndexType reset)
+{
+	if (start == 0 && start < end)
+	{
+		row[0] = 0;
+		reset = 0;
+		++start;
+	}
+
+#if FLAT_USE_SIMD == true
+	enum { DepthBytes = sizeof(DepthType), IndexBytes = sizeof(IndexType) }; // Enums to ensure these are used as compile-time constants
+
+	if ((DepthBytes == 1 || DepthBytes == 2 || DepthBytes == 4) && IndexBytes == 4)
+	{
+		const int level = flat_get_simd_level();
+		if (level >= FLAT_SIMD_AVX2)
+			return flat_build_cache_row_avx2(row, depths, rowNumber, start, end, reset);
+		if (level >= FLAT_SIMD_SSE41)
+			return flat_build_cache_row_sse41(row, depths, rowNumber, start, end, reset);
+	}
+#endif
+	flat_build_cache_row_scalar(row, depths, rowNumber, start, end, reset);
+}
+
+// Moves count values from source to dest like memmove and adds offset to every value except getIndexNotFound() (all bits set).
+// The patched array caches shift their tail with this after an insert or an erase. Loads run ahead of the stores in the
+// direction of the move, so the ranges may overlap.
+template<typename IndexType>
+void flat_shift_values_scalar(IndexType* dest, const IndexType* source, uintptr_t count, IndexType offset)
+{
+	const IndexType notFound = IndexType(~IndexType(0));
+	if (dest < source)
+	{
+		for (uintptr_t i = 0; i < count; i++)
+		{
+			const IndexType value = source[i];
+			dest[i] = value + (value != notFound ? offset : IndexType(0));
+		}
+	}
+	else
+	{
+		for (uintptr_t i = count; i > 0; i--)
+		{
+			const IndexType value = source[i - 1];
+			dest[i - 1] = value + (value != notFound ? offset : IndexType(0));
+		}
+	}
+}
+
+#if FLAT_USE_SIMD == true
+	template<typename IndexType>
+	FLAT_TARGET_SSE41 void flat_shift_values_sse41(IndexType* dest, const IndexType* source, uintptr_t count, IndexType offset)
+	{
+		const __m128i offsets = _mm_set1_epi32((int)offset);
+		const __m128i notFound = _mm_set1_epi32(-1);
+		if (dest < source)
+		{
+			uintptr_t i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				const __m128i v = _mm_loadu_si128((const __m128i*)(source + i));
+				_mm_storeu_si128((__m128i*)(dest + i), _mm_add_epi32(v, _mm_andnot_si128(_mm_cmpeq_epi32(v, notFound), offsets)));
+			}
+			flat_shift_values_scalar(dest + i, source + i, count - i, offset);
+		}
+		else
+		{
+			uintptr_t i = count;
+			for (; i >= 4; i -= 4)
+			{
+				const __m128i v = _mm_loadu_si128((const __m128i*)(source + i - 4));
+				_mm_storeu_si128((__m128i*)(dest + i - 4), _mm_add_epi32(v, _mm_andnot_si128(_mm_cmpeq_epi32(v, notFound), offsets)));
+			}
+			flat_shift_values_scalar(dest, source, i, offset);
+		}
+	}
+
+	template<typename IndexType>
+	FLAT_TARGET_AVX2 void flat_shift_values_avx2(IndexType* dest, const IndexType* source, uintptr_t count, IndexType offset)
+	{
+		const __m256i offsets = _mm256_set1_epi32((int)offset);
+		const __m256i notFound = _mm256_set1_epi32(-1);
+		if (dest < source)
+		{
+			uintptr_t i = 0;
+			for (; i + 8 <= count; i += 8)
+			{
+				const __m256i v = _mm256_loadu_si256((const __m256i*)(source + i));
+				_mm256_storeu_si256((__m256i*)(dest + i), _mm256_add_epi32(v, _mm256_andnot_si256(_mm256_cmpeq_epi32(v, notFound), offsets)));
+			}
+			flat_shift_values_sse41(dest + i, source + i, count - i, offset);
+		}
+		else
+		{
+			uintptr_t i = count;
+			for (; i >= 8; i -= 8)
+			{
+				const __m256i v = _mm256_loadu_si256((const __m256i*)(source + i - 8));
+				_mm256_storeu_si256((__m256i*)(dest + i - 8), _mm256_add_epi32(v, _mm256_andnot_si256(_mm256_cmpeq_epi32(v, notFound), offsets)));
+			}
+			flat_shift_values_sse41(dest, source, i, offset);
+		}
+	}
+#endif
+
+// Picks the kernel for the detected level. Indices other than 4 bytes use the scalar loop.
+template<typename IndexType>
+void flat_shift_values(IndexType* dest, const IndexType* source, uintptr_t count, IndexType offset)
+{
+#if FLAT_USE_SIMD == true
+	enum { IndexBytes = sizeof(IndexType) }; // Enum to ensure it is used as compile-time constant
+
+	if (IndexBytes == 4)
+	{
+		const int level = flat_get_simd_level();
+		if (level >= FLAT_SIMD_AVX2)
+			return flat_shift_values_avx2(dest, source, count, offset);
+		if (level >= FLAT_SIMD_SSE41)
+			return flat_shift_values_sse41(dest, source, count, offset);
+	}
+#endif
+	flat_shift_values_scalar(dest, source, count, offset);
+}
+
+template<typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
 struct HierarchyCache
 {
-	typedef FLAT_SIZETYPE SizeType;
+	typedef FlatHierarchyBase<DepthType, IndexType> Hierarchy;
+	typedef IndexType SizeType;
 	typedef SizeType RelativeParentIndex;
-	typedef FLAT_DEPTHTYPE RowIndex;
+	typedef DepthType RowIndex;
 	typedef SizeType ColumnIndex;
 
 	struct Row
 	{
-		typedef FLAT_SIZETYPE SizeType;
+		typedef IndexType SizeType;
 		typedef SizeType RelativeParentIndex;
 		typedef SizeType ColumnIndex;
 
@@ -122,12 +349,14 @@ public:
 		: cacheIsValid(false)
 		, rowCapacity(0)
 		, columnCapacity(0)
+		, builtRowCount(0)
 	{
 	}
 	HierarchyCache(RowIndex reserveRows, ColumnIndex reserveColumns)
 		: cacheIsValid(false)
 		, rowCapacity(0)
 		, columnCapacity(0)
+		, builtRowCount(0)
 	{
 		reserve(reserveRows, reserveColumns);
 	}
@@ -139,8 +368,8 @@ public:
 		}
 	}
 
-	FLAT_VECTOR<Buffer> buffers;
-	FLAT_VECTOR<Row> cacheRows;
+	FLAT_INDEXED_VECTOR(Buffer, SizeType) buffers;
+	FLAT_INDEXED_VECTOR(Row, SizeType) cacheRows;
 
 	// This is set to false after reserve messes up the cache. User can also set it to false.
 	// Automatically becomes true when makeCacheValid() is run.
@@ -148,11 +377,22 @@ public:
 private:
 	RowIndex rowCapacity;
 	SizeType columnCapacity;
+	RowIndex builtRowCount; // Rows that can hold values, the ones after it are all zero
 public:
 	SizeType DEBUG_getColumnCapacity() const
 	{
 		return columnCapacity;
 	}
+	// In bytes
+	uintptr_t getMemoryUsage() const
+	{
+		uintptr_t result = 0;
+		for (SizeType i = 0; i < buffers.getSize(); i++)
+		{
+			result += uintptr_t(buffers[i].capacity) * sizeof(RelativeParentIndex);
+		}
+		return result;
+	}
 	void reserve(RowIndex reserveRows, SizeType reserveColumns)
 	{
 		if (reserveRows <= rowCapacity && reserveColumns <= columnCapacity)
@@ -187,7 +427,7 @@ public:
 
 					for (RowIndex row = oldRowCount; row < cacheRows.getSize(); row++)
 					{
-						FLAT_MEMSET(cacheRows[row].cacheValues, 0, sizeof(Row::RelativeParentIndex) * columnCapacity);
+						FLAT_MEMSET(cacheRows[row].cacheValues, 0, sizeof(RelativeParentIndex) * columnCapacity);
 					}
 				}
 			}
@@ -218,7 +458,7 @@ public:
 		if (reserveRows > rowCapacity)
 		{
 			rowCapacity = reserveRows;
-			targetRowCount = (reserveRows + 1024 / columnCapacity) > FLAT_MAXDEPTH ? FLAT_MAXDEPTH : (RowIndex)(reserveRows + 1024 / columnCapacity);
+			targetRowCount = (reserveRows + 1024 / columnCapacity) > Hierarchy::getMaxDepth() ? Hierarchy::getMaxDepth() : (RowIndex)(reserveRows + 1024 / columnCapacity);
 		}
 
 		cacheRows.clear();
@@ -270,12 +510,12 @@ public:
 
 		for (RowIndex row = 0; row < rowIndex; row++)
 		{
-			FLAT_MEMSET(cacheRows[row].cacheValues + columnIndex, 0, sizeof(Row::RelativeParentIndex) * (columnCapacity - columnIndex));
+			FLAT_MEMSET(cacheRows[row].cacheValues + columnIndex, 0, sizeof(RelativeParentIndex) * (columnCapacity - columnIndex));
 		}
 
 		for (RowIndex row = rowIndex; row < cacheRows.getSize(); row++)
 		{
-			FLAT_MEMSET(cacheRows[row].cacheValues, 0, sizeof(Row::RelativeParentIndex) * columnCapacity);
+			FLAT_MEMSET(cacheRows[row].cacheValues, 0, sizeof(RelativeParentIndex) * columnCapacity);
 		}
 	}
 
@@ -290,7 +530,8 @@ public:
 		FLAT_ASSERT(cacheIsValid);
 		return row(parentDepth).column(child);
 	}
-	void makeCacheValid(const FlatHierarchyBase& hierarchy, RowIndex maxDepth = 0)
+	// With multiThreaded the columns are split into tiles that are built with FLAT_PARALLEL_FOR
+	void makeCacheValid(const Hierarchy& hierarchy, RowIndex maxDepth = 0, bool multiThreaded = false)
 	{	
 		if (maxDepth == 0)
 			maxDepth = hierarchy.findMaxDepth();
@@ -304,66 +545,248 @@ public:
 
 		clearValuesOutSide(maxDepth, hierarchy.getCount());
 
-		for (RowIndex rowNumber = 0; rowNumber < maxDepth; rowNumber++)
+		builtRowCount = maxDepth;
+		buildColumns(hierarchy, maxDepth, 0, hierarchy.getCount(), multiThreaded);
+	}
+
+	// Rebuilds the rows up to the deepest node so far, or of the updated columns if they went deeper. Rows below every node
+	// are all zero, so they stay valid. The hierarchy must not have grown deeper than the reserved rows since makeCacheValid().
+	void partialUpdate(const Hierarchy& hierarchy, ColumnIndex startColumn, ColumnIndex endColumn, bool multiThreaded = false)
+	{
+		FLAT_ASSERT(endColumn <= hierarchy.getCount());
+		FLAT_DEBUG_ASSERT(hierarchy.findMaxDepth() <= rowCapacity);
+
+		//printf("partialCacheUpdate: start: %d, count: %d\n", startColumn, endColumn - startColumn);
+
+		if (startColumn < endColumn)
+		{
+			const RowIndex columnDepth = (RowIndex)flat_reduce_depths<true>(hierarchy.depths.getPointer() + startColumn, endColumn - startColumn, (DepthType)0U);
+			if (columnDepth > builtRowCount)
+				builtRowCount = columnDepth;
+		}
+		FLAT_ASSERT(builtRowCount <= cacheRows.getSize());
+
+		buildColumns(hierarchy, builtRowCount, startColumn, endColumn, multiThreaded);
+	}
+
+private:
+	enum { TileColumns = 16384 }; // Keeps a tile's depths in L2 while its rows are filled
+
+	struct TileJob
+	{
+		HierarchyCache* cache;
+		const DepthType* depths;
+		const ColumnIndex* tileResets;
+		RowIndex rowCount;
+		ColumnIndex startColumn;
+		ColumnIndex endColumn;
+	};
+
+	FLAT_INDEXED_VECTOR(ColumnIndex, SizeType) tileResets; // Scratch for buildColumns, rowCount resets per tile
+	FLAT_INDEXED_VECTOR(ColumnIndex, SizeType) lastAtDepth; // Scratch for buildColumns
+
+	// Last index before startColumn that is not deeper than rowNumber
+	ColumnIndex getReset(RowIndex rowNumber, ColumnIndex startColumn) const
+	{
+		return startColumn > 0 ? startColumn - 1 - row(rowNumber).column(startColumn - 1) : 0;
+	}
+
+	void buildColumns(const Hierarchy& hierarchy, RowIndex rowCount, ColumnIndex startColumn, ColumnIndex endColumn, bool multiThreaded)
+	{
+		const DepthType* depths = hierarchy.depths.getPointer();
+
+		if (!multiThreaded || endColumn - startColumn <= TileColumns)
+		{
+			for (RowIndex rowNumber = 0; rowNumber < rowCount; rowNumber++)
+			{
+				flat_build_cache_row(row(rowNumber).cacheValues, depths, rowNumber, startColumn, endColumn, getReset(rowNumber, startColumn));
+			}
+			return;
+		}
+
+		// Every row of a tile continues from the last index that is not deeper than the row.
+		// If the node before the tile is deeper than the row, that is its ancestor at the row's depth, which is
+		// the last index at exactly that depth. One sequential pass over the depths tracks those for every tile.
+		const ColumnIndex tileCount = (endColumn - startColumn + TileColumns - 1) / TileColumns;
+		tileResets.resize(tileCount * rowCount);
+		lastAtDepth.resize(rowCount);
+		for (RowIndex rowNumber = 0; rowNumber < rowCount; rowNumber++)
 		{
-			Row& row = this->row(rowNumber);
+			lastAtDepth[rowNumber] = getReset(rowNumber, startColumn);
+		}
+
+		for (ColumnIndex tile = 0; tile < tileCount; tile++)
+		{
+			const ColumnIndex tileStart = startColumn + tile * TileColumns;
+			const ColumnIndex tileEnd = tileStart + TileColumns < endColumn ? tileStart + TileColumns : endColumn;
+			ColumnIndex* resets = tileResets.getPointer() + tile * rowCount;
 
-			row.column(0) = 0;
-			for (ColumnIndex i = 1; i < hierarchy.getCount(); i++)
+			if (tileStart == 0)
 			{
-				if (hierarchy.depths[i] > rowNumber)
+				for (RowIndex rowNumber = 0; rowNumber < rowCount; rowNumber++)
 				{
-					row.column(i) = row.column(i - 1) + 1;
+					resets[rowNumber] = 0;
 				}
-				else
+			}
+			else
+			{
+				for (RowIndex rowNumber = 0; rowNumber < rowCount; rowNumber++)
 				{
-					row.column(i) = 0;
+					resets[rowNumber] = depths[tileStart - 1] <= rowNumber ? tileStart - 1 : lastAtDepth[rowNumber];
 				}
 			}
+
+			for (ColumnIndex i = tileStart; i < tileEnd; i++)
+			{
+				if (depths[i] < rowCount)
+					lastAtDepth[depths[i]] = i;
+			}
 		}
+
+		TileJob job;
+		job.cache = this;
+		job.depths = depths;
+		job.tileResets = tileResets.getPointer();
+		job.rowCount = rowCount;
+		job.startColumn = startColumn;
+		job.endColumn = endColumn;
+		FLAT_PARALLEL_FOR((uint32_t)tileCount, &buildTile, &job);
 	}
 
-	void partialUpdate(const FlatHierarchyBase& hierarchy, ColumnIndex startColumn, ColumnIndex endColumn)
+	static void buildTile(void* context, uint32_t tile)
 	{
-		FLAT_ASSERT(endColumn <= hierarchy.getCount());
+		const TileJob& job = *(const TileJob*)context;
+		const ColumnIndex tileStart = job.startColumn + tile * TileColumns;
+		const ColumnIndex tileEnd = tileStart + TileColumns < job.endColumn ? tileStart + TileColumns : job.endColumn;
+		const ColumnIndex* resets = job.tileResets + tile * job.rowCount;
 
-		//printf("partialCacheUpdate: start: %d, count: %d\n", startColumn, endColumn - startColumn);
+		for (RowIndex rowNumber = 0; rowNumber < job.rowCount; rowNumber++)
+		{
+			flat_build_cache_row(job.cache->row(rowNumber).cacheValues, job.depths, rowNumber, tileStart, tileEnd, resets[rowNumber]);
+		}
+	}
+};
+
+// Alternative to HierarchyCache that answers the same queries with binary lifting (jump pointers).
+// Level k holds the 2^k:th ancestor of every node, so memory is O(N * log(MaxDepth)) instead of O(N * MaxDepth)
+// and queries are O(log(MaxDepth)) instead of O(1).
+template<typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
+struct AncestorCache
+{
+	typedef FlatHierarchyBase<DepthType, IndexType> Hierarchy;
+	typedef IndexType SizeType;
+	typedef SizeType RelativeParentIndex;
+	typedef DepthType RowIndex;
+	typedef SizeType ColumnIndex;
+	typedef typename Hierarchy::HierarchyIndex HierarchyIndex;
+	typedef typename Hierarchy::DepthValue DepthValue;
+
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) jumps; // levelCount rows of nodeCount ancestors
+	FLAT_INDEXED_VECTOR(DepthValue, SizeType) depths;
+	SizeType nodeCount;
+	SizeType levelCount;
+	bool cacheIsValid;
+
+	AncestorCache()
+		: nodeCount(0)
+		, levelCount(0)
+		, cacheIsValid(false)
+	{
+	}
+
+	// O(N * log(MaxDepth)) in a single pass. The ancestors of the current node are kept in a stack indexed by depth,
+	// so every jump is read straight from the stack instead of chasing the lower levels.
+	void makeCacheValid(const Hierarchy& hierarchy)
+	{
+		cacheIsValid = true;
+		nodeCount = hierarchy.getCount();
+
+		DepthValue maxDepth = 0;
+		depths.resize(nodeCount);
+		for (HierarchyIndex i = 0; i < nodeCount; i++)
+		{
+			depths[i] = hierarchy.depths[i];
+			if (maxDepth < depths[i])
+				maxDepth = depths[i];
+		}
 
-		for (RowIndex rowNumber = 0, end = hierarchy.findMaxDepth(); rowNumber < end; rowNumber++)
+		levelCount = 0;
+		while ((SizeType(1) << levelCount) <= SizeType(maxDepth))
 		{
-			Row& row = this->row(rowNumber);
+			++levelCount;
+		}
 
-			ColumnIndex i = startColumn;
-			if (i == 0)
-			{
-				row.column(0) = 0;
-				++i;
-			}
+		jumps.resize(levelCount * nodeCount);
+		path.resize(SizeType(maxDepth) + 1);
+
+		HierarchyIndex* jumpValues = jumps.getPointer();
+		for (HierarchyIndex i = 0; i < nodeCount; i++)
+		{
+			const DepthValue depth = depths[i];
+			FLAT_ASSERT(i == 0 || depth <= depths[i - 1] + 1);
+			path[depth] = i;
 
-			for (; i < endColumn; i++)
+			for (SizeType level = 0; level < levelCount; level++)
 			{
-				if (hierarchy.depths[i] > rowNumber)
-				{
-					row.column(i) = row.column(i - 1) + 1;
-				}
-				else
-				{
-					row.column(i) = 0;
-				}
+				const SizeType climb = SizeType(1) << level;
+				jumpValues[level * nodeCount + i] = climb <= SizeType(depth) ? path[depth - climb] : Hierarchy::getIndexNotFound();
 			}
 		}
 	}
 
+	// O(log(MaxDepth)). Returns the ancestor of child at ancestorDepth, or child itself if it is not deeper than that.
+	HierarchyIndex getAncestorIndex(RowIndex ancestorDepth, HierarchyIndex child) const
+	{
+		FLAT_ASSERT(cacheIsValid);
+		FLAT_ASSERT(child < nodeCount);
+
+		if (depths[child] <= ancestorDepth)
+			return child;
+
+		SizeType climb = SizeType(depths[child] - ancestorDepth);
+		const HierarchyIndex* levelValues = jumps.getPointer();
+		while (climb > 0)
+		{
+			if ((climb & 1) != 0)
+				child = levelValues[child];
+			climb >>= 1;
+			levelValues += nodeCount;
+		}
+		return child;
+	}
+
+	// Same values as HierarchyCache: distance back to the ancestor at parentDepth, 0 if child is not deeper than parentDepth
+	inline ColumnIndex getParentIndex(RowIndex parentDepth, ColumnIndex child) const
+	{
+		return child - getAncestorIndex(parentDepth, child);
+	}
+
+	inline bool isChildOf(ColumnIndex child, ColumnIndex parent, RowIndex parentDepth) const
+	{
+		FLAT_ASSERT(cacheIsValid);
+		return (child - parent) == getParentIndex(parentDepth, child);
+	}
+
+	// In bytes
+	uintptr_t getMemoryUsage() const
+	{
+		return uintptr_t(jumps.getSize()) * sizeof(HierarchyIndex) + uintptr_t(depths.getSize()) * sizeof(DepthValue);
+	}
+
+private:
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) path; // Scratch for makeCacheValid
 };
 
+template<typename DepthType, typename IndexType>
 struct ArrayCache
 {
-	typedef FlatHierarchyBase::SizeType SizeType;
-	typedef FlatHierarchyBase::SizeType CacheValue;
-	typedef FlatHierarchyBase::HierarchyIndex HierarchyIndex;
-	typedef FlatHierarchyBase::DepthValue DepthValue;
+	typedef FlatHierarchyBase<DepthType, IndexType> Hierarchy;
+	typedef typename Hierarchy::SizeType SizeType;
+	typedef typename Hierarchy::SizeType CacheValue;
+	typedef typename Hierarchy::HierarchyIndex HierarchyIndex;
+	typedef typename Hierarchy::DepthValue DepthValue;
 
-	FLAT_VECTOR<CacheValue> cacheValues;
+	FLAT_INDEXED_VECTOR(CacheValue, SizeType) cacheValues;
 	bool cacheIsValid;
 
 	ArrayCache()
@@ -395,10 +818,19 @@ struct ArrayCache
 	}
 };
 
-struct NextSiblingCache : public ArrayCache
+template<typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
+struct NextSiblingCache : public ArrayCache<DepthType, IndexType>
 {
+	typedef ArrayCache<DepthType, IndexType> Base;
+	typedef typename Base::Hierarchy Hierarchy;
+	typedef typename Base::SizeType SizeType;
+	typedef typename Base::HierarchyIndex HierarchyIndex;
+
+	using Base::cacheValues;
+	using Base::cacheIsValid;
+
 	// O(MaxDepth/BufferCapacity * N)
-	void makeCacheValid(const FlatHierarchyBase& h)
+	void makeCacheValid(const Hierarchy& h)
 	{
 		cacheIsValid = true;
 		SizeType maxDepth = 0;
@@ -409,7 +841,7 @@ struct NextSiblingCache : public ArrayCache
 			return;
 
 		const HierarchyIndex lastIndex = h.getCount() - 1;
-		cacheValues[lastIndex] = FlatHierarchyBase::getIndexNotFound();
+		cacheValues[lastIndex] = Hierarchy::getIndexNotFound();
 
 		const SizeType BufferCapacity = (4096 / sizeof(HierarchyIndex)) < 1 ? 1 : 4096 / sizeof(HierarchyIndex);
 		for (SizeType currentDepth = 0; currentDepth <= maxDepth; currentDepth += BufferCapacity)
@@ -417,7 +849,7 @@ struct NextSiblingCache : public ArrayCache
 			HierarchyIndex buffer[BufferCapacity];
 			for (HierarchyIndex i = 0, end = BufferCapacity; i < end; i++)
 			{
-				buffer[i] = FlatHierarchyBase::getIndexNotFound();
+				buffer[i] = Hierarchy::getIndexNotFound();
 			}
 
 			SizeType previousDepthValue = h.depths[lastIndex];
@@ -435,7 +867,7 @@ struct NextSiblingCache : public ArrayCache
 					if (d < previousDepthValue) // Depth decreases
 					{
 						FLAT_ASSERT(d + 1 == previousDepthValue && "Depth should never decrease by more than 1 when iterating backwards.");
-						buffer[previousDepthValue - currentDepth] = FlatHierarchyBase::getIndexNotFound();
+						buffer[previousDepthValue - currentDepth] = Hierarchy::getIndexNotFound();
 					}
 				}
 
@@ -454,98 +886,816 @@ struct NextSiblingCache : public ArrayCache
 		FLAT_ASSERT(index < cacheValues.getSize());
 		return cacheValues[index];
 	}
-	HierarchyIndex getNextSibling(const FlatHierarchyBase& h, HierarchyIndex index)
+	HierarchyIndex getNextSibling(const Hierarchy& h, HierarchyIndex index)
 	{
 		FLAT_ASSERT(index < h.getCount());
 		if (!cacheIsValid)
 			makeCacheValid(h);
 		return getNextSibling(index);
 	}
-};
-
-
-
-
 
-struct LastDescendantCache : public ArrayCache
-{
-	// O(MaxDepth/BufferCapacity * N)
-	void makeCacheValid(const FlatHierarchyBase& h)
+	// One past the last descendant of index. O(1) unless index is the last of its siblings, then O(Descendants)
+	HierarchyIndex getSubtreeEnd(const Hierarchy& h, HierarchyIndex index)
 	{
-		cacheIsValid = true;
-		SizeType maxDepth = 0;
+		HierarchyIndex result = getNextSibling(h, index);
+		if (result != Hierarchy::getIndexNotFound())
+			return result;
 
-		cacheValues.resize(h.getCount());
+		result = index + 1;
+		while (result < h.getCount() && h.depths[result] > h.depths[index])
+		{
+			++result;
+		}
+		return result;
+	}
 
-		if (h.getCount() == 0)
-			return;
+	// The functions below patch a valid cache after a mutation instead of rebuilding it.
+	// Indices behind the edit point are offset and only the previous sibling of the edited range is relinked.
+	// Nodes in front of the edit point can only link past it if they are its ancestors, which are found by walking the cache.
+	// Call them after mutating the hierarchy, while the cache still describes the hierarchy before the mutation.
 
-		const HierarchyIndex lastIndex = h.getCount() - 1;
-		cacheValues[lastIndex] = lastIndex;
+	// A leaf was inserted to index as a child of parent (getIndexNotFound() for a root)
+	void insertLeaf(const Hierarchy& h, HierarchyIndex index, HierarchyIndex parent)
+	{
+		FLAT_ASSERT(cacheIsValid);
+		FLAT_ASSERT(index <= cacheValues.getSize());
+		FLAT_ASSERT(parent == Hierarchy::getIndexNotFound() || parent < index);
 
-		const SizeType BufferCapacity = (4096 / sizeof(HierarchyIndex)) < 1 ? 1 : 4096 / sizeof(HierarchyIndex);
-		for (SizeType currentDepth = 0; currentDepth <= maxDepth; currentDepth += BufferCapacity)
+		HierarchyIndex previous = Hierarchy::getIndexNotFound();
+		HierarchyIndex firstSibling = 0;
+		if (parent != Hierarchy::getIndexNotFound())
 		{
-			HierarchyIndex buffer[BufferCapacity];
-			for (HierarchyIndex i = 0, end = BufferCapacity; i < end; i++)
+			findAncestors(parent);
+			ancestors.pushBack(parent);
+			for (SizeType i = 0; i < ancestors.getSize(); i++)
 			{
-				buffer[i] = lastIndex;
+				offsetValue(ancestors[i], index, 1);
 			}
+			firstSibling = parent + 1;
+		}
 
-			SizeType previousDepthValue = h.depths[lastIndex];
-
-			for (HierarchyIndex i = lastIndex; i-- > 0; )
+		if (firstSibling < index)
+		{
+			previous = firstSibling;
+			while (cacheValues[previous] < index)
 			{
-				SizeType d = (SizeType)(h.depths[i]);
-				if (d - currentDepth < BufferCapacity)
-				{
-					if (d == previousDepthValue)    // Depth stays the same
-					{
-						cacheValues[i] = i;
-					}
-					else if (d > previousDepthValue) // Depth increases
-					{
-						cacheValues[i] = i;
-						buffer[d - currentDepth] = i;
-						for (SizeType d2 = previousDepthValue; d2 <= d; ++d2)
-						{
-							buffer[d2 - currentDepth] = i;
-						}
-					}
-					else                             // Depth decreases
-					{
-						cacheValues[i] = buffer[d - currentDepth];
-						for (SizeType d2 = d; d2 <= previousDepthValue; ++d2)
-						{
-							buffer[d2 - currentDepth] = i;
-						}
-					}
-				}
-
-				previousDepthValue = d;
-
-				if (maxDepth < d)
-					maxDepth = d;
+				previous = cacheValues[previous];
 			}
 		}
+
+		const SizeType oldCount = cacheValues.getSize();
+		cacheValues.pushBack(0);
+		shiftValues(index + 1, index, oldCount - index, 1);
+
+		cacheValues[index] = index + 1 < h.getCount() && h.depths[index + 1] == h.depths[index] ? index + 1 : Hierarchy::getIndexNotFound();
+		if (previous != Hierarchy::getIndexNotFound())
+			cacheValues[previous] = index;
+
+		debugCheck(h);
 	}
 
-	// O(1)
-	HierarchyIndex getLastDescendant(HierarchyIndex index) const
+	// The subtree of count nodes starting at index was erased
+	void eraseSubtree(const Hierarchy& h, HierarchyIndex index, SizeType count)
 	{
 		FLAT_ASSERT(cacheIsValid);
-		FLAT_ASSERT(index < cacheValues.getSize());
-		return cacheValues[index];
+		FLAT_ASSERT(index + count <= cacheValues.getSize());
+
+		const HierarchyIndex previous = findAncestors(index);
+		for (SizeType i = 0; i < ancestors.getSize(); i++)
+		{
+			offsetValue(ancestors[i], index, CacheValue(0) - count);
+		}
+		if (previous != Hierarchy::getIndexNotFound())
+		{
+			cacheValues[previous] = cacheValues[index];
+			offsetValue(previous, index, CacheValue(0) - count);
+		}
+
+		const SizeType newCount = cacheValues.getSize() - count;
+		shiftValues(index, index + count, newCount - index, CacheValue(0) - count);
+		cacheValues.resize(newCount);
+
+		debugCheck(h);
 	}
-	HierarchyIndex getLastDescendant(const FlatHierarchyBase& h, HierarchyIndex index)
+
+	// The subtree of count nodes starting at source was moved with FlatHierarchy::move(source, dest, count) and made a child of newParent
+	void moveSubtree(const Hierarchy& h, HierarchyIndex source, HierarchyIndex dest, SizeType count, HierarchyIndex newParent)
 	{
-		FLAT_ASSERT(index < h.getCount());
+		FLAT_ASSERT(cacheIsValid);
+		FLAT_ASSERT(source + count <= cacheValues.getSize() && newParent < cacheValues.getSize());
+		FLAT_ASSERT(dest <= source || dest >= source + count);
+		FLAT_ASSERT(newParent < source || newParent >= source + count);
+
+		const HierarchyIndex low = source < dest ? source : dest;
+		const HierarchyIndex mid = source < dest ? source + count : source;
+		const HierarchyIndex high = source < dest ? dest : source + count;
+		const HierarchyIndex newSource = source < dest ? dest - count : dest;
+
+		// Old and new ancestors share a path from the root, so the common part is only remapped once
+		const HierarchyIndex oldPrevious = findAncestors(source);
+		const HierarchyIndex oldNext = cacheValues[source];
+		const SizeType oldAncestorCount = ancestors.getSize();
+		findAncestors(newParent, oldAncestorCount);
+		ancestors.pushBack(newParent);
+
+		SizeType common = 0;
+		while (common < oldAncestorCount && oldAncestorCount + common < ancestors.getSize() && ancestors[common] == ancestors[oldAncestorCount + common])
+		{
+			++common;
+		}
+
+		HierarchyIndex newPrevious = Hierarchy::getIndexNotFound();
+		if (newParent + 1 < dest)
+		{
+			newPrevious = newParent + 1;
+			while (cacheValues[newPrevious] < dest)
+			{
+				newPrevious = cacheValues[newPrevious];
+			}
+		}
+
+		// Everything in [low, high) and the ancestors in front of it may point into the rotated range
+		for (SizeType i = 0; i < ancestors.getSize(); i++)
+		{
+			if ((i < oldAncestorCount || i >= oldAncestorCount + common) && ancestors[i] < low)
+				cacheValues[ancestors[i]] = mapMovedIndex(cacheValues[ancestors[i]], source, dest, count);
+		}
+		CacheValue* values = cacheValues.getPointer();
+		for (HierarchyIndex i = low; i < high; i++)
+		{
+			values[i] = mapMovedIndex(values[i], source, dest, count);
+		}
+		flat_rotate(values, low, mid, high);
+
+		// Relink the siblings around the old and the new position
+		if (oldPrevious != Hierarchy::getIndexNotFound())
+			cacheValues[mapMovedIndex(oldPrevious, source, dest, count)] = mapMovedIndex(oldNext, source, dest, count);
+		cacheValues[newSource] = newSource + count < h.getCount() && h.depths[newSource + count] == h.depths[newSource] ? newSource + count : Hierarchy::getIndexNotFound();
+		if (newPrevious != Hierarchy::getIndexNotFound())
+			cacheValues[mapMovedIndex(newPrevious, source, dest, count)] = newSource;
+
+		debugCheck(h);
+	}
+
+private:
+	typedef typename Base::CacheValue CacheValue;
+
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) ancestors; // Scratch for findAncestors
+
+	// Adds offset to a value that points to index or past it
+	void offsetValue(HierarchyIndex at, HierarchyIndex index, CacheValue offset)
+	{
+		if (cacheValues[at] != Hierarchy::getIndexNotFound() && cacheValues[at] >= index)
+			cacheValues[at] += offset;
+	}
+
+	// Moves count values from source to dest like memmove while adding offset to the ones that are not getIndexNotFound()
+	void shiftValues(HierarchyIndex dest, HierarchyIndex source, SizeType count, CacheValue offset)
+	{
+		CacheValue* values = cacheValues.getPointer();
+		flat_shift_values(values + dest, values + source, count, offset);
+	}
+
+	// Where index ends up after FlatHierarchy::move(source, dest, count)
+	static HierarchyIndex mapMovedIndex(HierarchyIndex index, HierarchyIndex source, HierarchyIndex dest, SizeType count)
+	{
+		if (index == Hierarchy::getIndexNotFound())
+			return index;
+		if (index >= source && index < source + count)
+			return source < dest ? index + (dest - count - source) : index - (source - dest);
+		if (source < dest && index >= source + count && index < dest)
+			return index - count;
+		if (dest < source && index >= dest && index < source)
+			return index + count;
+		return index;
+	}
+
+	// Collects the ancestors of index from the root down to ancestors[keep...] and returns its previous sibling. O(Depth * Siblings)
+	HierarchyIndex findAncestors(HierarchyIndex index, SizeType keep = 0)
+	{
+		ancestors.resize(keep);
+
+		HierarchyIndex previous = Hierarchy::getIndexNotFound();
+		HierarchyIndex current = 0;
+		for (;;)
+		{
+			FLAT_ASSERT(current < cacheValues.getSize());
+			while (cacheValues[current] <= index)
+			{
+				previous = current;
+				current = cacheValues[current];
+			}
+			FLAT_ASSERT(current <= index);
+
+			if (current == index)
+				return previous;
+
+			ancestors.pushBack(current);
+			previous = Hierarchy::getIndexNotFound();
+			++current;
+		}
+	}
+
+	void debugCheck(const Hierarchy& h)
+	{
+#ifdef _DEBUG
+		{ // Correctness check
+			FLAT_ASSERT(cacheValues.getSize() == h.getCount());
+			NextSiblingCache check;
+			check.makeCacheValid(h);
+			for (HierarchyIndex i = 0; i < h.getCount(); i++)
+			{
+				FLAT_ASSERT(check.cacheValues[i] == cacheValues[i]);
+			}
+		}
+#endif
+	}
+};
+
+
+
+
+
+template<typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
+struct LastDescendantCache : public ArrayCache<DepthType, IndexType>
+{
+	typedef ArrayCache<DepthType, IndexType> Base;
+	typedef typename Base::Hierarchy Hierarchy;
+	typedef typename Base::SizeType SizeType;
+	typedef typename Base::HierarchyIndex HierarchyIndex;
+
+	using Base::cacheValues;
+	using Base::cacheIsValid;
+
+	// O(MaxDepth/BufferCapacity * N)
+	void makeCacheValid(const Hierarchy& h)
+	{
+		cacheIsValid = true;
+		SizeType maxDepth = 0;
+
+		cacheValues.resize(h.getCount());
+
+		if (h.getCount() == 0)
+			return;
+
+		const HierarchyIndex lastIndex = h.getCount() - 1;
+		cacheValues[lastIndex] = lastIndex;
+
+		const SizeType BufferCapacity = (4096 / sizeof(HierarchyIndex)) < 1 ? 1 : 4096 / sizeof(HierarchyIndex);
+		for (SizeType currentDepth = 0; currentDepth <= maxDepth; currentDepth += BufferCapacity)
+		{
+			HierarchyIndex buffer[BufferCapacity];
+			for (HierarchyIndex i = 0, end = BufferCapacity; i < end; i++)
+			{
+				buffer[i] = lastIndex;
+			}
+
+			SizeType previousDepthValue = h.depths[lastIndex];
+
+			for (HierarchyIndex i = lastIndex; i-- > 0; )
+			{
+				SizeType d = (SizeType)(h.depths[i]);
+				if (d - currentDepth < BufferCapacity)
+				{
+					if (d == previousDepthValue)    // Depth stays the same
+					{
+						cacheValues[i] = i;
+					}
+					else if (d > previousDepthValue) // Depth increases
+					{
+						cacheValues[i] = i;
+						buffer[d - currentDepth] = i;
+						for (SizeType d2 = previousDepthValue; d2 <= d; ++d2)
+						{
+							buffer[d2 - currentDepth] = i;
+						}
+					}
+					else                             // Depth decreases
+					{
+						cacheValues[i] = buffer[d - currentDepth];
+						for (SizeType d2 = d; d2 <= previousDepthValue; ++d2)
+						{
+							buffer[d2 - currentDepth] = i;
+						}
+					}
+				}
+
+				previousDepthValue = d;
+
+				if (maxDepth < d)
+					maxDepth = d;
+			}
+		}
+	}
+
+	// O(1)
+	HierarchyIndex getLastDescendant(HierarchyIndex index) const
+	{
+		FLAT_ASSERT(cacheIsValid);
+		FLAT_ASSERT(index < cacheValues.getSize());
+		return cacheValues[index];
+	}
+	HierarchyIndex getLastDescendant(const Hierarchy& h, HierarchyIndex index)
+	{
+		FLAT_ASSERT(index < h.getCount());
 		if (!cacheIsValid)
 			makeCacheValid(h);
 		return getLastDescendant(index);
 	}
+
+	// The functions below patch a valid cache after a mutation instead of rebuilding it.
+	// A node's cache value only changes if its index shifts or it gains or loses descendants,
+	// so each patch is O(N - edit point) for the shift plus a walk down to the edited range.
+	// Call them after mutating the hierarchy, while the cache still describes the hierarchy before the mutation.
+
+	// A leaf was inserted to index as a child of parent (getIndexNotFound() for a root)
+	void insertLeaf(const Hierarchy& h, HierarchyIndex index, HierarchyIndex parent)
+	{
+		FLAT_ASSERT(cacheIsValid);
+		FLAT_ASSERT(index <= cacheValues.getSize());
+		FLAT_ASSERT(parent == Hierarchy::getIndexNotFound() || parent < index);
+
+		if (parent != Hierarchy::getIndexNotFound())
+		{
+			findAncestors(parent);
+			ancestors.pushBack(parent);
+			for (SizeType i = 0; i < ancestors.getSize(); i++)
+			{
+				cacheValues[ancestors[i]] += 1;
+			}
+		}
+
+		const SizeType oldCount = cacheValues.getSize();
+		cacheValues.pushBack(0);
+		shiftValues(index + 1, index, oldCount - index, 1);
+		cacheValues[index] = index;
+
+		debugCheck(h);
+	}
+
+	// The subtree starting at index was erased
+	void eraseSubtree(const Hierarchy& h, HierarchyIndex index)
+	{
+		FLAT_ASSERT(cacheIsValid);
+		FLAT_ASSERT(index < cacheValues.getSize());
+
+		const SizeType count = cacheValues[index] - index + 1;
+
+		findAncestors(index);
+		for (SizeType i = 0; i < ancestors.getSize(); i++)
+		{
+			cacheValues[ancestors[i]] -= count;
+		}
+
+		const SizeType newCount = cacheValues.getSize() - count;
+		shiftValues(index, index + count, newCount - index, CacheValue(0) - count);
+		cacheValues.resize(newCount);
+
+		debugCheck(h);
+	}
+
+	// The subtree starting at source was moved with FlatHierarchy::move(source, dest, count) and made a child of newParent.
+	// Uses the fact that a node's subtree size only changes by the moved count when it stops or starts being an ancestor.
+	void moveSubtree(const Hierarchy& h, HierarchyIndex source, HierarchyIndex dest, HierarchyIndex newParent)
+	{
+		FLAT_ASSERT(cacheIsValid);
+		FLAT_ASSERT(source < cacheValues.getSize() && newParent < cacheValues.getSize());
+
+		const SizeType count = cacheValues[source] - source + 1;
+		FLAT_ASSERT(dest <= source || dest >= source + count);
+		FLAT_ASSERT(newParent < source || newParent > cacheValues[source]);
+
+		// Old ancestors lose the subtree, new ancestors gain it. Both walks need the unpatched cache.
+		findAncestors(source);
+		const SizeType oldAncestorCount = ancestors.getSize();
+		findAncestors(newParent, oldAncestorCount);
+		ancestors.pushBack(newParent);
+
+		for (SizeType i = 0; i < ancestors.getSize(); i++)
+		{
+			if (i < oldAncestorCount)
+				cacheValues[ancestors[i]] -= count;
+			else
+				cacheValues[ancestors[i]] += count;
+		}
+
+		// Rotate the moved range like the hierarchy was rotated, storing values relative to their node in between
+		const HierarchyIndex low = source < dest ? source : dest;
+		const HierarchyIndex mid = source < dest ? source + count : source;
+		const HierarchyIndex high = source < dest ? dest : source + count;
+
+		CacheValue* values = cacheValues.getPointer();
+		for (HierarchyIndex i = low; i < high; i++)
+		{
+			values[i] -= i;
+		}
+		flat_rotate(values, low, mid, high);
+		for (HierarchyIndex i = low; i < high; i++)
+		{
+			values[i] += i;
+		}
+
+		debugCheck(h);
+	}
+
+	// The subtrees whose roots are marked in rootMarks (one bit per node, 32 per word) were erased.
+	// first is the smallest marked index.
+	void eraseSubtrees(const Hierarchy& h, const uint32_t* rootMarks, HierarchyIndex first)
+	{
+		FLAT_ASSERT(cacheIsValid);
+		FLAT_ASSERT(first < cacheValues.getSize());
+
+		struct OpenNode
+		{
+			HierarchyIndex newIndex;
+			HierarchyIndex oldLastDescendant;
+		};
+
+		// Nodes whose subtree is still open get their value when the walk passes their old last descendant.
+		// By then every erased node up to it has been counted. Writes stay behind reads, so this works in place.
+		FLAT_INDEXED_VECTOR(OpenNode, SizeType) open;
+
+		findAncestors(first);
+		for (SizeType i = 0; i < ancestors.getSize(); i++)
+		{
+			OpenNode node = { ancestors[i], cacheValues[ancestors[i]] };
+			open.pushBack(node);
+		}
+
+		const SizeType count = cacheValues.getSize();
+		CacheValue* values = cacheValues.getPointer();
+		SizeType erased = 0;
+		HierarchyIndex read = first;
+		while (read < count)
+		{
+			while (open.getSize() > 0 && open.getBack().oldLastDescendant < read)
+			{
+				values[open.getBack().newIndex] = open.getBack().oldLastDescendant - erased;
+				open.resize(open.getSize() - 1);
+			}
+
+			if ((rootMarks[read / 32] >> (read % 32) & 1) != 0)
+			{
+				erased += values[read] - read + 1;
+				read = values[read] + 1;
+				continue;
+			}
+
+			OpenNode node = { read - erased, values[read] };
+			open.pushBack(node);
+			++read;
+		}
+		while (open.getSize() > 0)
+		{
+			values[open.getBack().newIndex] = open.getBack().oldLastDescendant - erased;
+			open.resize(open.getSize() - 1);
+		}
+		cacheValues.resize(count - erased);
+
+		debugCheck(h);
+	}
+
+private:
+	typedef typename Base::CacheValue CacheValue;
+
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) ancestors; // Scratch for findAncestors
+
+	// Moves count values from source to dest like memmove while adding offset, so the shifted tail is only touched once.
+	// Last descendants are never getIndexNotFound(), so the kernel adds offset to all of them.
+	void shiftValues(HierarchyIndex dest, HierarchyIndex source, SizeType count, CacheValue offset)
+	{
+		CacheValue* values = cacheValues.getPointer();
+		flat_shift_values(values + dest, values + source, count, offset);
+	}
+
+	// Collects the ancestors of index from the root down to ancestors[keep...]. O(Depth * Siblings)
+	void findAncestors(HierarchyIndex index, SizeType keep = 0)
+	{
+		ancestors.resize(keep);
+
+		HierarchyIndex current = 0;
+		for (;;)
+		{
+			// Skip siblings until current's subtree contains index
+			while (cacheValues[current] < index)
+			{
+				current = cacheValues[current] + 1;
+			}
+			FLAT_ASSERT(current <= index);
+
+			if (current == index)
+				break;
+
+			ancestors.pushBack(current);
+			++current;
+		}
+	}
+
+	void debugCheck(const Hierarchy& h)
+	{
+#ifdef _DEBUG
+		{ // Correctness check
+			FLAT_ASSERT(cacheValues.getSize() == h.getCount());
+			LastDescendantCache check;
+			check.makeCacheValid(h);
+			for (HierarchyIndex i = 0; i < h.getCount(); i++)
+			{
+				FLAT_ASSERT(check.cacheValues[i] == cacheValues[i]);
+			}
+		}
+#endif
+	}
+};
+
+// Set of dirty node indices for the incremental caches below. A bit per node and a bit per 32 node word that has bits set,
+// so taking the marks in index order costs O(N / 1024 + marks) and no sorting is needed.
+template<typename IndexType = FLAT_SIZETYPE>
+struct DirtyNodeSet
+{
+	typedef IndexType SizeType;
+	typedef IndexType HierarchyIndex;
+
+	FLAT_INDEXED_VECTOR(uint32_t, SizeType) bits;  // Bit per node
+	FLAT_INDEXED_VECTOR(uint32_t, SizeType) words; // Bit per bits word that has bits set
+
+	// Clears all marks
+	void resize(SizeType count)
+	{
+		bits.resize((count + 31) / 32);
+		words.resize((bits.getSize() + 31) / 32);
+		FLAT_MEMSET(bits.getPointer(), 0, sizeof(uint32_t) * bits.getSize());
+		FLAT_MEMSET(words.getPointer(), 0, sizeof(uint32_t) * words.getSize());
+	}
+
+	// O(1)
+	void mark(HierarchyIndex index)
+	{
+		FLAT_ASSERT(index / 32 < bits.getSize());
+		bits[index / 32] |= 1U << (index % 32);
+		words[index / 1024] |= 1U << (index / 32 % 32);
+	}
+
+	// Moves the marks to result in increasing order
+	void take(FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType)& result)
+	{
+		result.clear();
+		for (SizeType w = 0; w < words.getSize(); w++)
+		{
+			uint32_t wordBits = words[w];
+			words[w] = 0;
+			while (wordBits != 0)
+			{
+				const SizeType word = w * 32 + flat_trailing_zeros(wordBits);
+				wordBits &= wordBits - 1;
+
+				uint32_t nodeBits = bits[word];
+				bits[word] = 0;
+				while (nodeBits != 0)
+				{
+					result.pushBack(word * 32 + flat_trailing_zeros(nodeBits));
+					nodeBits &= nodeBits - 1;
+				}
+			}
+		}
+	}
+};
+
+// Cached FlatHierarchy::scanDown() results, world transforms with Op = parent * local, updated incrementally. Call markDirty(i)
+// when values[i] changes and update() before reading. update() recomputes only the subtrees of the dirty nodes, seeded from the
+// cached result of their parents, so the cost is the size of the changed subtrees instead of N. The parent of every node is kept
+// for that, so structural changes need makeCacheValid().
+template<typename Op, typename OutType, typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
+struct ScanDownCache
+{
+	typedef FlatHierarchyBase<DepthType, IndexType> Hierarchy;
+	typedef typename Hierarchy::SizeType SizeType;
+	typedef typename Hierarchy::HierarchyIndex HierarchyIndex;
+
+	FLAT_INDEXED_VECTOR(OutType, SizeType) cacheValues;
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) parents; // Parent of every node, where a dirty subtree is seeded from
+	DirtyNodeSet<IndexType> dirty;
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) dirtyList; // Scratch for update
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) ancestorStack; // Scratch for the scans
+	bool cacheIsValid;
+
+	ScanDownCache()
+		: cacheIsValid(false)
+	{
+	}
+
+	const OutType& operator[] (HierarchyIndex index) const
+	{
+		FLAT_ASSERT(cacheIsValid);
+		FLAT_ASSERT(index < cacheValues.getSize());
+		return cacheValues[index];
+	}
+
+	// O(N)
+	template<typename ValueType, typename Sorter>
+	void makeCacheValid(const FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h)
+	{
+		const SizeType count = h.getCount();
+		cacheValues.resize(count);
+		h.template scanDown<Op>(cacheValues.getPointer(), ancestorStack);
+
+		// The parent of a node is found by climbing the parents of the node before it, O(N) in total
+		parents.resize(count);
+		for (HierarchyIndex i = 0; i < count; i++)
+		{
+			HierarchyIndex parent = i > 0 ? i - 1 : h.getIndexNotFound();
+			while (parent != h.getIndexNotFound() && h.depths[parent] >= h.depths[i])
+			{
+				parent = parents[parent];
+			}
+			parents[i] = parent;
+		}
+		dirty.resize(count);
+		cacheIsValid = true;
+	}
+
+	// O(1)
+	void markDirty(HierarchyIndex index)
+	{
+		FLAT_ASSERT(index < cacheValues.getSize());
+		dirty.mark(index);
+	}
+
+	// O(N / 1024 + dirty node count + changed subtree sizes). Dirty nodes are taken in index order, so the subtree of a dirty node is recomputed
+	// before any dirty node after it, and dirty nodes inside an already recomputed subtree are skipped.
+	// Returns the number of recomputed nodes.
+	template<typename ValueType, typename Sorter>
+	SizeType update(const FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h)
+	{
+		if (!cacheIsValid)
+		{
+			makeCacheValid(h);
+			return h.getCount();
+		}
+		FLAT_ASSERT(cacheValues.getSize() == h.getCount());
+
+		dirty.take(dirtyList);
+
+		SizeType recomputed = 0;
+		HierarchyIndex end = 0; // End of the last recomputed subtree
+		for (SizeType i = 0; i < dirtyList.getSize(); i++)
+		{
+			const HierarchyIndex index = dirtyList[i];
+			if (index < end)
+				continue;
+
+			end = h.template scanDownSubtree<Op>(cacheValues.getPointer(), index, parents[index], ancestorStack);
+			recomputed += end - index;
+		}
+		return recomputed;
+	}
+};
+
+// Cached FlatHierarchy::reduceUp() results, subtree bounds of the world transforms for culling, updated incrementally.
+// Call markDirty(i) when in[i] changes and update() before reading. update() walks the tree like reduceUp(), but only goes into
+// subtrees that hold dirty nodes, the clean ones keep their aggregate and are jumped over with the LastDescendantCache.
+// The cost is the dirty subtrees plus the direct children of their ancestors. Structural changes need makeCacheValid().
+template<typename Op, typename OutType, typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
+struct ReduceUpCache
+{
+	typedef FlatHierarchyBase<DepthType, IndexType> Hierarchy;
+	typedef typename Hierarchy::SizeType SizeType;
+	typedef typename Hierarchy::HierarchyIndex HierarchyIndex;
+	typedef typename Hierarchy::DepthValue DepthValue;
+
+	FLAT_INDEXED_VECTOR(OutType, SizeType) cacheValues;
+	DirtyNodeSet<IndexType> dirty;
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) dirtyList; // Scratch for update
+	FLAT_INDEXED_VECTOR(HierarchyIndex, SizeType) ancestorStack; // Scratch for the scans
+	bool cacheIsValid;
+
+	ReduceUpCache()
+		: cacheIsValid(false)
+	{
+	}
+
+	const OutType& operator[] (HierarchyIndex index) const
+	{
+		FLAT_ASSERT(cacheIsValid);
+		FLAT_ASSERT(index < cacheValues.getSize());
+		return cacheValues[index];
+	}
+
+	// O(N). in holds a leaf for every node, values of the hierarchy or for example world transforms from a ScanDownCache.
+	template<typename InType>
+	void makeCacheValid(const Hierarchy& h, const InType* in)
+	{
+		const SizeType count = h.getCount();
+		cacheValues.resize(count);
+		flat_reduce_up<Op>(h.depths.getPointer(), count, in, cacheValues.getPointer(), ancestorStack);
+		dirty.resize(count);
+		cacheIsValid = true;
+	}
+
+	// O(1)
+	void markDirty(HierarchyIndex index)
+	{
+		FLAT_ASSERT(index < cacheValues.getSize());
+		dirty.mark(index);
+	}
+
+	// Returns the number of visited nodes
+	template<typename InType>
+	SizeType update(const Hierarchy& h, const InType* in, const LastDescendantCache<DepthType, IndexType>& descendantCache)
+	{
+		if (!cacheIsValid)
+		{
+			makeCacheValid(h, in);
+			return h.getCount();
+		}
+		FLAT_ASSERT(cacheValues.getSize() == h.getCount());
+		FLAT_ASSERT(descendantCache.cacheIsValid);
+
+		dirty.take(dirtyList);
+		if (dirtyList.getSize() == 0)
+			return 0;
+		dirtyList.pushBack(Hierarchy::getIndexNotFound()); // Stops the search for the next dirty node
+
+		const SizeType count = h.getCount();
+		const DepthValue* depths = h.depths.getPointer();
+		OutType* out = cacheValues.getPointer();
+
+		SizeType nextDirty = 0;
+		HierarchyIndex dirtyEnd = 0; // Nodes before dirtyEnd are in the subtree of a dirty node
+		SizeType visited = 0;
+		DepthValue openDepth = 0;
+
+		for (HierarchyIndex i = 0; i <= count; )
+		{
+			// Fold the open nodes that do not contain i to their parents, deepest first, like reduceUp()
+			const DepthValue depth = i < count ? depths[i] : 0;
+			for (DepthValue d = openDepth; visited > 0 && d >= depth && d > 0; --d)
+			{
+				out[ancestorStack[d - 1]] = Op::combine(out[ancestorStack[d - 1]], out[ancestorStack[d]]);
+			}
+
+			if (i == count)
+				break;
+
+			flat_grow_ancestor_stack(ancestorStack, depth);
+			ancestorStack[depth] = i;
+			openDepth = depth;
+			++visited;
+
+			if (i < dirtyEnd)
+			{
+				out[i] = Op::leaf(in[i]);
+				++i;
+				continue;
+			}
+
+			while (dirtyList[nextDirty] < i)
+			{
+				++nextDirty;
+			}
+
+			const HierarchyIndex last = descendantCache.getLastDescendant(i);
+			if (dirtyList[nextDirty] <= last)
+			{
+				// Dirty or the ancestor of a dirty node
+				if (dirtyList[nextDirty] == i)
+					dirtyEnd = last + 1;
+				out[i] = Op::leaf(in[i]);
+				++i;
+			}
+			else
+			{
+				// Clean subtree, out[i] is its aggregate
+				i = last + 1;
+			}
+		}
+
+		return visited;
+	}
 };
 
+// Calls visitor(index) in depth search order for every node whose subtree aggregate overlaps query, Op::overlaps(aggregate, query).
+// A subtree that does not overlap is skipped with one jump past its last descendant.
+template<typename Op, typename OutType, typename QueryType, typename Visitor, typename DepthType, typename IndexType>
+void forEachVisible(const ReduceUpCache<Op, OutType, DepthType, IndexType>& boundsCache, const LastDescendantCache<DepthType, IndexType>& descendantCache, const QueryType& query, Visitor& visitor)
+{
+	FLAT_ASSERT(boundsCache.cacheIsValid && descendantCache.cacheIsValid);
+
+	const IndexType count = boundsCache.cacheValues.getSize();
+	const OutType* bounds = boundsCache.cacheValues.getPointer();
+	for (IndexType i = 0; i < count; )
+	{
+		if (Op::overlaps(bounds[i], query))
+		{
+			visitor(i);
+			++i;
+		}
+		else
+		{
+			i = descendantCache.getLastDescendant(i) + 1;
+		}
+	}
+}
+
 
 
 
@@ -555,15 +1705,17 @@ struct LastDescendantCache : public ArrayCache
 
 
 
-template<typename ValueType, typename Sorter>
-FlatHierarchyBase::HierarchyIndex makeChildOf(FlatHierarchy<ValueType, Sorter>& h, LastDescendantCache& descendantCache, FlatHierarchyBase::HierarchyIndex child, FlatHierarchyBase::HierarchyIndex parent)
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+IndexType makeChildOf(FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, LastDescendantCache<DepthType, IndexType>& descendantCache, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex child, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex parent)
 {
+	h.onDepthsChanged();
+
 	FLAT_ASSERT(child != parent && "Self-adoption");
 	FLAT_ASSERT(!h.linearIsChildOf(parent, child) && "Incest");
 	FLAT_ASSERT((h.depths[child] != h.depths[parent] + 1 || !h.linearIsChildOf(child, parent)) && "Re-parenting");
 
-	SizeType dest = parent + 1; // Default destination position is right after parent
-	SizeType count = descendantCache.getLastDescendant(h, child) - child + 1; // Descendant count including the child
+	IndexType dest = parent + 1; // Default destination position is right after parent
+	IndexType count = descendantCache.getLastDescendant(h, child) - child + 1; // Descendant count including the child
 	FLAT_ASSERT(count > 0);
 
 	if (Sorter::UseSorting == true)
@@ -572,8 +1724,8 @@ FlatHierarchyBase::HierarchyIndex makeChildOf(FlatHierarchy<ValueType, Sorter>&
 
 		dest = descendantCache.getLastDescendant(h, parent) + 1; // Default to last possible index
 
-		FlatHierarchyBase::DepthValue targetDepth = h.depths[parent] + 1;
-		for (SizeType i = parent + 1; i < dest; ++i)
+		DepthType targetDepth = h.depths[parent] + 1;
+		for (IndexType i = parent + 1; i < dest; ++i)
 		{
 			if (h.depths[i] == targetDepth && Sorter::isFirst(h.values[child], h.values[i]))
 			{
@@ -588,9 +1740,9 @@ FlatHierarchyBase::HierarchyIndex makeChildOf(FlatHierarchy<ValueType, Sorter>&
 		{
 			// Commented to unify behavior with pointer trees
 			//// If child's index is greater than parent, find a place in parents children that is closest to child's current position
-			//FlatHierarchyBase::DepthValue targetDepth = h.depths[parent] + 1;
+			//DepthType targetDepth = h.depths[parent] + 1;
 			//
-			//for (FlatHierarchyBase::HierarchyIndex currentPlace = parent + 1
+			//for (IndexType currentPlace = parent + 1
 			//	; currentPlace < child
 			//	; currentPlace = descendantCache.getLastDescendant(h, currentPlace) + 1)
 			//{
@@ -604,30 +1756,32 @@ FlatHierarchyBase::HierarchyIndex makeChildOf(FlatHierarchy<ValueType, Sorter>&
 
 	// Do the move
 
-	SizeType source = child;
+	IndexType source = child;
 
 
-	FlatHierarchyBase::DepthValue depthDiff = h.depths[parent] + 1 - h.depths[child];
+	DepthType depthDiff = h.depths[parent] + 1 - h.depths[child];
 
 	if (source != dest && source + count != dest)
 	{
 		h.move(source, dest, count);
 	}
 
+	const IndexType moveDest = dest;
 	if (source < dest)
 	{
 		FLAT_ASSERT(source + count <= dest);
 		dest -= count;
 	}
 
-	for (SizeType i = 0; i < count; i++)
+	h.removeDepthCounts(dest, count);
+	for (IndexType i = 0; i < count; i++)
 	{
 		h.depths[dest + i] += depthDiff;
-		FLAT_ASSERT(h.depths[dest + i] < FLAT_MAXDEPTH && "Over/Under-flow threat detected"); // Over flow protection
+		FLAT_ASSERT(h.depths[dest + i] < h.getMaxDepth() && "Over/Under-flow threat detected"); // Over flow protection
 	}
+	h.addDepthCounts(dest, count);
 
-	descendantCache.cacheIsValid = false;
-	// TODO: Update cache
+	descendantCache.moveSubtree(h, source, moveDest, parent);
 
 	return dest;
 }
@@ -636,27 +1790,63 @@ FlatHierarchyBase::HierarchyIndex makeChildOf(FlatHierarchy<ValueType, Sorter>&
 
 
 
-template<typename ValueType, typename Sorter>
-void erase(FlatHierarchy<ValueType, Sorter>& h, LastDescendantCache& descendantCache, FlatHierarchyBase::HierarchyIndex child)
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+void erase(FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, LastDescendantCache<DepthType, IndexType>& descendantCache, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex child)
 {
-	SizeType count = descendantCache.getLastDescendant(h, child) - child + 1;
+	h.onDepthsChanged();
+
+	IndexType count = descendantCache.getLastDescendant(h, child) - child + 1;
+	h.removeDepthCounts(child, count);
 
-	const SizeType toShift = h.getCount() - (child + count);
-	FLAT_MEMMOVE(h.depths.getPointer() + child, h.depths.getPointer() + child + count, toShift * sizeof(FlatHierarchyBase::DepthValue));
+	const IndexType toShift = h.getCount() - (child + count);
+	FLAT_MEMMOVE(h.depths.getPointer() + child, h.depths.getPointer() + child + count, toShift * sizeof(DepthType));
 	FLAT_MEMMOVE(h.values.getPointer() + child, h.values.getPointer() + child + count, toShift * sizeof(ValueType));
 
 	h.depths.resize(h.depths.getSize() - count);
 	h.values.resize(h.values.getSize() - count);
 
-	// TODO: Update cache
-	descendantCache.cacheIsValid = false;
+	descendantCache.eraseSubtree(h, child);
+
+}
+
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+IndexType eraseMany(FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, LastDescendantCache<DepthType, IndexType>& descendantCache, const typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex* indices, typename FlatHierarchyBase<DepthType, IndexType>::SizeType indexCount)
+{
+	if (indexCount == 0)
+		return 0;
+
+	if (!descendantCache.cacheIsValid)
+		descendantCache.makeCacheValid(h);
 
+	// Reads stay ahead of writes, so the cache is still valid for every index that is read
+	struct SubtreeEnd
+	{
+		const LastDescendantCache<DepthType, IndexType>* cache;
+
+		IndexType getEnd(IndexType index) const
+		{
+			return cache->getLastDescendant(index) + 1;
+		}
+	};
+
+	SubtreeEnd subtreeEnd;
+	subtreeEnd.cache = &descendantCache;
+
+	FLAT_INDEXED_VECTOR(uint32_t, IndexType) marks;
+	IndexType first;
+	const IndexType erased = h.eraseMany(indices, indexCount, subtreeEnd, marks, first);
+
+	descendantCache.eraseSubtrees(h, marks.getPointer(), first);
+
+	return erased;
 }
 
-template<typename ValueType, typename Sorter>
-FlatHierarchyBase::HierarchyIndex createNodeAsChildOf(FlatHierarchy<ValueType, Sorter>& h, LastDescendantCache& descendantCache, FlatHierarchyBase::HierarchyIndex parentIndex, const ValueType& value)
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+IndexType createNodeAsChildOf(FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, LastDescendantCache<DepthType, IndexType>& descendantCache, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex parentIndex, const ValueType& value)
 {
-	SizeType newIndex = parentIndex + 1;
+	h.onDepthsChanged();
+
+	IndexType newIndex = parentIndex + 1;
 
 	if (Sorter::UseSorting == true)
 	{
@@ -664,8 +1854,8 @@ FlatHierarchyBase::HierarchyIndex createNodeAsChildOf(FlatHierarchy<ValueType, S
 		newIndex = descendantCache.getLastDescendant(h, parentIndex) + 1;
 
 		// Insert to sorted position
-		FlatHierarchyBase::DepthValue targetDepth = h.depths[parentIndex] + 1;
-		for (SizeType i = parentIndex + 1; i < newIndex; ++i)
+		DepthType targetDepth = h.depths[parentIndex] + 1;
+		for (IndexType i = parentIndex + 1; i < newIndex; ++i)
 		{
 			if (h.depths[i] == targetDepth && Sorter::isFirst(value, h.values[i]))
 			{
@@ -681,28 +1871,34 @@ FlatHierarchyBase::HierarchyIndex createNodeAsChildOf(FlatHierarchy<ValueType, S
 
 	FLAT_ASSERT(newIndex > parentIndex);
 
-	FLAT_DEPTHTYPE newParentCount = h.depths[parentIndex] + 1;
-	FLAT_ASSERT(newParentCount < FLAT_MAXDEPTH); // Over flow protection
+	DepthType newParentCount = h.depths[parentIndex] + 1;
+	FLAT_ASSERT(newParentCount < h.getMaxDepth()); // Over flow protection
 
 	h.values.insert(newIndex, value);
 	h.depths.insert(newIndex, newParentCount);
+	h.addDepthCounts(newIndex, 1);
 
-	// TODO: Update cache
-	descendantCache.cacheIsValid = false;
+	if (descendantCache.cacheIsValid)
+		descendantCache.insertLeaf(h, newIndex, parentIndex);
 
 	return newIndex;
 }
 
-template<typename ValueType, typename Sorter>
-FlatHierarchyBase::HierarchyIndex createRootNode(FlatHierarchyBase& h, NextSiblingCache& siblingCache, const ValueType& value)
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+IndexType createRootNode(FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, NextSiblingCache<DepthType, IndexType>& siblingCache, const ValueType& value)
 {
-	FlatHierarchyBase::HierarchyIndex newIndex = h.getCount();
+	h.onDepthsChanged();
+
+	IndexType newIndex = h.getCount();
 
 	if (Sorter::UseSorting == true)
 	{
 		// Insert to sorted position
 
-		FlatHierarchyBase::HierarchyIndex currentPlace = 0;
+		if (!siblingCache.cacheIsValid)
+			siblingCache.makeCacheValid(h);
+
+		IndexType currentPlace = 0;
 		while (currentPlace < newIndex)
 		{
 			if (Sorter::isFirst(value, h.values[currentPlace]))
@@ -714,26 +1910,163 @@ FlatHierarchyBase::HierarchyIndex createRootNode(FlatHierarchyBase& h, NextSibli
 		}
 
 		h.values.insert(newIndex, value);
-		h.depths.insert(newIndex, (FlatHierarchyBase::DepthValue)0U);
+		h.depths.insert(newIndex, (DepthType)0U);
 	}
 	else
 	{
 		// NOTE: Cache structure is not useful if not using sorting. Post warning?
 
 		h.values.pushBack(value);
-		h.depths.pushBack((FlatHierarchyBase::DepthValue)0U);
+		h.depths.pushBack((DepthType)0U);
 	}
+	h.addDepthCounts(newIndex, 1);
 
-	// TODO: Update cache
-	siblingCache.cacheIsValid = false;
+	if (siblingCache.cacheIsValid)
+		siblingCache.insertLeaf(h, newIndex, h.getIndexNotFound());
 
 	return newIndex;
 }
 
-template<typename ValueType, typename Sorter>
-FlatHierarchyBase::HierarchyIndex createRootNode(FlatHierarchy<ValueType, Sorter>& h, LastDescendantCache& descendantCache, const ValueType& value)
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+IndexType createNodeAsChildOf(FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, NextSiblingCache<DepthType, IndexType>& siblingCache, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex parentIndex, const ValueType& value)
+{
+	h.onDepthsChanged();
+
+	IndexType newIndex = parentIndex + 1;
+
+	if (Sorter::UseSorting == true)
+	{
+		// Insert to sorted position, jumping over the children's subtrees
+		DepthType targetDepth = h.depths[parentIndex] + 1;
+		IndexType currentPlace = parentIndex + 1;
+		if (currentPlace < h.getCount() && h.depths[currentPlace] == targetDepth)
+		{
+			for (;;)
+			{
+				if (Sorter::isFirst(value, h.values[currentPlace]))
+				{
+					newIndex = currentPlace;
+					break;
+				}
+				IndexType next = siblingCache.getNextSibling(h, currentPlace);
+				if (next == h.getIndexNotFound())
+				{
+					newIndex = siblingCache.getSubtreeEnd(h, currentPlace);
+					break;
+				}
+				currentPlace = next;
+			}
+		}
+	}
+
+	FLAT_ASSERT(newIndex > parentIndex);
+
+	DepthType newParentCount = h.depths[parentIndex] + 1;
+	FLAT_ASSERT(newParentCount < h.getMaxDepth()); // Over flow protection
+
+	h.values.insert(newIndex, value);
+	h.depths.insert(newIndex, newParentCount);
+	h.addDepthCounts(newIndex, 1);
+
+	if (siblingCache.cacheIsValid)
+		siblingCache.insertLeaf(h, newIndex, parentIndex);
+
+	return newIndex;
+}
+
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+void erase(FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, NextSiblingCache<DepthType, IndexType>& siblingCache, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex child)
+{
+	h.onDepthsChanged();
+
+	IndexType count = siblingCache.getSubtreeEnd(h, child) - child;
+	h.removeDepthCounts(child, count);
+
+	const IndexType toShift = h.getCount() - (child + count);
+	FLAT_MEMMOVE(h.depths.getPointer() + child, h.depths.getPointer() + child + count, toShift * sizeof(DepthType));
+	FLAT_MEMMOVE(h.values.getPointer() + child, h.values.getPointer() + child + count, toShift * sizeof(ValueType));
+
+	h.depths.resize(h.depths.getSize() - count);
+	h.values.resize(h.values.getSize() - count);
+
+	siblingCache.eraseSubtree(h, child, count);
+}
+
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+IndexType makeChildOf(FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, NextSiblingCache<DepthType, IndexType>& siblingCache, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex child, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex parent)
+{
+	h.onDepthsChanged();
+
+	FLAT_ASSERT(child != parent && "Self-adoption");
+
+	IndexType dest = parent + 1; // Default destination position is right after parent
+	IndexType count = siblingCache.getSubtreeEnd(h, child) - child; // Descendant count including the child
+	FLAT_ASSERT(count > 0);
+	FLAT_ASSERT((parent < child || parent >= child + count) && "Incest");
+
+	if (Sorter::UseSorting == true)
+	{
+		// Find a destination position that will have the child sorted among its siblings, jumping over their subtrees
+		DepthType targetDepth = h.depths[parent] + 1;
+		IndexType currentPlace = parent + 1;
+		if (currentPlace < h.getCount() && h.depths[currentPlace] == targetDepth)
+		{
+			for (;;)
+			{
+				FLAT_ASSERT(currentPlace != child && "Re-parenting");
+				if (Sorter::isFirst(h.values[child], h.values[currentPlace]))
+				{
+					dest = currentPlace;
+					break;
+				}
+				IndexType next = siblingCache.getNextSibling(currentPlace);
+				if (next == h.getIndexNotFound())
+				{
+					dest = siblingCache.getSubtreeEnd(h, currentPlace);
+					break;
+				}
+				currentPlace = next;
+			}
+		}
+	}
+
+	// Do the move
+
+	IndexType source = child;
+
+	DepthType depthDiff = h.depths[parent] + 1 - h.depths[child];
+
+	if (source != dest && source + count != dest)
+	{
+		h.move(source, dest, count);
+	}
+
+	const IndexType moveDest = dest;
+	if (source < dest)
+	{
+		FLAT_ASSERT(source + count <= dest);
+		dest -= count;
+	}
+
+	h.removeDepthCounts(dest, count);
+	for (IndexType i = 0; i < count; i++)
+	{
+		h.depths[dest + i] += depthDiff;
+		FLAT_ASSERT(h.depths[dest + i] < h.getMaxDepth() && "Over/Under-flow threat detected"); // Over flow protection
+	}
+	h.addDepthCounts(dest, count);
+
+	siblingCache.moveSubtree(h, source, moveDest, count, parent);
+
+	return dest;
+}
+
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+IndexType createRootNode(FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, LastDescendantCache<DepthType, IndexType>& descendantCache, const ValueType& value)
 {
-	FlatHierarchyBase::HierarchyIndex newIndex = h.getCount();
+	h.onDepthsChanged();
+
+	IndexType newIndex = h.getCount();
 
 	if (Sorter::UseSorting == true)
 	{
@@ -742,7 +2075,7 @@ FlatHierarchyBase::HierarchyIndex createRootNode(FlatHierarchy<ValueType, Sorter
 		if (!descendantCache.cacheIsValid)
 			descendantCache.makeCacheValid(h);
 
-		FlatHierarchyBase::HierarchyIndex currentPlace = 0;
+		IndexType currentPlace = 0;
 		while (currentPlace < newIndex)
 		{
 			if (Sorter::isFirst(value, h.values[currentPlace]))
@@ -754,36 +2087,59 @@ FlatHierarchyBase::HierarchyIndex createRootNode(FlatHierarchy<ValueType, Sorter
 		}
 
 		h.values.insert(newIndex, value);
-		h.depths.insert(newIndex, (FlatHierarchyBase::DepthValue)0U);
+		h.depths.insert(newIndex, (DepthType)0U);
 	}
 	else
 	{
 		// NOTE: Cache structure is not useful if not using sorting. Post warning?
 
 		h.values.pushBack(value);
-		h.depths.pushBack((FlatHierarchyBase::DepthValue)0U);
+		h.depths.pushBack((DepthType)0U);
 	}
+	h.addDepthCounts(newIndex, 1);
 
-	// TODO: Update cache
-	descendantCache.cacheIsValid = false;
+	if (descendantCache.cacheIsValid)
+		descendantCache.insertLeaf(h, newIndex, h.getIndexNotFound());
 
 	return newIndex;
 }
 
 
-FlatHierarchyBase::HierarchyIndex countDirectChildren(const FlatHierarchyBase& h, NextSiblingCache& siblingCache, FlatHierarchyBase::HierarchyIndex parent)
+// O(1) interval check with a valid cache. An invalid cache falls back to the linear scan instead of an O(N) rebuild.
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+bool isChildOf(const FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, const LastDescendantCache<DepthType, IndexType>& descendantCache, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex child, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex parent)
+{
+	if (!descendantCache.cacheIsValid)
+		return h.linearIsChildOf(child, parent);
+
+	FLAT_ASSERT(child < h.getCount() && parent < h.getCount());
+	return child > parent && child <= descendantCache.getLastDescendant(parent);
+}
+
+template<typename ValueType, typename Sorter, typename DepthType, typename IndexType>
+IndexType areDescendantsOf(const FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& h, const LastDescendantCache<DepthType, IndexType>& descendantCache, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex parent, const typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex* indices, typename FlatHierarchyBase<DepthType, IndexType>::SizeType indexCount, bool* results)
+{
+	if (!descendantCache.cacheIsValid)
+		return h.areDescendantsOf(parent, indices, indexCount, results);
+
+	FLAT_ASSERT(parent < h.getCount());
+	return flat_check_intervals<IndexType>(parent, descendantCache.getLastDescendant(parent), indices, indexCount, results);
+}
+
+template<typename DepthType, typename IndexType>
+IndexType countDirectChildren(const FlatHierarchyBase<DepthType, IndexType>& h, NextSiblingCache<DepthType, IndexType>& siblingCache, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex parent)
 {
-	SizeType result = 0;
+	IndexType result = 0;
 	if (parent + 1 >= h.getCount() || h.depths[parent] + 1 != h.depths[parent + 1])
 		return result;
 	++result;
 
-	FlatHierarchyBase::HierarchyIndex current = siblingCache.getNextSibling(h, parent + 1);
+	IndexType current = siblingCache.getNextSibling(h, parent + 1);
 
 	while (current < h.getCount())
 	{
 #ifndef MAX_PERF // Asserts are disabled on MAX_PERF
-		SizeType old = current;
+		IndexType old = current;
 #endif
 		++result;
 		current = siblingCache.getNextSibling(current);
@@ -795,9 +2151,10 @@ FlatHierarchyBase::HierarchyIndex countDirectChildren(const FlatHierarchyBase& h
 	return result;
 }
 
-FlatHierarchyBase::HierarchyIndex getNthChild(const FlatHierarchyBase& h, NextSiblingCache& siblingCache, FlatHierarchyBase::HierarchyIndex parent, SizeType n)
+template<typename DepthType, typename IndexType>
+IndexType getNthChild(const FlatHierarchyBase<DepthType, IndexType>& h, NextSiblingCache<DepthType, IndexType>& siblingCache, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex parent, typename FlatHierarchyBase<DepthType, IndexType>::SizeType n)
 {
-	FlatHierarchyBase::HierarchyIndex current = parent + 1;
+	IndexType current = parent + 1;
 	FLAT_ASSERT(current < h.getCount() && h.depths[parent] + 1 == h.depths[current]);
 
 	if (n-- == 0)
@@ -810,7 +2167,7 @@ FlatHierarchyBase::HierarchyIndex getNthChild(const FlatHierarchyBase& h, NextSi
 	while (n-- > 0)
 	{
 #ifndef MAX_PERF // Asserts are disabled on MAX_PERF
-		SizeType old = current;
+		IndexType old = current;
 #endif
 		current = siblingCache.getNextSibling(current);
 		FLAT_ASSERT(old < current);
@@ -821,45 +2178,57 @@ FlatHierarchyBase::HierarchyIndex getNthChild(const FlatHierarchyBase& h, NextSi
 }
 
 
-FlatHierarchyBase::HierarchyIndex countDirectChildren(const FlatHierarchyBase& h, FlatHierarchyBase::HierarchyIndex parent)
+template<typename DepthType, typename IndexType>
+IndexType countDirectChildren(const FlatHierarchyBase<DepthType, IndexType>& h, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex parent)
 {
 	FLAT_ASSERT(parent < h.getCount());
 
-	SizeType result = 0;
-	
-	const FlatHierarchyBase::DepthValue targetDepth = h.depths[parent] + 1;
-	FlatHierarchyBase::HierarchyIndex current = parent + 1;
+	const DepthType targetDepth = h.depths[parent] + 1;
 
-	while (current < h.getCount() && targetDepth <= h.depths[current])
-	{
-		if (targetDepth == h.depths[current])
-			++result;
-		++current;
-	}
+	// n that can't be reached makes the scan count every child
+	uintptr_t result = 0;
+	flat_scan_children(h.depths.getPointer(), parent + 1, h.getCount(), targetDepth, ~uintptr_t(0), &result);
 
-	return result;
+#ifdef _DEBUG
+	{ // Correctness check
+		IndexType check = 0;
+		for (IndexType current = parent + 1; current < h.getCount() && targetDepth <= h.depths[current]; ++current)
+		{
+			if (targetDepth == h.depths[current])
+				++check;
+		}
+		FLAT_ASSERT(check == result);
+	}
+#endif
+	return (IndexType)result;
 }
 
-FlatHierarchyBase::HierarchyIndex getNthChild(const FlatHierarchyBase& h, FlatHierarchyBase::HierarchyIndex parent, SizeType n)
+template<typename DepthType, typename IndexType>
+IndexType getNthChild(const FlatHierarchyBase<DepthType, IndexType>& h, typename FlatHierarchyBase<DepthType, IndexType>::HierarchyIndex parent, typename FlatHierarchyBase<DepthType, IndexType>::SizeType n)
 {
 	FLAT_ASSERT(parent < h.getCount());
 
-	const FlatHierarchyBase::DepthValue targetDepth = h.depths[parent] + 1;
-	FlatHierarchyBase::HierarchyIndex current = parent + 1;
+	const DepthType targetDepth = h.depths[parent] + 1;
 
-	FLAT_ASSERT(current < h.getCount() && targetDepth == h.depths[current]);
+	FLAT_ASSERT(parent + 1 < h.getCount() && targetDepth == h.depths[parent + 1]);
 
-	while (n > 0)
-	{
-		++current;
-		if (targetDepth == h.depths[current])
+	uintptr_t childCount = 0;
+	const IndexType result = (IndexType)flat_scan_children(h.depths.getPointer(), parent + 1, h.getCount(), targetDepth, n, &childCount);
+	FLAT_ASSERT(result < h.getCount() && targetDepth == h.depths[result] && "Less than n + 1 children");
+
+#ifdef _DEBUG
+	{ // Correctness check
+		IndexType check = parent + 1;
+		for (IndexType left = n; left > 0; )
 		{
-			--n;
+			++check;
+			if (targetDepth == h.depths[check])
+				--left;
 		}
-		FLAT_ASSERT(current < h.getCount() && targetDepth <= h.depths[current]);
+		FLAT_ASSERT(check == result);
 	}
-
-	return current;
+#endif
+	return result;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,513 @@
+#ifndef FLAT_PACKEDHIERARCHY_H
+#define FLAT_PACKEDHIERARCHY_H
+
+#include "FlatHierarchy.h"
+
+#ifndef FLAT_MEMSET
+	#include <string.h> /* memset */
+	#define FLAT_MEMSET(dst, value, length) memset(dst, value, length)
+#endif
+
+/////////////////////////////////////////////////////////////////
+//
+// Gapped (packed memory array) storage mode for FlatHierarchy
+//
+// Nodes are kept in the same depth search order, but depths and
+// values have evenly spread empty slots. Inserts and erases only
+// rearrange a small window around the edit point instead of the
+// whole tail, which makes them amortized O(log^2 N).
+//
+// A gap slot holds the depth of the next node after it (0 after
+// the last node). That keeps the depths-vector a valid input for
+// plain depth scans: findMaxDepth() and getLastDescendant() don't
+// need to know about the gaps and a parent-to-child propagation
+// over every slot gives the right result on the node slots.
+//
+// Indices are slot indices. They are not stable over mutations,
+// same as with FlatHierarchy.
+//
+/////////////////////////////////////////////////////////////////
+template<typename ValueType, typename Sorter = DefaultSorter, typename DepthType = FLAT_DEPTHTYPE, typename IndexType = FLAT_SIZETYPE>
+class PackedHierarchy : public FlatHierarchyBase<DepthType, IndexType>
+{
+public:
+	typedef FlatHierarchyBase<DepthType, IndexType> Base;
+	typedef typename Base::SizeType SizeType;
+	typedef typename Base::DepthValue DepthValue;
+	typedef typename Base::HierarchyIndex HierarchyIndex;
+
+	using Base::depths;
+	using Base::getIndexNotFound;
+	using Base::getMaxDepth;
+	using Base::onDepthsChanged;
+
+	typedef uint64_t OccupancyWord;
+	enum { OccupancyBits = 64 };
+	enum { MinCapacity = 64 };
+
+	FLAT_INDEXED_VECTOR(ValueType, SizeType) values;
+	FLAT_INDEXED_VECTOR(OccupancyWord, SizeType) occupancy; // One bit per slot, set when the slot holds a node
+
+	PackedHierarchy(SizeType reserveSize = 0)
+		: nodeCount(0)
+		, segmentSize(0)
+	{
+		if (reserveSize > 0)
+			resizeSlots(getSlotCountFor(reserveSize));
+	}
+	~PackedHierarchy()
+	{
+	}
+
+	SizeType getNodeCount() const { return nodeCount; }
+	SizeType getSlotCount() const { return depths.getSize(); }
+
+	inline bool isNode(HierarchyIndex slot) const
+	{
+		FLAT_ASSERT(slot < getSlotCount());
+		return (occupancy[slot / OccupancyBits] >> (slot % OccupancyBits) & 1) != 0;
+	}
+
+	// First node slot at or after 'slot'. Returns getSlotCount() if there is none.
+	HierarchyIndex getNextNode(HierarchyIndex slot) const
+	{
+		const SizeType slotCount = getSlotCount();
+		if (slot >= slotCount)
+			return slotCount;
+
+		SizeType word = slot / OccupancyBits;
+		OccupancyWord bits = occupancy[word] & (~(OccupancyWord)0 << (slot % OccupancyBits));
+		while (bits == 0)
+		{
+			if (++word >= occupancy.getSize())
+				return slotCount;
+			bits = occupancy[word];
+		}
+
+		SizeType bit = 0;
+		while ((bits & 1) == 0)
+		{
+			bits >>= 1;
+			++bit;
+		}
+		return word * OccupancyBits + bit;
+	}
+
+	// Slot of the node that is n:th in depth search order. O(N / 64)
+	HierarchyIndex getNthNode(SizeType n) const
+	{
+		FLAT_ASSERT(n < nodeCount);
+
+		SizeType word = 0;
+		SizeType bitCount = flat_popcount64(occupancy[word]);
+		while (n >= bitCount)
+		{
+			n -= bitCount;
+			bitCount = flat_popcount64(occupancy[++word]);
+		}
+
+		OccupancyWord bits = occupancy[word];
+		SizeType bit = 0;
+		for (;;)
+		{
+			if ((bits & 1) != 0 && n-- == 0)
+				break;
+			bits >>= 1;
+			++bit;
+		}
+		return word * OccupancyBits + bit;
+	}
+
+	void clear()
+	{
+		onDepthsChanged();
+		FLAT_MEMSET(occupancy.getPointer(), 0, occupancy.getSize() * sizeof(OccupancyWord));
+		FLAT_MEMSET(depths.getPointer(), 0, depths.getSize() * sizeof(DepthValue));
+		nodeCount = 0;
+	}
+
+	HierarchyIndex createRootNode(const ValueType& value)
+	{
+		HierarchyIndex before = getSlotCount();
+
+		if (Sorter::UseSorting == true)
+		{
+			// Insert to sorted position
+			DepthValue targetDepth = 0;
+			for (HierarchyIndex i = 0; i < before; ++i)
+			{
+				if (depths[i] == targetDepth && isNode(i) && Sorter::isFirst(value, values[i]))
+				{
+					before = i;
+					break;
+				}
+			}
+		}
+
+		DepthValue depth = 0;
+		return insertNodes(before, &depth, &value, 1);
+	}
+
+	HierarchyIndex createNodeAsChildOf(HierarchyIndex parentIndex, const ValueType& value)
+	{
+		FLAT_ASSERT(isNode(parentIndex));
+
+		HierarchyIndex before = parentIndex + 1;
+
+		if (Sorter::UseSorting == true)
+		{
+			// Default to last possible index
+			before = getLastDescendant(parentIndex) + 1;
+
+			// Insert to sorted position
+			DepthValue targetDepth = depths[parentIndex] + 1;
+			for (HierarchyIndex i = parentIndex + 1; i < before; ++i)
+			{
+				if (depths[i] == targetDepth && isNode(i) && Sorter::isFirst(value, values[i]))
+				{
+					before = i;
+					break;
+				}
+			}
+		}
+
+		DepthValue depth = depths[parentIndex] + 1;
+		FLAT_ASSERT(depth < getMaxDepth()); // Over flow protection
+
+		return insertNodes(before, &depth, &value, 1);
+	}
+
+	// Same scan as in FlatHierarchy. Gaps mirror the depth of the following node, so the
+	// first slot that isn't deeper than the parent comes right after the last descendant.
+	HierarchyIndex getLastDescendant(HierarchyIndex parentIndex) const
+	{
+		const HierarchyIndex result = (HierarchyIndex)flat_find_not_deeper(depths.getPointer(), parentIndex + 1, getSlotCount(), depths[parentIndex]);
+		FLAT_ASSERT(isNode(result - 1));
+		return result - 1;
+	}
+
+	HierarchyIndex makeChildOf(HierarchyIndex child, HierarchyIndex parent)
+	{
+		FLAT_ASSERT(child != parent && "Self-adoption");
+		FLAT_ASSERT(isNode(child) && isNode(parent));
+
+		const HierarchyIndex last = getLastDescendant(child);
+		FLAT_ASSERT(!(child < parent && parent <= last) && "Incest");
+
+		HierarchyIndex before = parent + 1;
+
+		if (Sorter::UseSorting == true)
+		{
+			// Find a destination position that will have the child sorted among its siblings
+
+			before = getLastDescendant(parent) + 1; // Default to last possible index
+
+			DepthValue targetDepth = depths[parent] + 1;
+			for (HierarchyIndex i = parent + 1; i < before; ++i)
+			{
+				if (depths[i] == targetDepth && isNode(i) && Sorter::isFirst(values[child], values[i]))
+				{
+					before = i;
+					break;
+				}
+			}
+		}
+
+		// Lift the subtree out with its new depths
+		const DepthValue depthDiff = depths[parent] + 1 - depths[child];
+		moveDepths.clear();
+		moveValues.clear();
+		for (HierarchyIndex i = child; i <= last; ++i)
+		{
+			if (!isNode(i))
+				continue;
+			moveDepths.pushBack(depths[i] + depthDiff);
+			moveValues.pushBack(values[i]);
+			FLAT_ASSERT(moveDepths.getBack() < getMaxDepth() && "Over/Under-flow threat detected"); // Over flow protection
+		}
+
+		// Erasing only turns slots into gaps, so 'before' still points to the same place
+		nodeCount -= markErased(child, last);
+
+		return insertNodes(before, moveDepths.getPointer(), moveValues.getPointer(), moveDepths.getSize());
+	}
+
+	void erase(HierarchyIndex child)
+	{
+		FLAT_ASSERT(isNode(child));
+
+		nodeCount -= markErased(child, getLastDescendant(child));
+
+		// Shrink when mostly empty to keep scans short
+		if (getSlotCount() > MinCapacity && nodeCount * 4 < getSlotCount())
+		{
+			gather(0, getSlotCount(), getSlotCount(), NULL, NULL, 0);
+			resizeSlots(getSlotCount() / 2);
+			spread(0, getSlotCount());
+		}
+	}
+
+	HierarchyIndex findValue(const ValueType& valueType, HierarchyIndex startingFrom = 0) const
+	{
+		// Linear search
+		for (HierarchyIndex i = startingFrom, end = getSlotCount(); i < end; ++i)
+		{
+			if (isNode(i) && values[i] == valueType)
+				return i;
+		}
+		return getIndexNotFound();
+	}
+
+	// Writes the nodes without gaps into a FlatHierarchy
+	void copyTo(FlatHierarchy<ValueType, Sorter, DepthType, IndexType>& result) const
+	{
+		result.values.clear();
+		result.depths.clear();
+		result.values.reserve(nodeCount);
+		result.depths.reserve(nodeCount);
+
+		for (HierarchyIndex i = getNextNode(0), end = getSlotCount(); i < end; i = getNextNode(i + 1))
+		{
+			result.values.pushBack(values[i]);
+			result.depths.pushBack(depths[i]);
+		}
+
+		if (result.depthCountsEnabled)
+			result.enableDepthCounts(true);
+		result.onDepthsChanged();
+	}
+
+private:
+	SizeType nodeCount;
+	SizeType segmentSize;
+
+	// Scratch buffers reused between operations to avoid allocations
+	FLAT_INDEXED_VECTOR(DepthValue, SizeType) scratchDepths;
+	FLAT_INDEXED_VECTOR(ValueType, SizeType) scratchValues;
+	SizeType scratchSpliceIndex;
+	FLAT_INDEXED_VECTOR(DepthValue, SizeType) moveDepths;
+	FLAT_INDEXED_VECTOR(ValueType, SizeType) moveValues;
+
+	static SizeType getSlotCountFor(SizeType nodes)
+	{
+		// Keep the root window under 3/4 full
+		SizeType result = MinCapacity;
+		while (nodes * 4 > result * 3)
+			result *= 2;
+		return result;
+	}
+
+	void setNode(HierarchyIndex slot)
+	{
+		occupancy[slot / OccupancyBits] |= (OccupancyWord)1 << (slot % OccupancyBits);
+	}
+	void setGap(HierarchyIndex slot)
+	{
+		occupancy[slot / OccupancyBits] &= ~((OccupancyWord)1 << (slot % OccupancyBits));
+	}
+
+	SizeType countNodes(HierarchyIndex first, HierarchyIndex end) const
+	{
+		SizeType result = 0;
+		while (first < end && (first % OccupancyBits) != 0)
+		{
+			result += isNode(first) ? 1 : 0;
+			++first;
+		}
+		while (first + OccupancyBits <= end)
+		{
+			result += flat_popcount64(occupancy[first / OccupancyBits]);
+			first += OccupancyBits;
+		}
+		while (first < end)
+		{
+			result += isNode(first) ? 1 : 0;
+			++first;
+		}
+		return result;
+	}
+
+	void resizeSlots(SizeType slotCount)
+	{
+		FLAT_ASSERT((slotCount & (slotCount - 1)) == 0);
+		onDepthsChanged();
+
+		depths.clear();
+		values.clear();
+		occupancy.clear();
+		depths.resize(slotCount);
+		values.resize(slotCount);
+		occupancy.resize((slotCount + OccupancyBits - 1) / OccupancyBits);
+
+		FLAT_MEMSET(occupancy.getPointer(), 0, occupancy.getSize() * sizeof(OccupancyWord));
+		FLAT_MEMSET(depths.getPointer(), 0, depths.getSize() * sizeof(DepthValue));
+		FLAT_MEMSET(values.getPointer(), 0, values.getSize() * sizeof(ValueType)); // Keep gaps harmless for value scans
+
+		// Segment size is roughly log2(slotCount) rounded up to a power of two
+		SizeType log2 = 0;
+		while ((SizeType(1) << log2) < slotCount)
+			++log2;
+		segmentSize = 8;
+		while (segmentSize < log2)
+			segmentSize *= 2;
+		if (segmentSize > slotCount)
+			segmentSize = slotCount;
+	}
+
+	// Turns the slots between first and last into gaps. Returns the number of removed nodes.
+	SizeType markErased(HierarchyIndex first, HierarchyIndex last)
+	{
+		onDepthsChanged();
+		const SizeType removed = countNodes(first, last + 1);
+		const DepthValue nextDepth = last + 1 < getSlotCount() ? depths[last + 1] : (DepthValue)0U;
+
+		for (HierarchyIndex i = first; i <= last; ++i)
+		{
+			setGap(i);
+			depths[i] = nextDepth;
+		}
+
+		// Gaps in front of the erased range now lead to a different node
+		for (HierarchyIndex i = first; i-- > 0 && !isNode(i); )
+		{
+			depths[i] = nextDepth;
+		}
+		return removed;
+	}
+
+	// Inserts 'count' nodes so that they come after the nodes before slot 'before'
+	// and in front of the nodes at or after it. Returns the slot of the first new node.
+	HierarchyIndex insertNodes(HierarchyIndex before, const DepthValue* newDepths, const ValueType* newValues, SizeType count)
+	{
+		FLAT_ASSERT(count > 0);
+		onDepthsChanged();
+		const SizeType slotCount = getSlotCount();
+
+		// Look for enough room in the gap run between the neighbouring nodes
+		if (slotCount > 0)
+		{
+			HierarchyIndex runStart = before;
+			while (runStart > 0 && !isNode(runStart - 1))
+				--runStart;
+			HierarchyIndex runEnd = before;
+			while (runEnd < slotCount && runEnd < runStart + count && !isNode(runEnd))
+				++runEnd;
+
+			if (runEnd - runStart >= count)
+			{
+				// Filling the run from its start keeps the remaining gaps pointing at the same next node
+				for (SizeType i = 0; i < count; ++i)
+				{
+					depths[runStart + i] = newDepths[i];
+					values[runStart + i] = newValues[i];
+					setNode(runStart + i);
+				}
+				nodeCount += count;
+				return runStart;
+			}
+
+			// Find the smallest window around the edit point that stays under its density threshold
+			const HierarchyIndex position = before < slotCount ? before : slotCount - 1;
+
+			SizeType rootHeight = 0;
+			while ((segmentSize << rootHeight) < slotCount)
+				++rootHeight;
+
+			for (SizeType height = 0; height <= rootHeight; ++height)
+			{
+				const SizeType windowSize = segmentSize << height;
+				const HierarchyIndex windowStart = position & ~(windowSize - 1);
+				const SizeType windowCount = countNodes(windowStart, windowStart + windowSize) + count;
+
+				// Allowed density goes linearly from 1 in a single segment to 3/4 in the root window
+				const bool fits = rootHeight == 0
+					? windowCount * 4 <= windowSize * 3
+					: windowCount * 4 * rootHeight <= windowSize * (4 * rootHeight - height);
+
+				if (fits)
+				{
+					gather(windowStart, windowStart + windowSize, before, newDepths, newValues, count);
+					nodeCount += count;
+					return spread(windowStart, windowStart + windowSize);
+				}
+			}
+		}
+
+		// Whole array is too dense, grow it
+		gather(0, slotCount, before, newDepths, newValues, count);
+		resizeSlots(getSlotCountFor(nodeCount + count) > slotCount * 2 ? getSlotCountFor(nodeCount + count) : slotCount * 2);
+		nodeCount += count;
+		return spread(0, getSlotCount());
+	}
+
+	// Collects the nodes of a window into the scratch buffers with new nodes spliced in front of slot 'before'
+	void gather(HierarchyIndex windowStart, HierarchyIndex windowEnd, HierarchyIndex before, const DepthValue* newDepths, const ValueType* newValues, SizeType count)
+	{
+		scratchDepths.clear();
+		scratchValues.clear();
+		scratchSpliceIndex = getIndexNotFound();
+
+		for (HierarchyIndex i = windowStart; i <= windowEnd; ++i)
+		{
+			if (i == before || (i == windowEnd && before > windowEnd))
+			{
+				scratchSpliceIndex = scratchDepths.getSize();
+				for (SizeType j = 0; j < count; ++j)
+				{
+					scratchDepths.pushBack(newDepths[j]);
+					scratchValues.pushBack(newValues[j]);
+				}
+			}
+			if (i < windowEnd && isNode(i))
+			{
+				scratchDepths.pushBack(depths[i]);
+				scratchValues.pushBack(values[i]);
+			}
+		}
+	}
+
+	// Spreads the scratch buffers evenly over a window. Returns the slot of the spliced nodes.
+	HierarchyIndex spread(HierarchyIndex windowStart, HierarchyIndex windowEnd)
+	{
+		const SizeType windowSize = windowEnd - windowStart;
+		const SizeType count = scratchDepths.getSize();
+		FLAT_ASSERT(count <= windowSize);
+		onDepthsChanged();
+
+		HierarchyIndex result = getIndexNotFound();
+
+		for (HierarchyIndex i = windowStart; i < windowEnd; ++i)
+		{
+			setGap(i);
+		}
+
+		for (SizeType j = 0; j < count; ++j)
+		{
+			const HierarchyIndex slot = windowStart + (HierarchyIndex)((uint64_t)j * windowSize / count);
+			depths[slot] = scratchDepths[j];
+			values[slot] = scratchValues[j];
+			setNode(slot);
+
+			if (j == scratchSpliceIndex)
+				result = slot;
+		}
+
+		// Gaps take the depth of the next node
+		DepthValue nextDepth = windowEnd < getSlotCount() ? depths[windowEnd] : (DepthValue)0U;
+		for (HierarchyIndex i = windowEnd; i-- > windowStart; )
+		{
+			if (isNode(i))
+				nextDepth = depths[i];
+			else
+				depths[i] = nextDepth;
+		}
+		for (HierarchyIndex i = windowStart; i-- > 0 && !isNode(i); )
+		{
+			depths[i] = nextDepth;
+		}
+
+		return result;
+	}
+};
+
+#endif // FLAT_PACKEDHIERARCHY_H
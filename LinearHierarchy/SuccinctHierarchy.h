@@ -0,0 +1,444 @@
+#ifndef FLAT_SUCCINCTHIERARCHY_H
+#define FLAT_SUCCINCTHIERARCHY_H
+
+#include "FlatHierarchy.h"
+
+#ifndef FLAT_MEMSET
+	#include <string.h> /* memset */
+	#define FLAT_MEMSET(dst, value, length) memset(dst, value, length)
+#endif
+
+#if FLAT_USE_SIMD == true
+	FLAT_TARGET_AVX2 inline uint32_t flat_select64_bmi2(uint64_t v, uint32_t k)
+	{
+		return flat_trailing_zeros(_pdep_u64((uint64_t)1 << k, v));
+	}
+#endif
+
+// Position of the k:th set bit of v, counting from 0
+inline uint32_t flat_select64(uint64_t v, uint32_t k)
+{
+	FLAT_ASSERT(k < flat_popcount64(v));
+#if FLAT_USE_SIMD == true
+	if (flat_get_simd_level() >= FLAT_SIMD_AVX2)
+		return flat_select64_bmi2(v, k);
+#endif
+
+	uint32_t base = 0;
+	for (uint32_t count = flat_popcount64(v & 0xFF); count <= k; count = flat_popcount64(v & 0xFF))
+	{
+		k -= count;
+		v >>= 8;
+		base += 8;
+	}
+	for (; k > 0; k--)
+	{
+		v &= v - 1;
+	}
+	return base + flat_trailing_zeros(v);
+}
+
+/////////////////////////////////////////////////////////////////
+//
+// Read-only succinct topology index for FlatHierarchy
+//
+// The depth search order is stored as balanced parentheses,
+// an open bit when a node starts and a close bit when its
+// subtree ends: 2 bits per node instead of a depths-vector and
+// index caches. Node i is the i:th open bit and
+//   depth = opens - closes before it
+//   last descendant and subtree size come from its close bit,
+//     the first later bit where the excess (opens - closes)
+//     drops below the excess after the open bit
+//   parent is the last earlier open bit at depth - 1
+//
+// rank (set bits before a position) uses a count per block of
+// BlockBits bits, select (position of the i:th set bit) a block
+// sample per BlockBits set bits. The excess searches go a byte
+// at a time inside a block with two 256 entry tables, and over
+// the blocks with a min-max tree of the lowest excess of every
+// block, so they are O(BlockBits / 8 + log N).
+//
+// About 2.4 bits per node with 32 bit indices. Build it again
+// after the hierarchy changes.
+//
+/////////////////////////////////////////////////////////////////
+template<typename IndexType = FLAT_SIZETYPE>
+class SuccinctHierarchy
+{
+public:
+	typedef IndexType SizeType;
+	typedef IndexType HierarchyIndex;
+
+	enum { BlockBits = 512 };
+
+	SuccinctHierarchy()
+		: nodeCount(0)
+		, bitCount(0)
+	{
+		for (int byte = 0; byte < 256; byte++)
+		{
+			int excess = 0;
+			int minExcess = 8;
+			for (int bit = 0; bit < 8; bit++)
+			{
+				excess += (byte >> bit) & 1 ? 1 : -1;
+				minExcess = excess < minExcess ? excess : minExcess;
+			}
+			byteExcess[byte] = (signed char)excess;
+			byteMinExcess[byte] = (signed char)minExcess;
+		}
+	}
+
+	SizeType getCount() const
+	{
+		return nodeCount;
+	}
+
+	// Bytes of the index, without the object itself
+	uintptr_t getByteCount() const
+	{
+		return words.getSize() * sizeof(uint64_t) + blockRanks.getSize() * sizeof(SizeType) + selectSamples.getSize() * sizeof(SizeType)
+			+ blockMins.getSize() * sizeof(int) + levelOffsets.getSize() * sizeof(SizeType);
+	}
+
+	// O(N)
+	template<typename DepthType>
+	void build(const FlatHierarchyBase<DepthType, IndexType>& h)
+	{
+		nodeCount = h.getCount();
+		bitCount = (uintptr_t)nodeCount * 2;
+		FLAT_ASSERT(bitCount / 2 < ((uintptr_t)1 << 30) && "Excess has to fit to an int");
+
+		words.resize((SizeType)((bitCount + 63) / 64));
+		FLAT_MEMSET(words.getPointer(), 0, words.getSize() * sizeof(uint64_t));
+
+		// Closes are the zero bits between the opens
+		uintptr_t position = 0;
+		for (HierarchyIndex i = 0; i < nodeCount; i++)
+		{
+			FLAT_ASSERT(i == 0 ? h.depths[i] == 0 : h.depths[i] <= h.depths[i - 1] + 1);
+			if (i > 0)
+				position += h.depths[i - 1] + 1 - h.depths[i];
+			words[(SizeType)(position >> 6)] |= (uint64_t)1 << (position & 63);
+			++position;
+		}
+		FLAT_ASSERT(nodeCount == 0 || position + h.depths[nodeCount - 1] + 1 == bitCount);
+
+		const SizeType blockCount = (SizeType)((bitCount + BlockBits - 1) / BlockBits);
+		blockRanks.resize(blockCount + 1);
+		blockMins.clear();
+		blockMins.resize(blockCount);
+		selectSamples.clear();
+
+		SizeType ones = 0;
+		for (SizeType block = 0; block < blockCount; block++)
+		{
+			blockRanks[block] = ones;
+			while ((SizeType)selectSamples.getSize() * BlockBits < ones + countOnes(block))
+			{
+				selectSamples.pushBack(block);
+			}
+
+			const uintptr_t start = (uintptr_t)block * BlockBits;
+			const uintptr_t end = start + BlockBits < bitCount ? start + BlockBits : bitCount;
+			int excess = 2 * (int)ones - (int)start;
+			int minExcess = excess + 1;
+			for (uintptr_t k = start; k < end; k++)
+			{
+				if ((k & 7) == 0 && k + 8 <= end)
+				{
+					const uint32_t byte = getByte(k);
+					minExcess = excess + byteMinExcess[byte] < minExcess ? excess + byteMinExcess[byte] : minExcess;
+					excess += byteExcess[byte];
+					k += 7;
+					continue;
+				}
+				excess += getBit(k) ? 1 : -1;
+				minExcess = excess < minExcess ? excess : minExcess;
+			}
+			blockMins[block] = minExcess;
+			ones += countOnes(block);
+		}
+		blockRanks[blockCount] = ones;
+
+		// Min-max tree levels after the blocks, every node is the lower of its two children
+		levelOffsets.clear();
+		levelOffsets.pushBack(0);
+		levelOffsets.pushBack(blockCount);
+		for (SizeType size = blockCount; size > 1; size = (size + 1) / 2)
+		{
+			const SizeType below = levelOffsets[levelOffsets.getSize() - 2];
+			for (SizeType node = 0; node < (size + 1) / 2; node++)
+			{
+				const int left = blockMins[below + node * 2];
+				const int right = node * 2 + 1 < size ? blockMins[below + node * 2 + 1] : left;
+				blockMins.pushBack(left < right ? left : right);
+			}
+			levelOffsets.pushBack(blockMins.getSize());
+		}
+	}
+
+	// O(log N)
+	SizeType getDepth(HierarchyIndex index) const
+	{
+		FLAT_ASSERT(index < nodeCount);
+		return (SizeType)(2 * (uintptr_t)index - select(index));
+	}
+
+	// O(BlockBits / 8 + log N), getIndexNotFound() for roots
+	HierarchyIndex getParent(HierarchyIndex index) const
+	{
+		FLAT_ASSERT(index < nodeCount);
+		const uintptr_t open = select(index);
+		const int depth = (int)(2 * (uintptr_t)index - open);
+		if (depth == 0)
+			return getIndexNotFound();
+		return rank(findEnclosing(open, depth));
+	}
+
+	// O(BlockBits / 8 + log N)
+	SizeType getSubtreeSize(HierarchyIndex index) const
+	{
+		FLAT_ASSERT(index < nodeCount);
+		const uintptr_t open = select(index);
+		return (SizeType)((findClose(open, (int)(2 * (uintptr_t)index - open) + 1) - open + 1) / 2);
+	}
+
+	// O(BlockBits / 8 + log N)
+	HierarchyIndex getLastDescendant(HierarchyIndex index) const
+	{
+		return index + getSubtreeSize(index) - 1;
+	}
+
+	// O(BlockBits / 8 + log N), getIndexNotFound() for the last child. Roots are siblings, like in NextSiblingCache.
+	HierarchyIndex getNextSibling(HierarchyIndex index) const
+	{
+		FLAT_ASSERT(index < nodeCount);
+		const uintptr_t open = select(index);
+		const uintptr_t close = findClose(open, (int)(2 * (uintptr_t)index - open) + 1);
+		if (close + 1 >= bitCount || !getBit(close + 1))
+			return getIndexNotFound();
+		return index + (HierarchyIndex)((close - open + 1) / 2);
+	}
+
+	static HierarchyIndex getIndexNotFound() { return HierarchyIndex(~HierarchyIndex(0)); }
+
+private:
+	FLAT_INDEXED_VECTOR(uint64_t, SizeType) words; // The parentheses, open is 1
+	FLAT_INDEXED_VECTOR(SizeType, SizeType) blockRanks; // Set bits before every block and the total
+	FLAT_INDEXED_VECTOR(SizeType, SizeType) selectSamples; // Block of every BlockBits:th set bit
+	FLAT_INDEXED_VECTOR(int, SizeType) blockMins; // Lowest excess after a bit of every block, then the min-max tree levels
+	FLAT_INDEXED_VECTOR(SizeType, SizeType) levelOffsets; // Start of every level in blockMins
+	SizeType nodeCount;
+	uintptr_t bitCount;
+	signed char byteExcess[256];    // Opens - closes of the byte
+	signed char byteMinExcess[256]; // Lowest excess after a bit of the byte
+
+	bool getBit(uintptr_t position) const
+	{
+		return ((words[(SizeType)(position >> 6)] >> (position & 63)) & 1) != 0;
+	}
+
+	// Byte aligned
+	uint32_t getByte(uintptr_t position) const
+	{
+		return (uint32_t)(words[(SizeType)(position >> 6)] >> (position & 63)) & 0xFF;
+	}
+
+	SizeType countOnes(SizeType block) const
+	{
+		const SizeType first = block * (BlockBits / 64);
+		const SizeType last = first + BlockBits / 64 < words.getSize() ? first + BlockBits / 64 : words.getSize();
+		SizeType result = 0;
+		for (SizeType w = first; w < last; w++)
+		{
+			result += flat_popcount64(words[w]);
+		}
+		return result;
+	}
+
+	// Set bits before position
+	HierarchyIndex rank(uintptr_t position) const
+	{
+		const SizeType block = (SizeType)(position / BlockBits);
+		SizeType result = blockRanks[block];
+		SizeType w = block * (BlockBits / 64);
+		for (; w < (SizeType)(position >> 6); w++)
+		{
+			result += flat_popcount64(words[w]);
+		}
+		if (position & 63)
+			result += flat_popcount64(words[w] & (((uint64_t)1 << (position & 63)) - 1));
+		return result;
+	}
+
+	// Position of the open bit of node index. Binary search for its block between two samples, blocks without opens are skipped.
+	uintptr_t select(HierarchyIndex index) const
+	{
+		const SizeType sample = index / BlockBits;
+		SizeType low = selectSamples[sample];
+		SizeType high = sample + 1 < selectSamples.getSize() ? selectSamples[sample + 1] : blockRanks.getSize() - 2;
+		while (low < high)
+		{
+			const SizeType mid = low + (high - low) / 2;
+			if (blockRanks[mid + 1] > index)
+				high = mid;
+			else
+				low = mid + 1;
+		}
+
+		SizeType remaining = index - blockRanks[low];
+		for (SizeType w = low * (BlockBits / 64);; w++)
+		{
+			const SizeType ones = flat_popcount64(words[w]);
+			if (remaining < ones)
+				return (uintptr_t)w * 64 + flat_select64(words[w], (uint32_t)remaining);
+			remaining -= ones;
+		}
+	}
+
+	// Excess after the last bit of block
+	int getBlockEndExcess(SizeType block) const
+	{
+		const uintptr_t end = ((uintptr_t)block + 1) * BlockBits < bitCount ? ((uintptr_t)block + 1) * BlockBits : bitCount;
+		return 2 * (int)blockRanks[block + 1] - (int)end;
+	}
+
+	// First position in [start, end) with excess <= target after it, or end. excess is the excess before start.
+	uintptr_t scanForward(uintptr_t start, uintptr_t end, int excess, int target) const
+	{
+		for (uintptr_t k = start; k < end; k++)
+		{
+			if ((k & 7) == 0 && k + 8 <= end)
+			{
+				const uint32_t byte = getByte(k);
+				if (excess + byteMinExcess[byte] > target)
+				{
+					excess += byteExcess[byte];
+					k += 7;
+					continue;
+				}
+			}
+			excess += getBit(k) ? 1 : -1;
+			if (excess <= target)
+				return k;
+		}
+		return end;
+	}
+
+	// Last position k in [start, end) with excess <= target after it, returned as k + 1, or 0. excess is the excess after end - 1.
+	uintptr_t scanBackward(uintptr_t start, uintptr_t end, int excess, int target) const
+	{
+		for (uintptr_t k = end; k > start; k--)
+		{
+			if ((k & 7) == 0 && k >= start + 8)
+			{
+				const uint32_t byte = getByte(k - 8);
+				const int before = excess - byteExcess[byte];
+				if (before + byteMinExcess[byte] > target)
+				{
+					excess = before;
+					k -= 7;
+					continue;
+				}
+			}
+			if (excess <= target)
+				return k;
+			excess -= getBit(k - 1) ? 1 : -1;
+		}
+		return 0;
+	}
+
+	// First block after block with a bit of excess <= target, or the block count
+	SizeType findBlockForward(SizeType block, int target) const
+	{
+		SizeType level = 0;
+		SizeType node = block;
+		for (;;)
+		{
+			const SizeType levelSize = levelOffsets[level + 1] - levelOffsets[level];
+			if ((node & 1) == 0 && node + 1 < levelSize && blockMins[levelOffsets[level] + node + 1] <= target)
+			{
+				++node;
+				break;
+			}
+			if (levelSize <= 1)
+				return blockRanks.getSize() - 1;
+			node >>= 1;
+			++level;
+		}
+		for (; level > 0; level--)
+		{
+			node *= 2;
+			if (blockMins[levelOffsets[level - 1] + node] > target)
+				++node;
+		}
+		return node;
+	}
+
+	// Last block before block with a bit of excess <= target, or the block count
+	SizeType findBlockBackward(SizeType block, int target) const
+	{
+		SizeType level = 0;
+		SizeType node = block;
+		for (;;)
+		{
+			const SizeType levelSize = levelOffsets[level + 1] - levelOffsets[level];
+			if ((node & 1) == 1 && blockMins[levelOffsets[level] + node - 1] <= target)
+			{
+				--node;
+				break;
+			}
+			if (levelSize <= 1)
+				return blockRanks.getSize() - 1;
+			node >>= 1;
+			++level;
+		}
+		for (; level > 0; level--)
+		{
+			const SizeType levelSize = levelOffsets[level] - levelOffsets[level - 1];
+			node = node * 2 + 1;
+			if (node >= levelSize || blockMins[levelOffsets[level - 1] + node] > target)
+				--node;
+		}
+		return node;
+	}
+
+	// Close bit of the open bit at open, excess is the excess after it
+	uintptr_t findClose(uintptr_t open, int excess) const
+	{
+		const int target = excess - 1;
+		const SizeType block = (SizeType)(open / BlockBits);
+		const uintptr_t blockEnd = ((uintptr_t)block + 1) * BlockBits < bitCount ? ((uintptr_t)block + 1) * BlockBits : bitCount;
+		const uintptr_t result = scanForward(open + 1, blockEnd, excess, target);
+		if (result < blockEnd)
+			return result;
+
+		const SizeType next = findBlockForward(block, target);
+		FLAT_ASSERT(next < blockRanks.getSize() - 1 && "Unbalanced parentheses");
+		const uintptr_t start = (uintptr_t)next * BlockBits;
+		const uintptr_t end = start + BlockBits < bitCount ? start + BlockBits : bitCount;
+		return scanForward(start, end, 2 * (int)blockRanks[next] - (int)start, target);
+	}
+
+	// Open bit of the parent of the open bit at open, depth is the excess before it and above 0
+	uintptr_t findEnclosing(uintptr_t open, int depth) const
+	{
+		// The parent opened right after the last bit before open where the excess is depth - 1, or at 0
+		const int target = depth - 1;
+		const SizeType block = (SizeType)(open / BlockBits);
+		const uintptr_t result = scanBackward((uintptr_t)block * BlockBits, open, depth, target);
+		if (result > 0 || block == 0)
+			return result;
+
+		const SizeType previous = findBlockBackward(block, target);
+		if (previous == blockRanks.getSize() - 1)
+			return 0;
+		const uintptr_t start = (uintptr_t)previous * BlockBits;
+		return scanBackward(start, start + BlockBits, getBlockEndExcess(previous), target);
+	}
+};
+
+
+#endif
@@ -12,6 +12,9 @@
 #include "FastHash.h"
 #include "FlatHierarchy.h"
 #include "HierarchyCache.h"
+#include "PackedHierarchy.h"
+#include "ColumnHierarchy.h"
+#include "SuccinctHierarchy.h"
 #include "RivalTree.h"
 #include "MultiwayTree.h"
 
@@ -224,6 +227,63 @@ struct TransformSorter
 	inline static bool isFirst(const Transform& a, const Transform& b) { return a.pos.x < b.pos.x; }
 };
 
+struct TransformSplitter
+{
+	inline static void split(const Transform& t, float* columns) { columns[0] = t.pos.x; columns[1] = t.pos.y; columns[2] = t.size.x; columns[3] = t.size.y; }
+};
+
+struct TransformMultiplyOp
+{
+	inline static Transform root(const Transform& value) { return value; }
+	inline static Transform combine(const Transform& parent, const Transform& value) { return Transform::multiply(parent, value); }
+};
+
+struct SubtreeBounds
+{
+	Vector2 min;
+	Vector2 max;
+	SizeType count;
+};
+
+struct SubtreeBoundsOp
+{
+	inline static SubtreeBounds leaf(const Transform& value)
+	{
+		SubtreeBounds result;
+		result.min = value.pos;
+		result.max = value.pos + value.size;
+		result.count = 1;
+		return result;
+	}
+	inline static SubtreeBounds combine(const SubtreeBounds& a, const SubtreeBounds& b)
+	{
+		SubtreeBounds result;
+		result.min = Vector2(a.min.x < b.min.x ? a.min.x : b.min.x, a.min.y < b.min.y ? a.min.y : b.min.y);
+		result.max = Vector2(a.max.x > b.max.x ? a.max.x : b.max.x, a.max.y > b.max.y ? a.max.y : b.max.y);
+		result.count = a.count + b.count;
+		return result;
+	}
+	inline static bool overlaps(const SubtreeBounds& a, const SubtreeBounds& b)
+	{
+		return a.min.x <= b.max.x && b.min.x <= a.max.x && a.min.y <= b.max.y && b.min.y <= a.max.y;
+	}
+};
+
+// World rect and subtree bounds for the pointer trees of cull_test, kept in child creation order
+struct CullNode
+{
+	SubtreeBounds rect;
+	SubtreeBounds bounds;
+};
+
+struct UnsortedSorter
+{
+	static const bool UseSorting = false;
+
+	template<typename T>
+	inline static bool isFirst(const T&, const T&) { return false; }
+};
+
 namespace // Logger
 {
 	char LogBuffer[1024 * 1024];
@@ -938,7 +998,7 @@ static Transform makeTransform()
 
 SizeType test_addChild(FlatHierarchy<Transform, TransformSorter>& tree, SizeType nodeCount, SizeType parentIndex)
 {
-	LastDescendantCache descendantCache;
+	LastDescendantCache<> descendantCache;
 	descendantCache.cacheIsValid = false;
 	if (FLAT_CACHE_CONDITION)
 		descendantCache.makeCacheValid(tree);
@@ -966,7 +1026,7 @@ void test_moveChildren(FlatHierarchy<Transform, TransformSorter>& tree, SizeType
 {
 	FLAT_ASSERT(newParentIndex < childIndex);
 
-	LastDescendantCache descendantCache;
+	LastDescendantCache<> descendantCache;
 	descendantCache.cacheIsValid = false;
 	if (FLAT_CACHE_CONDITION)
 		descendantCache.makeCacheValid(tree);
@@ -988,7 +1048,7 @@ void test_travelToLeaf(const FlatHierarchy<Transform, TransformSorter>& tree, Si
 	SizeType current = 0;
 	SizeType childCount = 0;
 
-	NextSiblingCache siblingCache;
+	NextSiblingCache<> siblingCache;
 
 	siblingCache.cacheIsValid = false; // Invalidate cache before starting to travel, just in case
 	if (FLAT_CACHE_CONDITION)
@@ -2017,47 +2077,2091 @@ void test()
 
 void array_test()
 {
+	// Compares the in place rotation used by FlatHierarchy::move to the buffered copy it replaced
 	static const SizeType tree_size = 500000;
 	static const SizeType test_count = 10000;
 	static const SizeType rep_count = 20;
-	double avg = 0;
+	static const SizeType engine_count = 2;
+	static const char* engine_names[engine_count] = { "buffered", "rotate" };
+	double avg[engine_count] = { 0, 0 };
 	FlatHierarchy<Transform> asdfasdf;
 	asdfasdf.values.reserve(tree_size);
 	asdfasdf.depths.reserve(tree_size);
 
+	struct LOLMBDA
+	{
+		// The old move: park the smaller side on the stack or on the heap, shift the larger one
+		static void bufferedMove(FlatHierarchy<Transform>& h, SizeType source, SizeType dest, SizeType count)
+		{
+			SizeType low = source < dest ? source : dest;
+			SizeType mid = source < dest ? source + count : source;
+			SizeType high = source < dest ? dest : source + count;
+
+			bool low_small = mid - low < high - mid;
+			SizeType small_start = low_small ? low              : mid;
+			SizeType small_count = low_small ? mid - low        : high - mid;
+			SizeType small_dest  = low_small ? low + high - mid : low;
+			SizeType large_start = low_small ? mid              : low;
+			SizeType large_count = low_small ? high - mid       : mid - low;
+			SizeType large_dest  = low_small ? low              : low + high - mid;
+
+			static const SizeType static_buffer_size = 1024;
+			char stack_buffer[static_buffer_size];
+			char* temp_buffer = stack_buffer;
+			if (small_count * sizeof(Transform) > static_buffer_size)
+				temp_buffer = (char*)malloc(small_count * sizeof(Transform));
+
+			FlatHierarchy<Transform>::DepthValue* d = h.depths.getPointer();
+			FLAT_MEMCPY (temp_buffer   , d + small_start, small_count * sizeof(FlatHierarchy<Transform>::DepthValue));
+			FLAT_MEMMOVE(d + large_dest, d + large_start, large_count * sizeof(FlatHierarchy<Transform>::DepthValue));
+			FLAT_MEMCPY (d + small_dest, temp_buffer    , small_count * sizeof(FlatHierarchy<Transform>::DepthValue));
+
+			Transform* v = h.values.getPointer();
+			FLAT_MEMCPY (temp_buffer   , v + small_start, small_count * sizeof(Transform));
+			FLAT_MEMMOVE(v + large_dest, v + large_start, large_count * sizeof(Transform));
+			FLAT_MEMCPY (v + small_dest, temp_buffer    , small_count * sizeof(Transform));
+
+			if (small_count * sizeof(Transform) > static_buffer_size)
+				free(temp_buffer);
+		}
+	};
+
+	for (SizeType engine = 0; engine < engine_count; engine++)
+	{
+		Random::init(13337);
+
+		for (SizeType reps = 0; reps < rep_count; reps++)
+		{
+			asdfasdf.values.clear();
+			asdfasdf.depths.clear();
+
+			for (SizeType i = 0; i < tree_size; i++)
+			{
+				asdfasdf.values.pushBack(Transform(i, i + 1, i + 2, i + 1.4f));
+				asdfasdf.depths.pushBack(i == 0 ? 0 : (i == 1 || i == 1 + tree_size / 2) ? 1 : 2);
+			}
+
+			ScopedProfiler prof;
+			for (SizeType i = 0; i < test_count; i++)
+			{
+				SizeType a = Random::get(0, tree_size);
+				SizeType count = Random::get(0, tree_size - a);
+				SizeType b = Random::get(0, tree_size - count);
+				if (b > a)
+					b += count;
+
+				if (engine == 0)
+					LOLMBDA::bufferedMove(asdfasdf, a, b, count);
+				else
+					asdfasdf.move(a, b, count);
+			}
+			double result = prof.stop();
+			avg[engine] += result;
+			printf("%s t: %f; ", engine_names[engine], result / test_count);
+			printf("hash: %x\n", SuperFastHash((char*)asdfasdf.values.getPointer(), sizeof(Transform) * asdfasdf.values.getSize()));
+		}
+	}
+	for (SizeType engine = 0; engine < engine_count; engine++)
+		printf("%s avg: %f\n", engine_names[engine], avg[engine] / rep_count / test_count);
+	system("pause");
+}
+
+// Compacts packed and asserts that it holds the nodes of flat in the same order, returns the node count
+SizeType packed_test_compare(const FlatHierarchy<Transform, TransformSorter>& flat, const PackedHierarchy<Transform, TransformSorter>& packed)
+{
+	FlatHierarchy<Transform, TransformSorter> compacted;
+	packed.copyTo(compacted);
+	FLAT_ASSERT(packed.getNodeCount() == flat.getCount());
+	FLAT_ASSERT(compacted.getCount() == flat.getCount());
+
+	const uint32_t flatHash = SuperFastHash((char*)flat.values.getPointer(), sizeof(Transform) * flat.values.getSize());
+	const uint32_t compactedHash = SuperFastHash((char*)compacted.values.getPointer(), sizeof(Transform) * compacted.values.getSize());
+	const uint32_t flatDepthHash = SuperFastHash((char*)flat.depths.getPointer(), sizeof(flat.depths[0]) * flat.depths.getSize());
+	const uint32_t compactedDepthHash = SuperFastHash((char*)compacted.depths.getPointer(), sizeof(compacted.depths[0]) * compacted.depths.getSize());
+	FLAT_ASSERT(flatHash == compactedHash);
+	FLAT_ASSERT(flatDepthHash == compactedDepthHash);
+	return compacted.getCount();
+}
+
+void packed_test()
+{
+	// Compares add and erase costs of the flat and the gapped storage
+	static const SizeType tree_size = 200000;
+	static const SizeType erase_count = 20000;
+	static const SizeType rep_count = 5;
+	double flatAdd = 0, flatErase = 0, packedAdd = 0, packedErase = 0;
+
+	for (SizeType reps = 0; reps < rep_count; reps++)
+	{
+		FlatHierarchy<Transform, TransformSorter> flat(tree_size);
+		PackedHierarchy<Transform, TransformSorter> packed(tree_size);
+
+		flat.createRootNode(Transform());
+		packed.createRootNode(Transform());
+
+		Random::init(13337 + reps);
+		for (SizeType i = 1; i < tree_size; i++)
+		{
+			SizeType parent = Random::get(0, i);
+			Transform value = makeTransform();
+			SizeType packedParent = packed.getNthNode(parent);
+			{
+				ScopedProfiler prof(&flatAdd, true);
+				flat.createNodeAsChildOf(parent, value);
+			}
+			{
+				ScopedProfiler prof(&packedAdd, true);
+				packed.createNodeAsChildOf(packedParent, value);
+			}
+		}
+		const SizeType addedNodes = packed_test_compare(flat, packed);
+
+		for (SizeType i = 0; i < erase_count && flat.getCount() > 1; i++)
+		{
+			SizeType child = Random::get(1, flat.getCount());
+			SizeType packedChild = packed.getNthNode(child);
+			{
+				ScopedProfiler prof(&flatErase, true);
+				flat.erase(child);
+			}
+			{
+				ScopedProfiler prof(&packedErase, true);
+				packed.erase(packedChild);
+			}
+		}
+
+		const SizeType erasedNodes = packed_test_compare(flat, packed);
+		printf("nodes: %u / %u after erase, slots: %u\n", addedNodes, erasedNodes, packed.getSlotCount());
+	}
+	printf("avg add   flat: %f, packed: %f\n", flatAdd / rep_count / (tree_size - 1), packedAdd / rep_count / (tree_size - 1));
+	printf("avg erase flat: %f, packed: %f\n", flatErase / rep_count / erase_count, packedErase / rep_count / erase_count);
+	system("pause");
+}
+
+template<typename Hierarchy>
+void depth_type_test_imp(const char* name, SizeType tree_size, SizeType rep_count)
+{
+	Hierarchy h(tree_size);
+	h.createRootNode(0);
+
 	Random::init(13337);
+	for (SizeType i = 1; i < tree_size; i++)
+	{
+		// Shallow UI-like trees: attach mostly to recent nodes, cap depth well below 255. A node is at most one deeper than the
+		// node before it, anything deeper would skip a depth and leave the depth search order invalid.
+		SizeType parent = i - 1 - Random::get(0, i < 16 ? i : 16);
+		if (h.depths[parent] >= 60)
+			parent = 0;
+		SizeType depth = h.depths[parent] + 1;
+		depth = depth > (SizeType)h.depths[i - 1] + 1 ? (SizeType)h.depths[i - 1] + 1 : depth;
+		h.depths.pushBack((typename Hierarchy::DepthValue)depth);
+		h.values.pushBack(i);
+	}
 
+	double maxDepthTime = 0;
+	double descendantTime = 0;
+	SizeType checksum = 0;
 	for (SizeType reps = 0; reps < rep_count; reps++)
 	{
-		asdfasdf.values.clear();
-		asdfasdf.depths.clear();
+		{
+			ScopedProfiler prof(&maxDepthTime, true);
+			checksum += h.findMaxDepth();
+		}
+		{
+			ScopedProfiler prof(&descendantTime, true);
+			checksum += (SizeType)h.getLastDescendant(0);
+		}
+	}
+	printf("%s: findMaxDepth: %f, getLastDescendant(root): %f, depth bytes: %u, checksum: %u\n", name
+		, maxDepthTime / rep_count, descendantTime / rep_count, (SizeType)(sizeof(typename Hierarchy::DepthValue) * h.getCount()), checksum);
+}
+
+void depth_type_test()
+{
+	// Compares full depth scans with 8, 16 and 32 bit depths
+	static const SizeType tree_size = 4000000;
+	static const SizeType rep_count = 20;
+	depth_type_test_imp<FlatHierarchy<SizeType, DefaultSorter, uint8_t, uint32_t> >("uint8 ", tree_size, rep_count);
+	depth_type_test_imp<FlatHierarchy<SizeType, DefaultSorter, uint16_t, uint32_t> >("uint16", tree_size, rep_count);
+	depth_type_test_imp<FlatHierarchy<SizeType, DefaultSorter, uint32_t, uint32_t> >("uint32", tree_size, rep_count);
+	system("pause");
+}
+
+void mixed_test()
+{
+	// Alternates a mutation and a few last descendant queries every frame
+	static const SizeType tree_size = 100000;
+	static const SizeType frame_count = 4000;
+	static const SizeType query_count = 8;
+	static const SizeType engine_count = 3;
+	static const char* engine_names[engine_count] = { "Flat", "Flat cached (rebuild)", "Flat cached (incremental)" };
+
+	for (SizeType engine = 0; engine < engine_count; engine++)
+	{
+		FlatHierarchy<Transform, TransformSorter> tree(tree_size * 2);
+		LastDescendantCache<> descendantCache;
 
-		SizeType a = 1 + Random::get(0, 1);
-		SizeType b = 1 + tree_size / 2 + Random::get(0, 1);
-		SizeType a_count = tree_size / 10 + Random::get(0, 1);
-		SizeType b_count = tree_size / 3 + Random::get(0, 1);
-		for (SizeType i = 0; i < tree_size; i++)
+		Random::init(13337);
+		tree.createRootNode(makeTransform());
+		for (SizeType i = 1; i < tree_size; i++)
+		{
+			tree.createNodeAsChildOf(Random::get(0, i), makeTransform());
+		}
+		descendantCache.makeCacheValid(tree);
+
+		double time = 0;
+		SizeType checksum = 0;
+		for (SizeType frame = 0; frame < frame_count; frame++)
+		{
+			ScopedProfiler prof(&time, true);
+
+			SizeType index = Random::get(1, tree.getCount());
+			if (engine == 0)
+			{
+				if (frame % 2 == 0)
+					tree.createNodeAsChildOf(index, makeTransform());
+				else
+					tree.erase(index);
+			}
+			else
+			{
+				if (frame % 2 == 0)
+					createNodeAsChildOf(tree, descendantCache, index, makeTransform());
+				else
+					erase(tree, descendantCache, index);
+
+				if (engine == 1)
+					descendantCache.cacheIsValid = false;
+			}
+
+			for (SizeType i = 0; i < query_count; i++)
+			{
+				SizeType query = Random::get(0, tree.getCount());
+				checksum += engine == 0 ? tree.getLastDescendant(query) : descendantCache.getLastDescendant(tree, query);
+			}
+		}
+		printf("%s: %f per frame, nodes: %u, checksum: %u\n", engine_names[engine], time / frame_count, tree.getCount(), checksum);
+	}
+	system("pause");
+}
+
+void sibling_mixed_test()
+{
+	// Alternates a mutation and a few child queries every frame
+	static const SizeType tree_size = 100000;
+	static const SizeType frame_count = 4000;
+	static const SizeType query_count = 8;
+	static const SizeType engine_count = 3;
+	static const char* engine_names[engine_count] = { "Flat", "Flat cached (rebuild)", "Flat cached (incremental)" };
+
+	for (SizeType engine = 0; engine < engine_count; engine++)
+	{
+		FlatHierarchy<Transform, TransformSorter> tree(tree_size * 2);
+		NextSiblingCache<> siblingCache;
+
+		Random::init(13337);
+		tree.createRootNode(makeTransform());
+		for (SizeType i = 1; i < tree_size; i++)
+		{
+			tree.createNodeAsChildOf(Random::get(0, i), makeTransform());
+		}
+		siblingCache.makeCacheValid(tree);
+
+		double time = 0;
+		SizeType checksum = 0;
+		for (SizeType frame = 0; frame < frame_count; frame++)
+		{
+			ScopedProfiler prof(&time, true);
+
+			SizeType index = Random::get(1, tree.getCount());
+			if (engine == 0)
+			{
+				if (frame % 2 == 0)
+					tree.createNodeAsChildOf(index, makeTransform());
+				else
+					tree.erase(index);
+			}
+			else
+			{
+				if (frame % 2 == 0)
+					createNodeAsChildOf(tree, siblingCache, index, makeTransform());
+				else
+					erase(tree, siblingCache, index);
+
+				if (engine == 1)
+					siblingCache.cacheIsValid = false;
+			}
+
+			for (SizeType i = 0; i < query_count; i++)
+			{
+				SizeType query = Random::get(0, tree.getCount());
+				SizeType childCount = engine == 0 ? countDirectChildren(tree, query) : countDirectChildren(tree, siblingCache, query);
+				checksum += childCount;
+				if (childCount > 0)
+					checksum += engine == 0 ? getNthChild(tree, query, childCount - 1) : getNthChild(tree, siblingCache, query, childCount - 1);
+			}
+		}
+		printf("%s: %f per frame, nodes: %u, checksum: %u\n", engine_names[engine], time / frame_count, tree.getCount(), checksum);
+	}
+	system("pause");
+}
+
+template<typename Cache>
+SizeType patched_cache_test_imp(const char* name, SizeType tree_size, SizeType frame_count)
+{
+	// Random mutations through the cache patching functions. After every one the cache is compared with a fresh makeCacheValid()
+	// and the tree with the same mutations done without a cache.
+	FlatHierarchy<Transform, TransformSorter> tree(tree_size * 2);
+	FlatHierarchy<Transform, TransformSorter> plain(tree_size * 2);
+	Cache cache;
+	Cache fresh;
+
+	Random::init(13337);
+	const Transform root = makeTransform();
+	tree.createRootNode(root);
+	plain.createRootNode(root);
+	for (SizeType i = 1; i < tree_size; i++)
+	{
+		const SizeType parent = Random::get(0, i);
+		const Transform value = makeTransform();
+		tree.createNodeAsChildOf(parent, value);
+		plain.createNodeAsChildOf(parent, value);
+	}
+	cache.makeCacheValid(tree);
+
+	SizeType mismatches = 0;
+	SizeType counts[4] = { 0, 0, 0, 0 };
+	for (SizeType frame = 0; frame < frame_count; frame++)
+	{
+		const SizeType index = Random::get(1, tree.getCount());
+		const SizeType parent = Random::get(0, tree.getCount());
+		const Transform value = makeTransform();
+		const SizeType mutation = Random::get(0, 4);
+		if (mutation == 0)
+		{
+			createNodeAsChildOf(tree, cache, index, value);
+			plain.createNodeAsChildOf(index, value);
+		}
+		else if (mutation == 1)
+		{
+			createRootNode(tree, cache, value);
+			plain.createRootNode(value);
+		}
+		else if (mutation == 2)
+		{
+			if (tree.getCount() < tree_size / 2)
+				continue;
+			erase(tree, cache, index);
+			plain.erase(index);
+		}
+		else
+		{
+			// makeChildOf() does not take a parent inside the subtree or the current parent
+			if (parent == index || tree.linearIsChildOf(parent, index) || (tree.depths[index] == tree.depths[parent] + 1 && tree.linearIsChildOf(index, parent)))
+				continue;
+			makeChildOf(tree, cache, index, parent);
+			plain.makeChildOf(index, parent);
+		}
+		++counts[mutation];
+
+		fresh.makeCacheValid(tree);
+		mismatches += cache.cacheValues.getSize() != fresh.cacheValues.getSize() || tree.getCount() != plain.getCount();
+		for (SizeType i = 0; i < fresh.cacheValues.getSize() && i < cache.cacheValues.getSize(); i++)
+		{
+			mismatches += cache.cacheValues[i] != fresh.cacheValues[i];
+		}
+		for (SizeType i = 0; i < tree.getCount() && i < plain.getCount(); i++)
+		{
+			mismatches += tree.depths[i] != plain.depths[i] || !tree.values[i].equals(plain.values[i]);
+		}
+	}
+	printf("%s: %u inserts, %u roots, %u erases, %u moves, nodes: %u, mismatches: %u\n", name, counts[0], counts[1], counts[2], counts[3], tree.getCount(), mismatches);
+	return mismatches;
+}
+
+void patched_cache_test()
+{
+	// The patched LastDescendantCache and NextSiblingCache against rebuilt ones, with every shift kernel
+	static const SizeType tree_size = 2000;
+	static const SizeType frame_count = 4000;
+
+	static const char* level_names[] = { "scalar", "SSE4.1", "AVX2", "AVX-512" };
+	const int detected = flat_detect_simd_level();
+
+	SizeType mismatches = 0;
+	for (int level = FLAT_SIMD_SCALAR; level <= detected && level <= FLAT_SIMD_AVX2; level++)
+	{
+		flat_set_simd_level(level);
+		printf("%s\n", level_names[level]);
+		mismatches += patched_cache_test_imp<LastDescendantCache<> >("LastDescendantCache", tree_size, frame_count);
+		mismatches += patched_cache_test_imp<NextSiblingCache<> >("NextSiblingCache   ", tree_size, frame_count);
+	}
+	flat_set_simd_level(detected);
+	FLAT_ASSERT(mismatches == 0);
+	system("pause");
+}
+
+// Value of the node at index in test_createDepthWalk()
+struct test_IndexValue
+{
+	static SizeType make(SizeType index)
+	{
+		return index;
+	}
+};
+
+// Value of every node of the transform trees
+struct test_TransformValue
+{
+	static Transform make(SizeType)
+	{
+		return makeTransform();
+	}
+};
+
+// Grows h to tree_size nodes with a random walk of the depth between minDepth and maxDepth, so the depth search order
+// stays valid. A node is never more than one deeper than the previous one, so the walk also starts below a single root.
+template<typename ValueMaker, typename Hierarchy>
+void test_createDepthWalk(Hierarchy& h, SizeType tree_size, SizeType minDepth, SizeType maxDepth)
+{
+	for (SizeType i = h.getCount(); i < tree_size; i++)
+	{
+		const SizeType step = Random::get(0, 3);
+		const SizeType next = (SizeType)h.depths[i - 1] + 1;
+		SizeType depth = next > step ? next - step : minDepth;
+		depth = depth > maxDepth ? maxDepth : depth < minDepth ? minDepth : depth;
+		depth = depth > next ? next : depth;
+		h.depths.pushBack((typename Hierarchy::DepthValue)depth);
+		h.values.pushBack(ValueMaker::make(i));
+	}
+}
+
+template<typename Hierarchy>
+void test_createDepthWalk(Hierarchy& h, SizeType tree_size, SizeType minDepth, SizeType maxDepth)
+{
+	test_createDepthWalk<test_IndexValue>(h, tree_size, minDepth, maxDepth);
+}
+
+template<typename Cache>
+void ancestor_cache_test_imp(const char* name, const FlatHierarchy<SizeType>& h, const FLAT_VECTOR<SizeType>& queryNodes, const FLAT_VECTOR<SizeType>& queryDepths, SizeType rep_count)
+{
+	Cache cache;
+
+	double buildTime = 0;
+	double queryTime = 0;
+	SizeType checksum = 0;
+	for (SizeType reps = 0; reps < rep_count; reps++)
+	{
+		{
+			ScopedProfiler prof(&buildTime, true);
+			cache.makeCacheValid(h);
+		}
+		{
+			ScopedProfiler prof(&queryTime, true);
+			for (SizeType i = 0; i < queryNodes.getSize(); i++)
+			{
+				checksum += cache.getParentIndex((typename Cache::RowIndex)queryDepths[i], queryNodes[i]);
+			}
+		}
+	}
+	printf("%s: build: %f, %u queries: %f, memory: %f MB, checksum: %u\n", name, buildTime / rep_count, queryNodes.getSize(), queryTime / rep_count
+		, cache.getMemoryUsage() / (1024.0 * 1024.0), checksum);
+}
+
+// Builds the rows tile by tile with FLAT_PARALLEL_FOR. Define FLAT_USE_THREADS as true to run the tiles on every core.
+struct MultiThreadedHierarchyCache : public HierarchyCache<>
+{
+	void makeCacheValid(const Hierarchy& h)
+	{
+		HierarchyCache<>::makeCacheValid(h, 0, true);
+	}
+};
+
+void ancestor_cache_test()
+{
+	// Compares the depth * N ancestor table with the binary lifting one
+	static const SizeType tree_size = 1000000;
+	static const SizeType query_count = 1000000;
+	static const SizeType rep_count = 5;
+
+	FlatHierarchy<SizeType> h(tree_size);
+	h.createRootNode(0);
+
+	Random::init(13337);
+	test_createDepthWalk(h, tree_size, 1, 40);
+
+	FLAT_VECTOR<SizeType> queryNodes;
+	FLAT_VECTOR<SizeType> queryDepths;
+	for (SizeType i = 0; i < query_count; i++)
+	{
+		SizeType node = Random::get(1, tree_size);
+		queryNodes.pushBack(node);
+		queryDepths.pushBack(Random::get(0, h.depths[node]));
+	}
+
+	ancestor_cache_test_imp<HierarchyCache<> >("HierarchyCache         ", h, queryNodes, queryDepths, rep_count);
+	ancestor_cache_test_imp<MultiThreadedHierarchyCache>("HierarchyCache (tiled) ", h, queryNodes, queryDepths, rep_count);
+	ancestor_cache_test_imp<AncestorCache<> >("AncestorCache          ", h, queryNodes, queryDepths, rep_count);
+	system("pause");
+}
+
+void parallel_cache_test()
+{
+	// Serial against tiled HierarchyCache builds and partial updates over growing trees. Build with FLAT_USE_THREADS
+	// to run the tiles on the worker pool, the pool is started before the timing.
+	static const SizeType tree_sizes[] = { 100000, 1000000, 4000000 };
+	static const SizeType rep_count = 5;
+
+	SizeType threadCount = 1;
+#if FLAT_USE_THREADS == true
+	threadCount = flat_get_thread_pool()->workerCount + 1;
+#endif
+	printf("Threads: %u\n", threadCount);
+
+	for (SizeType test = 0; test < sizeof(tree_sizes) / sizeof(tree_sizes[0]); test++)
+	{
+		const SizeType tree_size = tree_sizes[test];
+		FlatHierarchy<SizeType> h(tree_size);
+		h.createRootNode(0);
+
+		Random::init(13337);
+		test_createDepthWalk(h, tree_size, 1, 40);
+
+		HierarchyCache<> serial;
+		HierarchyCache<> tiled;
+		const SizeType maxDepth = h.findMaxDepth();
+		double serialTime = 0;
+		double tiledTime = 0;
+		double serialPartialTime = 0;
+		double tiledPartialTime = 0;
+		for (SizeType r = 0; r < rep_count; r++)
 		{
-			asdfasdf.values.pushBack(Transform(i, i + 1, i + 2, i + 1.4f)); // char('0' + i)); 
-			asdfasdf.depths.pushBack(0 == a ? 0 : (i == a || i == 1 + tree_size / 2) ? 1 : 2);
+			{
+				ScopedProfiler prof(&serialTime);
+				serial.makeCacheValid(h, (HierarchyCache<>::RowIndex)maxDepth);
+			}
+			{
+				ScopedProfiler prof(&tiledTime);
+				tiled.makeCacheValid(h, (HierarchyCache<>::RowIndex)maxDepth, true);
+			}
+
+			// The last quarter, like after an insert in the middle of the last root child
+			{
+				ScopedProfiler prof(&serialPartialTime);
+				serial.partialUpdate(h, tree_size / 4 * 3, tree_size);
+			}
+			{
+				ScopedProfiler prof(&tiledPartialTime);
+				tiled.partialUpdate(h, tree_size / 4 * 3, tree_size, true);
+			}
+		}
+
+		SizeType mismatches = 0;
+		for (SizeType row = 0; row < maxDepth; row++)
+		{
+			for (SizeType i = 0; i < tree_size; i++)
+			{
+				if (serial.row((HierarchyCache<>::RowIndex)row).column(i) != tiled.row((HierarchyCache<>::RowIndex)row).column(i))
+					++mismatches;
+			}
 		}
+		FLAT_ASSERT(mismatches == 0);
+		printf("%u nodes: build serial %f, tiled %f, partial update serial %f, tiled %f, mismatches: %u\n", tree_size
+			, serialTime / rep_count, tiledTime / rep_count, serialPartialTime / rep_count, tiledPartialTime / rep_count, mismatches);
+	}
+	system("pause");
+}
+
+void depth_count_test()
+{
+	// Alternates a mutation and a max depth plus level size query every frame
+	static const SizeType tree_size = 100000;
+	static const SizeType frame_count = 4000;
+	static const SizeType engine_count = 2;
+	static const char* engine_names[engine_count] = { "Flat (scan)", "Flat (depth counts)" };
+
+	for (SizeType engine = 0; engine < engine_count; engine++)
+	{
+		FlatHierarchy<Transform, TransformSorter> tree(tree_size * 2);
 
-		//printf("%.10s\n", asdfasdf.values.getPointer());
+		Random::init(13337);
+		tree.createRootNode(makeTransform());
+		for (SizeType i = 1; i < tree_size; i++)
+		{
+			tree.createNodeAsChildOf(Random::get(0, i), makeTransform());
+		}
+		tree.enableDepthCounts(engine == 1);
 
-		ScopedProfiler prof;
-		for (SizeType i = 0; i < test_count; i++)
+		double time = 0;
+		SizeType checksum = 0;
+		for (SizeType frame = 0; frame < frame_count; frame++)
 		{
-			SizeType a = Random::get(0, tree_size);
-			SizeType b = Random::get(0, tree_size);
-			SizeType count = Random::get(0, a > b ? tree_size - a : tree_size - b);
-			asdfasdf.move(a, b, count);
-			//printf("%.10s\n", asdfasdf.values.getPointer());
+			ScopedProfiler prof(&time, true);
+
+			SizeType index = Random::get(1, tree.getCount());
+			if (frame % 2 == 0)
+				tree.createNodeAsChildOf(index, makeTransform());
+			else
+				tree.erase(index);
+
+			const SizeType maxDepth = tree.findMaxDepth();
+			checksum += maxDepth + tree.countNodesAtDepth(maxDepth / 2);
 		}
-		double result = prof.stop();
-		printf("t: %f; ", result / test_count);
-		avg += result;
-		printf("hash: %x\n", SuperFastHash((char*)asdfasdf.values.getPointer(), sizeof(Transform) * asdfasdf.values.getSize()));
+		printf("%s: %f per frame, nodes: %u, checksum: %u\n", engine_names[engine], time / frame_count, tree.getCount(), checksum);
 	}
-	printf("avg: %f\n", avg / rep_count / test_count);
 	system("pause");
-}
\ No newline at end of file
+}
+
+template<typename DepthType>
+void depth_kernel_test_imp(const char* name, SizeType tree_size, SizeType rep_count)
+{
+	FlatHierarchy<SizeType, DefaultSorter, DepthType, uint32_t> h(tree_size);
+	h.createRootNode(0);
+
+	Random::init(13337);
+	for (SizeType i = 1; i < tree_size; i++)
+	{
+		SizeType depth = Random::get(1, h.depths[i - 1] + 2);
+		h.depths.pushBack(depth > 100 ? 100 : depth);
+		h.values.pushBack(i);
+	}
+
+	static const char* level_names[] = { "scalar", "SSE4.1", "AVX2", "AVX-512" };
+	const int detected = flat_detect_simd_level();
+	const double bytes = double(tree_size) * sizeof(DepthType) * rep_count;
+
+	for (int level = FLAT_SIMD_SCALAR; level <= detected; level++)
+	{
+		flat_set_simd_level(level);
+
+		SizeType checksum = 0;
+		uint64_t start = __rdtsc();
+		for (SizeType r = 0; r < rep_count; r++)
+		{
+			checksum += h.findMaxDepth();
+		}
+		const uint64_t maxCycles = __rdtsc() - start;
+
+		start = __rdtsc();
+		for (SizeType r = 0; r < rep_count; r++)
+		{
+			checksum += h.findMinDepthBetween(1, tree_size - 1);
+		}
+		const uint64_t minCycles = __rdtsc() - start;
+
+		printf("%s %-8s findMaxDepth: %6.2f bytes/cycle, findMinDepthBetween: %6.2f bytes/cycle, checksum: %u\n"
+			, name, level_names[level], bytes / double(maxCycles), bytes / double(minCycles), checksum);
+	}
+	flat_set_simd_level(detected);
+}
+
+void depth_kernel_test()
+{
+	// Depth reductions at every kernel width the CPU supports. 64k depths stay in the L2 cache so the kernels are compute bound.
+	static const SizeType tree_size = 65536;
+	static const SizeType rep_count = 2000;
+
+	depth_kernel_test_imp<uint8_t>("uint8 ", tree_size, rep_count);
+	depth_kernel_test_imp<uint16_t>("uint16", tree_size, rep_count);
+	depth_kernel_test_imp<uint32_t>("uint32", tree_size, rep_count);
+	system("pause");
+}
+
+void last_descendant_test()
+{
+	// getLastDescendant() at every kernel width, for random nodes and for shallow nodes with large subtrees
+	static const SizeType tree_size = 1000000;
+	static const SizeType query_count = 100000;
+	static const SizeType shallow_query_count = 1000;
+
+	FlatHierarchy<SizeType> h(tree_size);
+	h.createRootNode(0);
+
+	Random::init(13337);
+	test_createDepthWalk(h, tree_size, 1, 40);
+
+	FLAT_VECTOR<SizeType> queries;
+	FLAT_VECTOR<SizeType> shallowQueries;
+	for (SizeType i = 0; i < query_count; i++)
+	{
+		queries.pushBack(Random::get(0, tree_size));
+	}
+	for (SizeType i = 0; i < tree_size && shallowQueries.getSize() < shallow_query_count; i++)
+	{
+		if (h.depths[i] <= 2)
+			shallowQueries.pushBack(i);
+	}
+
+	static const char* level_names[] = { "scalar", "SSE4.1", "AVX2", "AVX-512" };
+	const int detected = flat_detect_simd_level();
+
+	for (int level = FLAT_SIMD_SCALAR; level <= detected; level++)
+	{
+		flat_set_simd_level(level);
+
+		double randomTime = 0;
+		double shallowTime = 0;
+		SizeType checksum = 0;
+		{
+			ScopedProfiler prof(&randomTime);
+			for (SizeType i = 0; i < query_count; i++)
+			{
+				checksum += h.getLastDescendant(queries[i]);
+			}
+		}
+		{
+			ScopedProfiler prof(&shallowTime);
+			for (SizeType i = 0; i < shallowQueries.getSize(); i++)
+			{
+				checksum += h.getLastDescendant(shallowQueries[i]);
+			}
+		}
+		printf("%-8s random nodes: %f, shallow nodes: %f, checksum: %u\n", level_names[level], randomTime, shallowTime, checksum);
+	}
+	flat_set_simd_level(detected);
+	system("pause");
+}
+
+void child_scan_test()
+{
+	// Random root to leaf travels with the uncached child scans at every kernel width and with NextSiblingCache
+	static const SizeType tree_size = 100000;
+	static const SizeType travel_count = 20000;
+
+	FlatHierarchy<Transform, TransformSorter> tree(tree_size);
+	Random::init(13337);
+	tree.createRootNode(makeTransform());
+	for (SizeType i = 1; i < tree_size; i++)
+	{
+		tree.createNodeAsChildOf(Random::get(0, i), makeTransform());
+	}
+
+	NextSiblingCache<> siblingCache;
+	siblingCache.makeCacheValid(tree);
+
+	static const char* level_names[] = { "scalar", "SSE4.1", "AVX2", "AVX-512" };
+	const int detected = flat_detect_simd_level();
+
+	for (int level = FLAT_SIMD_SCALAR; level <= detected + 1; level++)
+	{
+		const bool cached = level > detected;
+		flat_set_simd_level(level);
+
+		Random::init(1234);
+		double time = 0;
+		SizeType checksum = 0;
+		{
+			ScopedProfiler prof(&time);
+			for (SizeType travel = 0; travel < travel_count; travel++)
+			{
+				SizeType current = 0;
+				SizeType childCount = cached ? countDirectChildren(tree, siblingCache, current) : countDirectChildren(tree, current);
+				while (childCount > 0)
+				{
+					if (cached)
+					{
+						current = getNthChild(tree, siblingCache, current, Random::get(0, childCount));
+						childCount = countDirectChildren(tree, siblingCache, current);
+					}
+					else
+					{
+						current = getNthChild(tree, current, Random::get(0, childCount));
+						childCount = countDirectChildren(tree, current);
+					}
+				}
+				checksum += current;
+			}
+		}
+		printf("%-16s %f per travel, checksum: %u\n", cached ? "NextSiblingCache" : level_names[level], time / travel_count, checksum);
+	}
+	flat_set_simd_level(detected);
+	system("pause");
+}
+
+void descendant_filter_test()
+{
+	// Filters a selection of random nodes down to the ones inside a subtree
+	static const SizeType tree_size = 100000;
+	static const SizeType selection_size = 10000;
+	static const SizeType parent_count = 200;
+
+	FlatHierarchy<SizeType> h(tree_size);
+	Random::init(13337);
+	h.createRootNode(0);
+	for (SizeType i = 1; i < tree_size; i++)
+	{
+		h.createNodeAsChildOf(Random::get(0, i), i);
+	}
+
+	LastDescendantCache<> descendantCache;
+	descendantCache.makeCacheValid(h);
+
+	FLAT_VECTOR<SizeType> selection;
+	FLAT_VECTOR<SizeType> parents;
+	for (SizeType i = 0; i < selection_size; i++)
+	{
+		selection.pushBack(Random::get(0, tree_size));
+	}
+	while (parents.getSize() < parent_count)
+	{
+		// Shallow parents, so the subtrees hold a part of the selection
+		SizeType parent = Random::get(0, tree_size);
+		if (h.depths[parent] <= 2)
+			parents.pushBack(parent);
+	}
+
+	bool* results = new bool[selection_size];
+	static const SizeType engine_count = 3;
+	static const char* engine_names[engine_count] = { "linearIsChildOf", "areDescendantsOf", "areDescendantsOf (cached)" };
+
+	for (SizeType engine = 0; engine < engine_count; engine++)
+	{
+		double time = 0;
+		SizeType checksum = 0;
+		{
+			ScopedProfiler prof(&time);
+			for (SizeType p = 0; p < parent_count; p++)
+			{
+				if (engine == 0)
+				{
+					for (SizeType i = 0; i < selection_size; i++)
+					{
+						checksum += h.linearIsChildOf(selection[i], parents[p]);
+					}
+				}
+				else if (engine == 1)
+				{
+					checksum += h.areDescendantsOf(parents[p], selection.getPointer(), selection_size, results);
+				}
+				else
+				{
+					checksum += areDescendantsOf(h, descendantCache, parents[p], selection.getPointer(), selection_size, results);
+				}
+			}
+		}
+		printf("%s: %f per selection, checksum: %u\n", engine_names[engine], time / parent_count, checksum);
+	}
+	delete[] results;
+	system("pause");
+}
+
+void column_transform_test_imp(const char* name, const FlatHierarchy<Transform, TransformSorter>& tree, SizeType rep_count)
+{
+	const SizeType count = tree.getCount();
+
+	// Array of structures, same loop as test_multiplyTransforms
+	FLAT_VECTOR<Transform> resultTransforms;
+	resultTransforms.resize(count);
+	Transform tempBuffer[256];
+	FLAT_ASSERT(tree.findMaxDepth() + 1 < 256);
+
+	double aosTime = 0;
+	{
+		ScopedProfiler prof(&aosTime);
+		for (SizeType r = 0; r < rep_count; r++)
+		{
+			for (SizeType i = 0; i < count; i++)
+			{
+				Transform myTransform = tree.depths[i] == 0 ? tree.values[i] : Transform::multiply(tempBuffer[tree.depths[i] - 1], tree.values[i]);
+				resultTransforms[i] = myTransform;
+				tempBuffer[tree.depths[i]] = myTransform;
+			}
+		}
+	}
+	printf("%s AoS: %f per propagation\n", name, aosTime / rep_count);
+
+	// Structure of arrays
+	ColumnHierarchy<4> columns;
+	ColumnHierarchy<4> world;
+	columns.copyFrom<TransformSplitter>(tree);
+
+	static const char* level_names[] = { "scalar", "SSE4.1", "AVX2", "AVX-512" };
+	const int detected = flat_detect_simd_level();
+	for (int level = FLAT_SIMD_SCALAR; level <= detected && level <= FLAT_SIMD_AVX2; level++)
+	{
+		flat_set_simd_level(level);
+
+		double time = 0;
+		{
+			ScopedProfiler prof(&time);
+			for (SizeType r = 0; r < rep_count; r++)
+			{
+				columns.propagateScaleTranslate(world);
+			}
+		}
+
+		SizeType mismatches = 0;
+		for (SizeType i = 0; i < count; i++)
+		{
+			const Transform& t = resultTransforms[i];
+			if (t.pos.x != world.columns[0][i] || t.pos.y != world.columns[1][i] || t.size.x != world.columns[2][i] || t.size.y != world.columns[3][i])
+				++mismatches;
+		}
+		printf("%s SoA %-7s: %f per propagation, mismatches: %u\n", name, level_names[level], time / rep_count, mismatches);
+	}
+	flat_set_simd_level(detected);
+}
+
+void column_transform_test()
+{
+	// World transform propagation with Transform values against 4 float columns
+	static const SizeType tree_size = 100000;
+	static const SizeType rep_count = 100;
+
+	{
+		// Random tree, mostly short sibling runs
+		FlatHierarchy<Transform, TransformSorter> tree(tree_size);
+		Random::init(13337);
+		tree.createRootNode(makeTransform());
+		for (SizeType i = 1; i < tree_size; i++)
+		{
+			tree.createNodeAsChildOf(Random::get(0, i), makeTransform());
+		}
+		column_transform_test_imp("Random", tree, rep_count);
+	}
+	{
+		// UI like tree: panels of 16 to 128 leaf items under one root
+		FlatHierarchy<Transform, TransformSorter> tree(tree_size);
+		Random::init(13337);
+		tree.createRootNode(makeTransform());
+		while (tree.getCount() < tree_size)
+		{
+			const SizeType panel = tree.createNodeAsChildOf(0, makeTransform());
+			const SizeType items = Random::get(16, 128);
+			for (SizeType k = 0; k < items && tree.getCount() < tree_size; k++)
+			{
+				tree.createNodeAsChildOf(panel, makeTransform());
+			}
+		}
+		column_transform_test_imp("Wide  ", tree, rep_count);
+	}
+	system("pause");
+}
+
+void scan_down_test()
+{
+	// scanDown() with TransformMultiplyOp against the hand written loop of test_multiplyTransforms
+	static const SizeType tree_size = 100000;
+	static const SizeType rep_count = 100;
+
+	FlatHierarchy<Transform, TransformSorter> tree(tree_size);
+	Random::init(13337);
+	tree.createRootNode(makeTransform());
+	for (SizeType i = 1; i < tree_size; i++)
+	{
+		tree.createNodeAsChildOf(Random::get(0, i), makeTransform());
+	}
+
+	FLAT_VECTOR<Transform> handResults;
+	FLAT_VECTOR<Transform> scanResults;
+	handResults.resize(tree_size);
+	scanResults.resize(tree_size);
+	Transform tempBuffer[256];
+	FLAT_ASSERT(tree.findMaxDepth() + 1 < 256);
+
+	double handTime = 0;
+	{
+		ScopedProfiler prof(&handTime);
+		for (SizeType r = 0; r < rep_count; r++)
+		{
+			for (SizeType i = 0; i < tree_size; i++)
+			{
+				Transform myTransform = tree.depths[i] == 0 ? tree.values[i] : Transform::multiply(tempBuffer[tree.depths[i] - 1], tree.values[i]);
+				handResults[i] = myTransform;
+				tempBuffer[tree.depths[i]] = myTransform;
+			}
+		}
+	}
+
+	double scanTime = 0;
+	{
+		ScopedProfiler prof(&scanTime);
+		for (SizeType r = 0; r < rep_count; r++)
+		{
+			tree.scanDown<TransformMultiplyOp>(scanResults.getPointer());
+		}
+	}
+
+	SizeType mismatches = 0;
+	for (SizeType i = 0; i < tree_size; i++)
+	{
+		if (!handResults[i].equals(scanResults[i]))
+			++mismatches;
+	}
+	printf("Hand written loop: %f per propagation\n", handTime / rep_count);
+	printf("scanDown: %f per propagation, mismatches: %u\n", scanTime / rep_count, mismatches);
+	system("pause");
+}
+
+void reduce_up_test()
+{
+	// Subtree bounds and node counts with reduceUp() against recursion over the pointer trees holding the same nodes
+	static const SizeType tree_size = 100000;
+	static const SizeType rep_count = 100;
+
+	FlatHierarchy<Transform, TransformSorter> tree(tree_size);
+	Random::init(13337);
+	tree.createRootNode(makeTransform());
+	for (SizeType i = 1; i < tree_size; i++)
+	{
+		tree.createNodeAsChildOf(Random::get(0, i), makeTransform());
+	}
+
+	RivalTree<Transform, TransformSorter> rivalTree;
+	MultiwayTree<Transform, TransformSorter> multiwayTree;
+	{
+		FLAT_VECTOR<RivalTree<Transform, TransformSorter>::Node*> rivalParents;
+		FLAT_VECTOR<MultiwayTree<Transform, TransformSorter>::Node*> multiwayParents;
+		rivalParents.resize(tree.findMaxDepth() + 1);
+		multiwayParents.resize(tree.findMaxDepth() + 1);
+		for (SizeType i = 0; i < tree_size; i++)
+		{
+			const SizeType depth = tree.depths[i];
+			rivalParents[depth] = rivalTree.createNode(tree.values[i], depth == 0 ? NULL : rivalParents[depth - 1]);
+			multiwayParents[depth] = multiwayTree.createNode(tree.values[i], depth == 0 ? NULL : multiwayParents[depth - 1]);
+		}
+		rivalTree.root = rivalParents[0];
+		multiwayTree.root = multiwayParents[0];
+	}
+
+	struct LOLMBDA
+	{
+		static SubtreeBounds reduce(const RivalTreeNodeBase* node, SubtreeBounds* out, SizeType& n)
+		{
+			SubtreeBounds& result = out[n++];
+			result = SubtreeBoundsOp::leaf(((const RivalTreeNode<Transform>*)node)->value);
+			for (SizeType i = 0; i < node->children.getSize(); i++)
+			{
+				result = SubtreeBoundsOp::combine(result, reduce(node->children[i], out, n));
+			}
+			return result;
+		}
+		static SubtreeBounds reduce(const MultiwayTreeNodeBase* node, SubtreeBounds* out, SizeType& n)
+		{
+			SubtreeBounds& result = out[n++];
+			result = SubtreeBoundsOp::leaf(((const MultiwayTreeNode<Transform>*)node)->value);
+			for (const MultiwayTreeNodeBase* child = node->child; child != NULL; child = child->sibling)
+			{
+				result = SubtreeBoundsOp::combine(result, reduce(child, out, n));
+			}
+			return result;
+		}
+	};
+
+	FLAT_VECTOR<SubtreeBounds> results;
+	results.resize(tree_size);
+	static const SizeType engine_count = 3;
+	static const char* engine_names[engine_count] = { "RivalTree recursion", "MultiwayTree recursion", "reduceUp" };
+
+	for (SizeType engine = 0; engine < engine_count; engine++)
+	{
+		double time = 0;
+		{
+			ScopedProfiler prof(&time);
+			for (SizeType r = 0; r < rep_count; r++)
+			{
+				SizeType n = 0;
+				if (engine == 0)
+					LOLMBDA::reduce(rivalTree.root, results.getPointer(), n);
+				else if (engine == 1)
+					LOLMBDA::reduce(multiwayTree.root, results.getPointer(), n);
+				else
+					tree.reduceUp<SubtreeBoundsOp>(results.getPointer());
+			}
+		}
+
+		double checksum = 0;
+		SizeType countSum = 0;
+		for (SizeType i = 0; i < tree_size; i++)
+		{
+			checksum += results[i].max.x - results[i].min.y;
+			countSum += results[i].count;
+		}
+		printf("%s: %f per reduce, root count: %u, count sum: %u, checksum: %f\n", engine_names[engine], time / rep_count, results[0].count, countSum, checksum);
+	}
+	system("pause");
+}
+
+void parallel_scan_test_imp(const char* name, FlatHierarchy<Transform, TransformSorter>& tree, SizeType rep_count)
+{
+	const SizeType count = tree.getCount();
+	FLAT_VECTOR<Transform> serialResults;
+	FLAT_VECTOR<Transform> chunkResults;
+	serialResults.resize(count);
+	chunkResults.resize(count);
+
+	double serialTime = 0;
+	{
+		ScopedProfiler prof(&serialTime);
+		for (SizeType r = 0; r < rep_count; r++)
+		{
+			tree.scanDown<TransformMultiplyOp>(serialResults.getPointer());
+		}
+	}
+
+	double chunkTime = 0;
+	{
+		ScopedProfiler prof(&chunkTime);
+		for (SizeType r = 0; r < rep_count; r++)
+		{
+			tree.scanDown<TransformMultiplyOp>(chunkResults.getPointer(), true);
+		}
+	}
+
+	SizeType mismatches = 0;
+	for (SizeType i = 0; i < count; i++)
+	{
+		if (!serialResults[i].equals(chunkResults[i]))
+			++mismatches;
+	}
+
+	// The chunk buffers kept between the propagations, like every frame of a game
+	FlatHierarchy<Transform, TransformSorter>::ScanDownScratch<Transform> scratch;
+	double scratchTime = 0;
+	{
+		ScopedProfiler prof(&scratchTime);
+		for (SizeType r = 0; r < rep_count; r++)
+		{
+			tree.scanDown<TransformMultiplyOp>(chunkResults.getPointer(), scratch);
+		}
+	}
+
+	for (SizeType i = 0; i < count; i++)
+	{
+		if (!serialResults[i].equals(chunkResults[i]))
+			++mismatches;
+	}
+	FLAT_ASSERT(mismatches == 0);
+	printf("%s: serial %f, chunked %f, chunked with scratch %f per propagation, max depth: %u, mismatches: %u\n", name
+		, serialTime / rep_count, chunkTime / rep_count, scratchTime / rep_count, (SizeType)tree.findMaxDepth(), mismatches);
+}
+
+void parallel_scan_test()
+{
+	// Chunked scanDown() against the serial one, build with FLAT_USE_THREADS to run the chunks on all cores
+	static const SizeType tree_size = 1000000;
+	static const SizeType rep_count = 20;
+	static const SizeType max_depths[] = { 40, 400 };
+	static const char* names[] = { "Depth 40 ", "Depth 400" };
+
+	SizeType threadCount = 1;
+#if FLAT_USE_THREADS == true
+	threadCount = flat_get_thread_pool()->workerCount + 1;
+#endif
+	printf("Threads: %u\n", threadCount);
+
+	for (SizeType test = 0; test < 2; test++)
+	{
+		// Random walk of the depth from depth 2. Every node below depth 1 is in the subtree of the second node,
+		// like in a file system, so splitting the work at the root children would not help.
+		FlatHierarchy<Transform, TransformSorter> tree(tree_size);
+		Random::init(13337);
+		tree.createRootNode(makeTransform());
+		test_createDepthWalk<test_TransformValue>(tree, tree_size, 2, max_depths[test]);
+		parallel_scan_test_imp(names[test], tree, rep_count);
+	}
+	system("pause");
+}
+
+void dirty_update_test()
+{
+	// World transforms kept up to date with ScanDownCache against a full scanDown() every frame
+	static const SizeType tree_size = 100000;
+	static const SizeType frame_count = 100;
+	static const SizeType change_counts[] = { 1, 10, 100, 1000 };
+
+	FlatHierarchy<Transform, TransformSorter> tree(tree_size);
+	Random::init(13337);
+	tree.createRootNode(makeTransform());
+	for (SizeType i = 1; i < tree_size; i++)
+	{
+		tree.createNodeAsChildOf(Random::get(0, i), makeTransform());
+	}
+
+	FLAT_VECTOR<Transform> fullResults;
+	fullResults.resize(tree_size);
+	ScanDownCache<TransformMultiplyOp, Transform> worldCache;
+	worldCache.makeCacheValid(tree);
+
+	for (SizeType test = 0; test < sizeof(change_counts) / sizeof(change_counts[0]); test++)
+	{
+		double fullTime = 0;
+		double dirtyTime = 0;
+		SizeType recomputed = 0;
+		for (SizeType frame = 0; frame < frame_count; frame++)
+		{
+			for (SizeType i = 0; i < change_counts[test]; i++)
+			{
+				const SizeType index = Random::get(0, tree_size);
+				tree.values[index].pos.x = Random::get(0, 900) / 1000.0f;
+				worldCache.markDirty(index);
+			}
+			{
+				ScopedProfiler prof(&fullTime);
+				tree.scanDown<TransformMultiplyOp>(fullResults.getPointer());
+			}
+			{
+				ScopedProfiler prof(&dirtyTime);
+				recomputed += worldCache.update(tree);
+			}
+		}
+
+		SizeType mismatches = 0;
+		for (SizeType i = 0; i < tree_size; i++)
+		{
+			if (!fullResults[i].equals(worldCache[i]))
+				++mismatches;
+		}
+		printf("%u changes: full %f, dirty %f per frame, recomputed nodes: %u, mismatches: %u\n", change_counts[test], fullTime / frame_count, dirtyTime / frame_count, recomputed / frame_count, mismatches);
+	}
+	system("pause");
+}
+
+void cull_test()
+{
+	// Rect queries over subtree bounds of the world transforms. The flat tree skips culled subtrees with LastDescendantCache jumps,
+	// the pointer trees skip them by not recursing.
+	static const SizeType tree_size = 100000;
+	static const SizeType query_count = 1000;
+	static const SizeType frame_count = 100;
+	static const SizeType changes_per_frame = 10;
+
+	FlatHierarchy<Transform, TransformSorter> tree(tree_size);
+	Random::init(13337);
+	tree.createRootNode(makeTransform());
+	for (SizeType i = 1; i < tree_size; i++)
+	{
+		tree.createNodeAsChildOf(Random::get(0, i), makeTransform());
+	}
+
+	LastDescendantCache<> descendantCache;
+	ScanDownCache<TransformMultiplyOp, Transform> worldCache;
+	ReduceUpCache<SubtreeBoundsOp, SubtreeBounds> boundsCache;
+	descendantCache.makeCacheValid(tree);
+	worldCache.makeCacheValid(tree);
+	boundsCache.makeCacheValid(tree, worldCache.cacheValues.getPointer());
+
+	// Incremental bounds: marking the root of a changed subtree recomputes the whole subtree
+	{
+		double fullTime = 0;
+		double dirtyTime = 0;
+		SizeType visited = 0;
+		FLAT_VECTOR<SubtreeBounds> fullBounds;
+		fullBounds.resize(tree_size);
+		for (SizeType frame = 0; frame < frame_count; frame++)
+		{
+			for (SizeType i = 0; i < changes_per_frame; i++)
+			{
+				const SizeType index = Random::get(0, tree_size);
+				tree.values[index].pos.x = Random::get(0, 900) / 1000.0f;
+				worldCache.markDirty(index);
+				boundsCache.markDirty(index);
+			}
+			worldCache.update(tree);
+			{
+				ScopedProfiler prof(&fullTime);
+				tree.reduceUp<SubtreeBoundsOp>(worldCache.cacheValues.getPointer(), fullBounds.getPointer());
+			}
+			{
+				ScopedProfiler prof(&dirtyTime);
+				visited += boundsCache.update(tree, worldCache.cacheValues.getPointer(), descendantCache);
+			}
+		}
+
+		SizeType mismatches = 0;
+		for (SizeType i = 0; i < tree_size; i++)
+		{
+			const SubtreeBounds& a = fullBounds[i];
+			const SubtreeBounds& b = boundsCache[i];
+			if (a.min.x != b.min.x || a.min.y != b.min.y || a.max.x != b.max.x || a.max.y != b.max.y || a.count != b.count)
+				++mismatches;
+		}
+		printf("Bounds, %u changes: full reduceUp %f, update %f per frame, visited nodes: %u, mismatches: %u\n", changes_per_frame
+			, fullTime / frame_count, dirtyTime / frame_count, visited / frame_count, mismatches);
+	}
+
+	RivalTree<CullNode, UnsortedSorter> rivalTree;
+	MultiwayTree<CullNode, UnsortedSorter> multiwayTree;
+	{
+		FLAT_VECTOR<RivalTree<CullNode, UnsortedSorter>::Node*> rivalParents;
+		FLAT_VECTOR<MultiwayTree<CullNode, UnsortedSorter>::Node*> multiwayParents;
+		rivalParents.resize(tree.findMaxDepth() + 1);
+		multiwayParents.resize(tree.findMaxDepth() + 1);
+		for (SizeType i = 0; i < tree_size; i++)
+		{
+			CullNode node;
+			node.rect = SubtreeBoundsOp::leaf(worldCache[i]);
+			node.bounds = boundsCache[i];
+
+			const SizeType depth = tree.depths[i];
+			rivalParents[depth] = rivalTree.createNode(node, depth == 0 ? NULL : rivalParents[depth - 1]);
+			multiwayParents[depth] = multiwayTree.createNode(node, depth == 0 ? NULL : multiwayParents[depth - 1]);
+		}
+		rivalTree.root = rivalParents[0];
+		multiwayTree.root = multiwayParents[0];
+	}
+
+	FLAT_VECTOR<SubtreeBounds> queries;
+	for (SizeType i = 0; i < query_count; i++)
+	{
+		const float width = Random::get(50, 200) / 1000.0f;
+		const float height = Random::get(50, 200) / 1000.0f;
+		SubtreeBounds query;
+		query.min = Vector2(Random::get(0, 1000) / 1000.0f - width * 0.5f, Random::get(0, 1000) / 1000.0f - height * 0.5f);
+		query.max = query.min + Vector2(width, height);
+		query.count = 0;
+		queries.pushBack(query);
+	}
+
+	struct LOLMBDA
+	{
+		const ScanDownCache<TransformMultiplyOp, Transform>* world;
+		const SubtreeBounds* query;
+		SizeType hits;
+
+		void operator()(SizeType index)
+		{
+			hits += SubtreeBoundsOp::overlaps(SubtreeBoundsOp::leaf((*world)[index]), *query);
+		}
+		static SizeType visit(const RivalTreeNodeBase* node, const SubtreeBounds& query)
+		{
+			const CullNode& value = ((const RivalTreeNode<CullNode>*)node)->value;
+			if (!SubtreeBoundsOp::overlaps(value.bounds, query))
+				return 0;
+
+			SizeType hits = SubtreeBoundsOp::overlaps(value.rect, query);
+			for (SizeType i = 0; i < node->children.getSize(); i++)
+			{
+				hits += visit(node->children[i], query);
+			}
+			return hits;
+		}
+		static SizeType visit(const MultiwayTreeNodeBase* node, const SubtreeBounds& query)
+		{
+			const CullNode& value = ((const MultiwayTreeNode<CullNode>*)node)->value;
+			if (!SubtreeBoundsOp::overlaps(value.bounds, query))
+				return 0;
+
+			SizeType hits = SubtreeBoundsOp::overlaps(value.rect, query);
+			for (const MultiwayTreeNodeBase* child = node->child; child != NULL; child = child->sibling)
+			{
+				hits += visit(child, query);
+			}
+			return hits;
+		}
+	};
+
+	static const SizeType engine_count = 3;
+	static const char* engine_names[engine_count] = { "RivalTree", "MultiwayTree", "forEachVisible" };
+	for (SizeType engine = 0; engine < engine_count; engine++)
+	{
+		double time = 0;
+		SizeType checksum = 0;
+		{
+			ScopedProfiler prof(&time);
+			for (SizeType q = 0; q < query_count; q++)
+			{
+				if (engine == 0)
+				{
+					checksum += LOLMBDA::visit(rivalTree.root, queries[q]);
+				}
+				else if (engine == 1)
+				{
+					checksum += LOLMBDA::visit(multiwayTree.root, queries[q]);
+				}
+				else
+				{
+					LOLMBDA visitor;
+					visitor.world = &worldCache;
+					visitor.query = &queries[q];
+					visitor.hits = 0;
+					forEachVisible(boundsCache, descendantCache, queries[q], visitor);
+					checksum += visitor.hits;
+				}
+			}
+		}
+		printf("%s: %f per query, checksum: %u\n", engine_names[engine], time / query_count, checksum);
+	}
+	system("pause");
+}
+
+void hit_test()
+{
+	// Deepest node under random points, a linear scan over the world transforms against RectHitIndex at every kernel width
+	static const SizeType size_count = 4;
+	static const SizeType tree_sizes[size_count] = { 1000, 10000, 100000, 300000 };
+	static const SizeType query_count = 1000;
+
+	static const char* level_names[] = { "scalar", "SSE4.1", "AVX2", "AVX-512" };
+	const int detected = flat_detect_simd_level();
+
+	for (SizeType s = 0; s < size_count; s++)
+	{
+		const SizeType tree_size = tree_sizes[s];
+
+		FlatHierarchy<Transform, TransformSorter> tree(tree_size);
+		Random::init(13337);
+		tree.createRootNode(makeTransform());
+		for (SizeType i = 1; i < tree_size; i++)
+		{
+			tree.createNodeAsChildOf(Random::get(0, i), makeTransform());
+		}
+
+		FLAT_VECTOR<Transform> world;
+		world.resize(tree_size);
+		tree.scanDown<TransformMultiplyOp>(world.getPointer());
+
+		FLAT_VECTOR<Vector2> queries;
+		for (SizeType i = 0; i < query_count; i++)
+		{
+			queries.pushBack(Vector2(Random::get(0, 1000) / 1000.0f, Random::get(0, 1000) / 1000.0f));
+		}
+
+		// What mouse over does without an index, every rect is tested
+		FLAT_VECTOR<SizeType> scanHits;
+		scanHits.resize(query_count);
+		double scanTime = 0;
+		{
+			ScopedProfiler prof(&scanTime);
+			for (SizeType q = 0; q < query_count; q++)
+			{
+				const Vector2& p = queries[q];
+				SizeType hit = tree.getIndexNotFound();
+				for (SizeType i = 0; i < tree_size; i++)
+				{
+					const Transform& t = world[i];
+					if (p.x >= t.pos.x && p.x <= t.pos.x + t.size.x && p.y >= t.pos.y && p.y <= t.pos.y + t.size.y
+						&& (hit == tree.getIndexNotFound() || tree.depths[i] >= tree.depths[hit]))
+						hit = i;
+				}
+				scanHits[q] = hit;
+			}
+		}
+		printf("%u nodes, linear scan: %f per query\n", tree_size, scanTime / query_count);
+
+		double buildTime = 0;
+		RectHitIndex<> index;
+		{
+			ScopedProfiler prof(&buildTime);
+			index.build<TransformSplitter>(tree, world.getPointer());
+		}
+
+		for (int level = FLAT_SIMD_SCALAR; level <= detected && level <= FLAT_SIMD_AVX2; level++)
+		{
+			flat_set_simd_level(level);
+
+			double time = 0;
+			SizeType mismatches = 0;
+			{
+				ScopedProfiler prof(&time);
+				for (SizeType q = 0; q < query_count; q++)
+				{
+					mismatches += index.hitTest(tree, queries[q].x, queries[q].y) != scanHits[q];
+				}
+			}
+			printf("%u nodes, hitTest %-7s: %f per query (build %f), mismatches: %u\n", tree_size, level_names[level], time / query_count, buildTime, mismatches);
+			FLAT_ASSERT(mismatches == 0);
+		}
+		flat_set_simd_level(detected);
+
+		// Move a few rects, then update() against a full build
+		static const SizeType moved_count = 100;
+		for (SizeType m = 0; m < moved_count; m++)
+		{
+			const SizeType i = Random::get(0, tree_size - 1);
+			world[i] = makeTransform();
+			index.setRect(i, world[i].pos.x, world[i].pos.y, world[i].size.x, world[i].size.y);
+		}
+
+		double updateTime = 0;
+		SizeType visited = 0;
+		{
+			ScopedProfiler prof(&updateTime);
+			visited = index.update(tree);
+		}
+
+		double rebuildTime = 0;
+		RectHitIndex<> rebuilt;
+		{
+			ScopedProfiler prof(&rebuildTime);
+			rebuilt.build<TransformSplitter>(tree, world.getPointer());
+		}
+
+		SizeType mismatches = 0;
+		for (SizeType i = 0; i < tree_size; i++)
+		{
+			const RectBounds& a = index.boundsCache[i];
+			const RectBounds& b = rebuilt.boundsCache[i];
+			mismatches += a.minX != b.minX || a.minY != b.minY || a.maxX != b.maxX || a.maxY != b.maxY;
+		}
+		for (SizeType q = 0; q < query_count; q++)
+		{
+			mismatches += index.hitTest(tree, queries[q].x, queries[q].y) != rebuilt.hitTest(tree, queries[q].x, queries[q].y);
+		}
+		printf("%u nodes, %u moved rects: update %f (%u visited), build %f, mismatches: %u\n", tree_size, moved_count, updateTime, visited, rebuildTime, mismatches);
+		FLAT_ASSERT(mismatches == 0);
+	}
+	system("pause");
+}
+
+void lca_test()
+{
+	// Lowest common ancestor of random node pairs, close together and anywhere in the tree. Climbing both nodes one
+	// parent at a time against findMinDepthBetween() with the linear kernel and with the depth range index.
+	static const SizeType tree_size = 1000000;
+	static const SizeType query_count = 2000;
+	static const SizeType set_count = 2;
+	static const char* set_names[set_count] = { "Close pairs", "Any pairs  " };
+	static const SizeType engine_count = 3;
+	static const char* engine_names[engine_count] = { "climb", "scan", "index" };
+
+	FlatHierarchy<SizeType> h(tree_size);
+	h.createRootNode(0);
+
+	Random::init(13337);
+	test_createDepthWalk(h, tree_size, 1, 40);
+
+	double buildTime = 0;
+	{
+		ScopedProfiler prof(&buildTime);
+		h.enableDepthRangeIndex(true);
+	}
+	const SizeType indexBytes = (h.depthRangeTable.getSize() + h.depthRangeParents.getSize()) * sizeof(SizeType);
+	printf("Depth range index: build %f, %f bytes per node\n", buildTime, (double)indexBytes / tree_size);
+
+	for (SizeType set = 0; set < set_count; set++)
+	{
+		FLAT_VECTOR<SizeType> queryA;
+		FLAT_VECTOR<SizeType> queryB;
+		FLAT_VECTOR<SizeType> climbResults; // Every engine has to find the node of the climb
+		FLAT_VECTOR<SizeType> results;
+		climbResults.resize(query_count);
+		results.resize(query_count);
+		for (SizeType i = 0; i < query_count; i++)
+		{
+			const SizeType a = Random::get(0, tree_size);
+			const SizeType offset = Random::get(1, 4096);
+			const SizeType b = set == 0 ? (a + offset < tree_size ? a + offset : tree_size - 1) : Random::get(0, tree_size);
+			queryA.pushBack(a);
+			queryB.pushBack(b);
+		}
+
+		for (SizeType engine = 0; engine < engine_count; engine++)
+		{
+			if (engine == 2)
+				h.makeDepthRangeIndexValid();
+			else
+				h.depthRangeIndexValid = false; // Falls back to the linear kernel
+
+			double lcaTime = 0;
+			double minTime = 0;
+			SizeType checksum = 0;
+			SizeType minChecksum = 0;
+			{
+				ScopedProfiler prof(&lcaTime);
+				for (SizeType q = 0; q < query_count; q++)
+				{
+					if (engine == 0)
+					{
+						SizeType x = queryA[q];
+						SizeType y = queryB[q];
+						while (x != y)
+						{
+							SizeType& up = h.depths[x] > h.depths[y] || (h.depths[x] == h.depths[y] && x > y) ? x : y;
+							SizeType parent = up - 1;
+							while (h.depths[parent] >= h.depths[up])
+							{
+								--parent;
+							}
+							up = parent;
+						}
+						results[q] = x;
+					}
+					else
+					{
+						results[q] = h.lowestCommonAncestor(queryA[q], queryB[q]);
+					}
+					checksum += results[q];
+				}
+			}
+
+			SizeType mismatches = 0;
+			for (SizeType q = 0; q < query_count; q++)
+			{
+				if (engine == 0)
+					climbResults[q] = results[q];
+				mismatches += results[q] != climbResults[q];
+			}
+			FLAT_ASSERT(mismatches == 0);
+
+			if (engine != 0)
+			{
+				ScopedProfiler prof(&minTime);
+				for (SizeType q = 0; q < query_count; q++)
+				{
+					const SizeType first = queryA[q] < queryB[q] ? queryA[q] : queryB[q];
+					const SizeType last = queryA[q] < queryB[q] ? queryB[q] : queryA[q];
+					minChecksum += h.findMinDepthBetween(first, last);
+				}
+			}
+			printf("%s %-5s: lowestCommonAncestor %f, findMinDepthBetween %f per query, checksum: %u, min depth checksum: %u\n", set_names[set]
+				, engine_names[engine], lcaTime / query_count, minTime / query_count, checksum, minChecksum);
+		}
+	}
+	system("pause");
+}
+
+void depth_range_index_test()
+{
+	// Every writer of depths has to invalidate the depth range index, or the queries read a stale table
+	static const SizeType tree_size = 5000;
+
+	FlatHierarchy<SizeType> h(tree_size);
+	h.createRootNode(0);
+
+	Random::init(13337);
+	test_createDepthWalk(h, tree_size, 1, 40);
+	h.enableDepthRangeIndex(true);
+	FLAT_ASSERT(h.isDepthRangeIndexValid());
+
+	// 10 roots copied over the indexed tree
+	PackedHierarchy<SizeType> packed;
+	for (SizeType i = 0; i < 10; i++)
+	{
+		packed.createRootNode(i);
+	}
+	packed.copyTo(h);
+	FLAT_ASSERT(h.getCount() == 10);
+	FLAT_ASSERT(!h.isDepthRangeIndexValid());
+	FLAT_ASSERT(h.lowestCommonAncestor(2, 5) == h.getIndexNotFound());
+
+	h.makeDepthRangeIndexValid();
+	FLAT_ASSERT(h.isDepthRangeIndexValid());
+	FLAT_ASSERT(h.lowestCommonAncestor(2, 5) == h.getIndexNotFound());
+
+	// Root 5 under root 2, then the mutations of FlatHierarchy, the cached free functions and ColumnHierarchy
+	SizeType child = h.makeChildOf(5, 2);
+	FLAT_ASSERT(!h.isDepthRangeIndexValid());
+	FLAT_ASSERT(h.lowestCommonAncestor(2, child) == 2);
+
+	h.makeDepthRangeIndexValid();
+	h.move(0, 10, 1);
+	FLAT_ASSERT(!h.isDepthRangeIndexValid());
+	h.move(9, 0, 1);
+
+	LastDescendantCache<> descendantCache;
+	h.makeDepthRangeIndexValid();
+	createNodeAsChildOf(h, descendantCache, 0, (SizeType)100);
+	FLAT_ASSERT(!h.isDepthRangeIndexValid());
+	FLAT_ASSERT(h.lowestCommonAncestor(0, 1) == 0);
+
+	ColumnHierarchy<4> columns;
+	const float rect[4] = { 0.0f, 0.0f, 1.0f, 1.0f };
+	columns.createRootNode(rect);
+	columns.createRootNode(rect);
+	columns.enableDepthRangeIndex(true);
+	columns.createNodeAsChildOf(0, rect);
+	FLAT_ASSERT(!columns.isDepthRangeIndexValid());
+	columns.makeDepthRangeIndexValid();
+	FLAT_ASSERT(columns.lowestCommonAncestor(1, 2) == columns.getIndexNotFound());
+
+	ColumnHierarchy<4> world;
+	world.enableDepthRangeIndex(true);
+	columns.propagateScaleTranslate(world);
+	FLAT_ASSERT(!world.isDepthRangeIndexValid());
+	world.makeDepthRangeIndexValid();
+	FLAT_ASSERT(world.lowestCommonAncestor(0, 1) == 0);
+
+	printf("Depth range index invalidation ok\n");
+	system("pause");
+}
+
+template<typename Hierarchy>
+void batch_edit_copy(Hierarchy& dst, const Hierarchy& src)
+{
+	dst.depths.clear();
+	dst.values.clear();
+	for (SizeType i = 0; i < src.getCount(); i++)
+	{
+		dst.depths.pushBack(src.depths[i]);
+		dst.values.pushBack(src.values[i]);
+	}
+}
+
+template<typename Hierarchy>
+SizeType batch_edit_mismatches(const Hierarchy& a, const Hierarchy& b)
+{
+	if (a.getCount() != b.getCount())
+		return 1;
+
+	SizeType mismatches = 0;
+	for (SizeType i = 0; i < a.getCount(); i++)
+	{
+		mismatches += a.depths[i] != b.depths[i] || a.values[i] != b.values[i];
+	}
+	return mismatches;
+}
+
+// Random tree of unique keys, so a node is found again by its value. The keys are even, the tests insert odd ones.
+// Every tree_size / root_count th node is a new root.
+template<typename Hierarchy>
+void batch_edit_createTree(Hierarchy& h, SizeType tree_size, SizeType root_count = 1)
+{
+	h.depths.clear();
+	h.values.clear();
+	h.createRootNode(0);
+	for (SizeType i = 1; i < tree_size; i++)
+	{
+		const SizeType value = 2 * ((i * 2654435761U) & 0x7fffffff);
+		if (i % (tree_size / root_count) == 0)
+			h.createRootNode(value);
+		else
+			h.createNodeAsChildOf(Random::get(0, h.getCount()), value);
+	}
+}
+
+template<typename Sorter>
+void create_nodes_test_imp(const char* name, SizeType tree_size, SizeType rep_count)
+{
+	typedef FlatHierarchy<SizeType, Sorter> Hierarchy;
+
+	Hierarchy batch(tree_size * 2);
+	Hierarchy single(tree_size * 2);
+	batch_edit_createTree(batch, tree_size);
+	SizeType nextOdd = 1;
+
+	SizeType mismatches = 0;
+	for (SizeType rep = 0; rep < rep_count; rep++)
+	{
+		// Start over when the blocks have doubled the tree
+		if (batch.getCount() > tree_size * 2)
+			batch_edit_createTree(batch, tree_size);
+
+		// createNodesAsChildrenOf() against createNodeAsChildOf() for every node of the block. Values grow in depth search order,
+		// so the siblings inside the block are sorted too.
+		{
+			static const SizeType max_block_size = 16;
+			SizeType blockValues[max_block_size];
+			typename Hierarchy::DepthValue blockDepths[max_block_size];
+			const SizeType blockSize = Random::get(1, max_block_size + 1);
+			for (SizeType k = 0; k < blockSize; k++)
+			{
+				blockDepths[k] = k == 0 ? 0 : (typename Hierarchy::DepthValue)Random::get(0, blockDepths[k - 1] + 2);
+				blockValues[k] = nextOdd;
+				nextOdd += 2;
+			}
+			const SizeType parent = Random::get(0, batch.getCount());
+			const SizeType parentValue = batch.values[parent];
+
+			batch_edit_copy(single, batch);
+			const SizeType first = batch.createNodesAsChildrenOf(parent, blockValues, blockDepths, blockSize);
+			mismatches += batch.values[first] != blockValues[0];
+
+			// Nodes without sorting become the first child, so the siblings go in back to front
+			for (SizeType k = blockSize; k-- > 0; )
+			{
+				if (blockDepths[k] == 0)
+					single.createNodeAsChildOf(single.findValue(parentValue), blockValues[k]);
+			}
+			for (SizeType k = 0; k < blockSize; k++)
+			{
+				SizeType end = k + 1;
+				while (end < blockSize && blockDepths[end] > blockDepths[k])
+				{
+					++end;
+				}
+				for (SizeType c = end; c-- > k + 1; )
+				{
+					if (blockDepths[c] == blockDepths[k] + 1)
+						single.createNodeAsChildOf(single.findValue(blockValues[k]), blockValues[c]);
+				}
+			}
+			mismatches += batch_edit_mismatches(batch, single);
+		}
+	}
+	printf("%s: %u blocks, nodes: %u, mismatches: %u\n", name, rep_count, batch.getCount(), mismatches);
+	FLAT_ASSERT(mismatches == 0);
+}
+
+void create_nodes_test()
+{
+	// createNodesAsChildrenOf() against createNodeAsChildOf() on small random trees
+	static const SizeType tree_size = 200;
+	static const SizeType rep_count = 2000;
+
+	Random::init(13337);
+	create_nodes_test_imp<DefaultSorter>("Sorted  ", tree_size, rep_count);
+	create_nodes_test_imp<UnsortedSorter>("Unsorted", tree_size, rep_count);
+	system("pause");
+}
+
+template<typename Sorter>
+void erase_many_test_imp(const char* name, SizeType tree_size, SizeType rep_count)
+{
+	typedef FlatHierarchy<SizeType, Sorter> Hierarchy;
+
+	Hierarchy batch(tree_size);
+	Hierarchy single(tree_size);
+	Hierarchy cached(tree_size);
+	batch_edit_createTree(batch, tree_size);
+
+	LastDescendantCache<> descendantCache;
+	LastDescendantCache<> freshCache;
+
+	SizeType mismatches = 0;
+	SizeType erasedNodes = 0;
+	for (SizeType rep = 0; rep < rep_count; rep++)
+	{
+		// Start over when half of the tree is gone
+		if (batch.getCount() < tree_size / 2)
+			batch_edit_createTree(batch, tree_size);
+
+		// eraseMany() with the LastDescendantCache against erase() for every index, with duplicates and indices inside erased subtrees
+		static const SizeType max_erase_count = 8;
+		SizeType indices[max_erase_count];
+		SizeType eraseValues[max_erase_count];
+		const SizeType eraseCount = Random::get(1, max_erase_count + 1);
+		for (SizeType e = 0; e < eraseCount; e++)
+		{
+			indices[e] = Random::get(1, batch.getCount());
+			eraseValues[e] = batch.values[indices[e]];
+		}
+
+		batch_edit_copy(single, batch);
+		batch_edit_copy(cached, batch);
+		descendantCache.makeCacheValid(cached);
+
+		const SizeType erased = batch.eraseMany(indices, eraseCount);
+		erasedNodes += erased;
+		mismatches += eraseMany(cached, descendantCache, indices, eraseCount) != erased;
+		for (SizeType e = 0; e < eraseCount; e++)
+		{
+			const SizeType index = single.findValue(eraseValues[e]);
+			if (index != single.getIndexNotFound())
+				single.erase(index);
+		}
+		mismatches += batch_edit_mismatches(batch, single);
+		mismatches += batch_edit_mismatches(batch, cached);
+
+		freshCache.makeCacheValid(batch);
+		for (SizeType i = 0; i < batch.getCount(); i++)
+		{
+			mismatches += descendantCache.getLastDescendant(i) != freshCache.getLastDescendant(i);
+		}
+	}
+	printf("%s: %u erase lists, %u erased nodes, mismatches: %u\n", name, rep_count, erasedNodes, mismatches);
+	FLAT_ASSERT(mismatches == 0);
+}
+
+void erase_many_test()
+{
+	// Both eraseMany() overloads against erase() on small random trees
+	static const SizeType tree_size = 200;
+	static const SizeType rep_count = 2000;
+
+	Random::init(13337);
+	erase_many_test_imp<DefaultSorter>("Sorted  ", tree_size, rep_count);
+	erase_many_test_imp<UnsortedSorter>("Unsorted", tree_size, rep_count);
+	system("pause");
+}
+
+template<typename Sorter>
+void batch_edit_test_imp(const char* name, SizeType tree_size, SizeType rep_count)
+{
+	typedef FlatHierarchy<SizeType, Sorter> Hierarchy;
+
+	Hierarchy batch(tree_size);
+	Hierarchy single(tree_size);
+	typename Hierarchy::MakeChildrenScratch scratch;
+
+	SizeType mismatches = 0;
+	SizeType rejectedMoves = 0;
+	SizeType comparedMoves = 0;
+	for (SizeType rep = 0; rep < rep_count; rep++)
+	{
+		// Start over every now and then with a few roots, moves of roots merge them. The depth counts are rebuilt after
+		// the tree, makeChildrenOf() updates them for its span only.
+		if (rep % 100 == 0)
+		{
+			batch_edit_createTree(batch, tree_size, 4);
+			batch.enableDepthCounts(true);
+		}
+
+		// makeChildrenOf() against makeChildOf() for every move, in list order with sorting and back to front without. Move lists
+		// that pass through a state makeChildOf() can not do, a parent inside the moved subtree, are only done in one go.
+		{
+			static const SizeType max_move_count = 8;
+			SizeType children[max_move_count];
+			SizeType newParents[max_move_count];
+			SizeType newIndices[max_move_count];
+			SizeType childValues[max_move_count];
+			SizeType parentValues[max_move_count];
+			const SizeType moveCount = Random::get(1, max_move_count + 1);
+			for (SizeType m = 0; m < moveCount; m++)
+			{
+				children[m] = Random::get(1, batch.getCount());
+				newParents[m] = Random::get(0, batch.getCount());
+				childValues[m] = batch.values[children[m]];
+				parentValues[m] = batch.values[newParents[m]];
+			}
+
+			batch_edit_copy(single, batch);
+			// Every other call with the scratch kept between calls
+			const bool moved = rep % 2 == 0 ? batch.makeChildrenOf(children, newParents, moveCount, scratch, newIndices)
+				: batch.makeChildrenOf(children, newParents, moveCount, newIndices);
+			if (!moved)
+			{
+				++rejectedMoves;
+				mismatches += batch_edit_mismatches(batch, single);
+			}
+			else
+			{
+				for (SizeType m = 0; m < moveCount; m++)
+				{
+					mismatches += batch.values[newIndices[m]] != childValues[m];
+				}
+
+				bool doable = true;
+				for (SizeType n = 0; n < moveCount && doable; n++)
+				{
+					const SizeType m = Sorter::UseSorting == true ? n : moveCount - 1 - n;
+					const SizeType child = single.findValue(childValues[m]);
+					const SizeType parent = single.findValue(parentValues[m]);
+					doable = !single.linearIsChildOf(parent, child);
+					if (doable)
+						single.makeChildOf(child, parent);
+				}
+				if (doable)
+				{
+					++comparedMoves;
+					mismatches += batch_edit_mismatches(batch, single);
+					mismatches += batch.findMaxDepth() != single.findMaxDepth();
+				}
+			}
+		}
+	}
+	printf("%s: %u reps, %u move lists compared, %u rejected, mismatches: %u\n", name, rep_count, comparedMoves, rejectedMoves, mismatches);
+	FLAT_ASSERT(mismatches == 0);
+}
+
+void batch_edit_test()
+{
+	// makeChildrenOf() against makeChildOf() on small random trees
+	static const SizeType tree_size = 200;
+	static const SizeType rep_count = 2000;
+
+	Random::init(13337);
+	batch_edit_test_imp<DefaultSorter>("Sorted  ", tree_size, rep_count);
+	batch_edit_test_imp<UnsortedSorter>("Unsorted", tree_size, rep_count);
+	system("pause");
+}
+
+void succinct_test()
+{
+	// Memory and query latency of the balanced parentheses index against the depths-vector and the index caches
+	static const SizeType tree_size = 4000000;
+	static const SizeType query_count = 1000000;
+	static const SizeType engine_count = 4;
+	static const char* engine_names[engine_count] = { "Depths + kernels  ", "LastDescendantCache", "NextSiblingCache ", "SuccinctHierarchy" };
+
+	FlatHierarchy<SizeType> h(tree_size);
+	h.createRootNode(0);
+
+	Random::init(13337);
+	test_createDepthWalk(h, tree_size, 1, 40);
+
+	LastDescendantCache<> descendantCache;
+	NextSiblingCache<> siblingCache;
+	SuccinctHierarchy<> succinct;
+	double buildTimes[engine_count] = { 0, 0, 0, 0 };
+	{
+		ScopedProfiler prof(&buildTimes[1]);
+		descendantCache.makeCacheValid(h);
+	}
+	{
+		ScopedProfiler prof(&buildTimes[2]);
+		siblingCache.makeCacheValid(h);
+	}
+	{
+		ScopedProfiler prof(&buildTimes[3]);
+		succinct.build(h);
+	}
+	const double byteCounts[engine_count] = { (double)h.depths.getSize() * sizeof(FLAT_DEPTHTYPE), (double)descendantCache.cacheValues.getSize() * sizeof(SizeType)
+		, (double)siblingCache.cacheValues.getSize() * sizeof(SizeType), (double)succinct.getByteCount() };
+
+	SizeType mismatches = 0;
+	for (SizeType i = 0; i < tree_size; i++)
+	{
+		mismatches += succinct.getDepth(i) != h.depths[i];
+		mismatches += succinct.getLastDescendant(i) != descendantCache.getLastDescendant(i);
+		mismatches += succinct.getNextSibling(i) != siblingCache.getNextSibling(i);
+	}
+	h.enableDepthRangeIndex(true);
+	for (SizeType i = 0; i < tree_size; i++)
+	{
+		mismatches += succinct.getParent(i) != h.depthRangeParents[i];
+	}
+	printf("SuccinctHierarchy mismatches: %u\n", mismatches);
+	FLAT_ASSERT(mismatches == 0);
+
+	FLAT_VECTOR<SizeType> queries;
+	for (SizeType i = 0; i < query_count; i++)
+	{
+		queries.pushBack(Random::get(0, tree_size));
+	}
+
+	for (SizeType engine = 0; engine < engine_count; engine++)
+	{
+		double lastDescendantTime = 0;
+		double nextSiblingTime = 0;
+		double depthTime = 0;
+		double parentTime = 0;
+		SizeType checksum = 0;
+		if (engine != 2)
+		{
+			ScopedProfiler prof(&lastDescendantTime);
+			for (SizeType q = 0; q < query_count; q++)
+			{
+				checksum += engine == 0 ? h.getLastDescendant(queries[q]) : engine == 1 ? descendantCache.getLastDescendant(queries[q]) : succinct.getLastDescendant(queries[q]);
+			}
+		}
+		if (engine != 1)
+		{
+			ScopedProfiler prof(&nextSiblingTime);
+			for (SizeType q = 0; q < query_count; q++)
+			{
+				// Without a cache the next sibling is the node after the last descendant, if it is on the same depth
+				SizeType next = 0;
+				if (engine == 0)
+				{
+					next = h.getLastDescendant(queries[q]) + 1;
+					next = next < tree_size && h.depths[next] == h.depths[queries[q]] ? next : h.getIndexNotFound();
+				}
+				else
+				{
+					next = engine == 2 ? siblingCache.getNextSibling(queries[q]) : succinct.getNextSibling(queries[q]);
+				}
+				checksum += next;
+			}
+		}
+		if (engine == 0 || engine == 3)
+		{
+			ScopedProfiler prof(&depthTime);
+			for (SizeType q = 0; q < query_count; q++)
+			{
+				checksum += engine == 0 ? h.depths[queries[q]] : succinct.getDepth(queries[q]);
+			}
+		}
+		if (engine == 3)
+		{
+			ScopedProfiler prof(&parentTime);
+			for (SizeType q = 0; q < query_count; q++)
+			{
+				checksum += succinct.getParent(queries[q]);
+			}
+		}
+		printf("%s: %f bits per node, build %f, last descendant %f, next sibling %f, depth %f, parent %f, checksum: %u\n", engine_names[engine]
+			, byteCounts[engine] * 8 / tree_size, buildTimes[engine], lastDescendantTime, nextSiblingTime, depthTime, parentTime, checksum);
+	}
+	system("pause");
+}
@@ -6,6 +6,31 @@
 int main()
 {
 	//array_test();
+	//packed_test();
+	//depth_type_test();
+	//mixed_test();
+	//sibling_mixed_test();
+	//patched_cache_test();
+	//ancestor_cache_test();
+	//depth_count_test();
+	//depth_kernel_test();
+	//last_descendant_test();
+	//child_scan_test();
+	//descendant_filter_test();
+	//column_transform_test();
+	//scan_down_test();
+	//reduce_up_test();
+	//parallel_scan_test();
+	//dirty_update_test();
+	//cull_test();
+	//hit_test();
+	//lca_test();
+	//create_nodes_test();
+	//erase_many_test();
+	//batch_edit_test();
+	//succinct_test();
+	//depth_range_index_test();
+	//parallel_cache_test();
 	test();
     return 0;
 }